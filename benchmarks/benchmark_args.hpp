@@ -0,0 +1,57 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __UNIRENDER_BENCHMARK_ARGS_HPP__
+#define __UNIRENDER_BENCHMARK_ARGS_HPP__
+
+#include <cinttypes>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Command line helpers shared by the benchmark drivers. Arguments have the form --name=value.
+namespace unirender::benchmark {
+	inline std::optional<std::string_view> get_arg_value(std::string_view arg, std::string_view name)
+	{
+		if(arg.size() <= name.size() || arg.substr(0, name.size()) != name || arg[name.size()] != '=')
+			return {};
+		return arg.substr(name.size() + 1);
+	}
+
+	inline bool parse_uint(std::string_view value, uint32_t &outValue)
+	{
+		try {
+			size_t pos = 0;
+			auto v = std::stoul(std::string {value}, &pos);
+			if(pos != value.size())
+				return false;
+			outValue = static_cast<uint32_t>(v);
+			return true;
+		}
+		catch(const std::exception &) {
+			return false;
+		}
+	}
+
+	inline bool parse_double(std::string_view value, double &outValue)
+	{
+		try {
+			size_t pos = 0;
+			auto v = std::stod(std::string {value}, &pos);
+			if(pos != value.size())
+				return false;
+			outValue = v;
+			return true;
+		}
+		catch(const std::exception &) {
+			return false;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,8 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Benchmark harnesses for the benchmark drivers. Only built with UNIRENDER_BUILD_BENCHMARKS, so none of this ships with the runtime library.
+export module pragma.scenekit.benchmarks;
+export import :denoiser;
+export import :tile_manager;
@@ -0,0 +1,123 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Standalone driver for pragma::scenekit::DenoiserBenchmark, which doubles as a quality regression check: The process fails if any case
+// misses the regression thresholds, or falls behind the baseline (if one is specified).
+// Usage: unirender_denoiser_benchmark [--resolution=WxH]... [--iterations=N] [--threads=N] [--no-lightmap] [--min-psnr-gain=dB] [--min-ssim=X]
+//                                     [--baseline=<file>] [--max-slowdown=X] [--write-baseline=<file>] [--json]
+// A baseline is the JSON output of a previous run, written with --write-baseline.
+
+#include "benchmark_args.hpp"
+#include <sharedutils/magic_enum.hpp>
+#include <cinttypes>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+import pragma.scenekit;
+import pragma.scenekit.benchmarks;
+
+int main(int argc, char *argv[])
+{
+	using Benchmark = pragma::scenekit::DenoiserBenchmark;
+	using unirender::benchmark::get_arg_value;
+	using unirender::benchmark::parse_double;
+	using unirender::benchmark::parse_uint;
+	Benchmark::Settings settings {};
+	Benchmark::RegressionThresholds thresholds {};
+	std::vector<std::pair<uint32_t, uint32_t>> resolutions;
+	std::string baselinePath;
+	std::string writeBaselinePath;
+	auto printJson = false;
+	for(int i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		auto valid = true;
+		if(arg == "--json")
+			printJson = true;
+		else if(arg == "--no-lightmap")
+			settings.includeLightmap = false;
+		else if(auto v = get_arg_value(arg, "--resolution")) {
+			auto sep = v->find('x');
+			uint32_t w, h;
+			valid = (sep != std::string_view::npos) && parse_uint(v->substr(0, sep), w) && parse_uint(v->substr(sep + 1), h);
+			if(valid)
+				resolutions.push_back({w, h});
+		}
+		else if(auto v = get_arg_value(arg, "--iterations"))
+			valid = parse_uint(*v, settings.iterations);
+		else if(auto v = get_arg_value(arg, "--threads"))
+			valid = parse_uint(*v, settings.numThreads);
+		else if(auto v = get_arg_value(arg, "--min-psnr-gain"))
+			valid = parse_double(*v, thresholds.minPsnrGain);
+		else if(auto v = get_arg_value(arg, "--min-ssim"))
+			valid = parse_double(*v, thresholds.minSsim);
+		else if(auto v = get_arg_value(arg, "--max-slowdown"))
+			valid = parse_double(*v, thresholds.maxSlowdown);
+		else if(auto v = get_arg_value(arg, "--baseline"))
+			baselinePath = *v;
+		else if(auto v = get_arg_value(arg, "--write-baseline"))
+			writeBaselinePath = *v;
+		else
+			valid = false;
+		if(!valid) {
+			std::cout << "Invalid argument '" << arg << "'!" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if(!resolutions.empty())
+		settings.resolutions = std::move(resolutions);
+
+	std::optional<Benchmark::Result> baseline {};
+	if(!baselinePath.empty()) {
+		std::ifstream f {baselinePath};
+		if(!f) {
+			std::cout << "Unable to open baseline '" << baselinePath << "'!" << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::stringstream ss;
+		ss << f.rdbuf();
+		std::string err;
+		baseline = Benchmark::Result::FromJson(ss.str(), err);
+		if(!baseline) {
+			std::cout << "Unable to parse baseline '" << baselinePath << "': " << err << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::string err;
+	auto result = Benchmark::Run(settings, err);
+	if(!result) {
+		std::cout << "Denoiser benchmark failed: " << err << std::endl;
+		return EXIT_FAILURE;
+	}
+	for(auto &c : result->cases) {
+		std::cout << c.width << "x" << c.height << " " << magic_enum::enum_name(c.format) << " " << magic_enum::enum_name(c.auxInputs) << (c.lightmap ? " lightmap" : "") << ": ";
+		std::cout << std::chrono::duration<double, std::milli>(c.duration).count() << " ms (cold " << std::chrono::duration<double, std::milli>(c.coldDuration).count() << " ms), " << c.megapixelsPerSecond << " MPix/s, ";
+		std::cout << "PSNR " << c.psnrNoisy << " -> " << c.psnr << " dB, SSIM " << c.ssim << std::endl;
+	}
+	if(printJson)
+		std::cout << result->ToJson() << std::endl;
+	if(!writeBaselinePath.empty()) {
+		std::ofstream f {writeBaselinePath};
+		if(!(f << result->ToJson())) {
+			std::cout << "Unable to write baseline '" << writeBaselinePath << "'!" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	auto failures = Benchmark::CheckRegressions(*result, thresholds, baseline ? &*baseline : nullptr);
+	for(auto &failure : failures)
+		std::cout << "REGRESSION: " << failure << std::endl;
+	return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,456 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_buffer.hpp>
+#include <sharedutils/magic_enum.hpp>
+#include <cinttypes>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+module pragma.scenekit.benchmarks;
+
+import :denoiser;
+import pragma.scenekit;
+
+namespace {
+	struct SyntheticScene {
+		std::vector<float> groundTruth; // Packed RGB
+		std::vector<float> noisy;
+		std::vector<float> albedo;
+		std::vector<float> normal;
+	};
+	class Xorshift {
+	  public:
+		Xorshift(uint32_t seed) : m_state {seed ? seed : 1u} {}
+		float NextUniform()
+		{
+			m_state ^= m_state << 13;
+			m_state ^= m_state >> 17;
+			m_state ^= m_state << 5;
+			return (static_cast<float>(m_state >> 8) + 0.5f) / 16'777'216.f;
+		}
+		float NextGaussian()
+		{
+			auto u0 = NextUniform();
+			auto u1 = NextUniform();
+			return std::sqrt(-2.f * std::log(u0)) * std::cos(6.2831853f * u1);
+		}
+	  private:
+		uint32_t m_state;
+	};
+
+	// Checkerboard of materials with different albedos and normals, lit by smooth gradients and a soft highlight.
+	// The noise is relative to the pixel value and has occasional fireflies, similar to a path tracer at low sample counts.
+	SyntheticScene generate_synthetic_scene(uint32_t w, uint32_t h, float noiseLevel, uint32_t seed)
+	{
+		constexpr uint32_t cellSize = 48;
+		constexpr float albedos[4][3] = {{0.8f, 0.2f, 0.2f}, {0.2f, 0.7f, 0.3f}, {0.25f, 0.3f, 0.8f}, {0.75f, 0.75f, 0.7f}};
+		constexpr float normals[4][3] = {{0.f, 0.f, 1.f}, {0.6f, 0.f, 0.8f}, {0.f, 0.6f, 0.8f}, {-0.6f, 0.f, 0.8f}};
+		SyntheticScene scene {};
+		auto numValues = static_cast<size_t>(w) * h * 3;
+		scene.groundTruth.resize(numValues);
+		scene.noisy.resize(numValues);
+		scene.albedo.resize(numValues);
+		scene.normal.resize(numValues);
+		Xorshift rng {seed};
+		for(uint32_t y = 0; y < h; ++y) {
+			for(uint32_t x = 0; x < w; ++x) {
+				auto idx = (static_cast<size_t>(y) * w + x) * 3;
+				auto material = ((x / cellSize) + 2 * (y / cellSize)) % 4;
+				auto u = static_cast<float>(x) / static_cast<float>(w);
+				auto v = static_cast<float>(y) / static_cast<float>(h);
+				auto dx = u - 0.35f;
+				auto dy = v - 0.4f;
+				auto lighting = 0.3f + 0.5f * (1.f - v) + 0.4f * std::exp(-(dx * dx + dy * dy) * 20.f);
+				lighting *= 0.75f + 0.25f * normals[material][2];
+				auto noise = noiseLevel * rng.NextGaussian();
+				if(rng.NextUniform() < 0.001f)
+					noise += 10.f; // Firefly
+				for(uint32_t c = 0; c < 3; ++c) {
+					auto value = std::min(albedos[material][c] * lighting, 1.f);
+					scene.groundTruth[idx + c] = value;
+					scene.noisy[idx + c] = std::max(value * (1.f + noise + noiseLevel * 0.5f * rng.NextGaussian()), 0.f);
+					scene.albedo[idx + c] = albedos[material][c];
+					scene.normal[idx + c] = normals[material][c];
+				}
+			}
+		}
+		return scene;
+	}
+
+	uint32_t get_channel_count(uimg::Format format) { return static_cast<uint32_t>(uimg::ImageBuffer::GetPixelSize(format) / ((format == uimg::Format::RGBA16 || format == uimg::Format::RGB16) ? sizeof(uint16_t) : sizeof(float))); }
+	bool is_half_format(uimg::Format format) { return format == uimg::Format::RGBA16 || format == uimg::Format::RGB16; }
+	std::vector<uint8_t> convert_to_format(const std::vector<float> &rgb, uimg::Format format)
+	{
+		auto numPixels = rgb.size() / 3;
+		auto numChannels = get_channel_count(format);
+		auto half = is_half_format(format);
+		std::vector<uint8_t> data(numPixels * uimg::ImageBuffer::GetPixelSize(format));
+		for(size_t i = 0; i < numPixels; ++i) {
+			for(uint32_t c = 0; c < numChannels; ++c) {
+				auto value = (c < 3) ? rgb[i * 3 + c] : 1.f;
+				if(half)
+					reinterpret_cast<uint16_t *>(data.data())[i * numChannels + c] = pragma::scenekit::tile_kernels::float_to_half(value);
+				else
+					reinterpret_cast<float *>(data.data())[i * numChannels + c] = value;
+			}
+		}
+		return data;
+	}
+	std::vector<float> convert_to_rgb(const std::vector<uint8_t> &data, uimg::Format format)
+	{
+		auto numChannels = get_channel_count(format);
+		auto half = is_half_format(format);
+		auto numPixels = data.size() / uimg::ImageBuffer::GetPixelSize(format);
+		std::vector<float> rgb(numPixels * 3);
+		for(size_t i = 0; i < numPixels; ++i) {
+			for(uint32_t c = 0; c < 3; ++c) {
+				auto idx = i * numChannels + c;
+				rgb[i * 3 + c] = half ? pragma::scenekit::tile_kernels::half_to_float(reinterpret_cast<const uint16_t *>(data.data())[idx]) : reinterpret_cast<const float *>(data.data())[idx];
+			}
+		}
+		return rgb;
+	}
+};
+
+double pragma::scenekit::DenoiserBenchmark::CalcPsnr(const float *rgb, const float *rgbReference, uint32_t width, uint32_t height)
+{
+	auto numValues = static_cast<size_t>(width) * height * 3;
+	if(numValues == 0)
+		return 0.0;
+	double sqErrorSum = 0.0;
+	for(size_t i = 0; i < numValues; ++i) {
+		auto diff = static_cast<double>(std::clamp(rgb[i], 0.f, 1.f)) - std::clamp(rgbReference[i], 0.f, 1.f);
+		sqErrorSum += diff * diff;
+	}
+	auto mse = sqErrorSum / static_cast<double>(numValues);
+	if(mse <= 0.0)
+		return std::numeric_limits<double>::infinity();
+	return 10.0 * std::log10(1.0 / mse);
+}
+
+double pragma::scenekit::DenoiserBenchmark::CalcSsim(const float *rgb, const float *rgbReference, uint32_t width, uint32_t height)
+{
+	constexpr uint32_t windowSize = 8;
+	constexpr uint32_t stride = 4;
+	constexpr double c1 = 0.01 * 0.01;
+	constexpr double c2 = 0.03 * 0.03;
+	if(width < windowSize || height < windowSize)
+		return 0.0;
+	auto getLuminance = [](const float *px) { return 0.2126 * std::clamp(px[0], 0.f, 1.f) + 0.7152 * std::clamp(px[1], 0.f, 1.f) + 0.0722 * std::clamp(px[2], 0.f, 1.f); };
+	double ssimSum = 0.0;
+	uint32_t numWindows = 0;
+	for(uint32_t wy = 0; wy + windowSize <= height; wy += stride) {
+		for(uint32_t wx = 0; wx + windowSize <= width; wx += stride) {
+			double sumA = 0.0, sumB = 0.0, sumAA = 0.0, sumBB = 0.0, sumAB = 0.0;
+			for(uint32_t y = wy; y < wy + windowSize; ++y) {
+				for(uint32_t x = wx; x < wx + windowSize; ++x) {
+					auto idx = (static_cast<size_t>(y) * width + x) * 3;
+					auto a = getLuminance(rgb + idx);
+					auto b = getLuminance(rgbReference + idx);
+					sumA += a;
+					sumB += b;
+					sumAA += a * a;
+					sumBB += b * b;
+					sumAB += a * b;
+				}
+			}
+			constexpr auto n = static_cast<double>(windowSize * windowSize);
+			auto meanA = sumA / n;
+			auto meanB = sumB / n;
+			auto varA = sumAA / n - meanA * meanA;
+			auto varB = sumBB / n - meanB * meanB;
+			auto covAB = sumAB / n - meanA * meanB;
+			ssimSum += ((2.0 * meanA * meanB + c1) * (2.0 * covAB + c2)) / ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+			++numWindows;
+		}
+	}
+	return ssimSum / static_cast<double>(numWindows);
+}
+
+std::optional<pragma::scenekit::DenoiserBenchmark::Result> pragma::scenekit::DenoiserBenchmark::Run(const Settings &settings, std::string &outErr)
+{
+	if(settings.resolutions.empty() || settings.formats.empty() || settings.iterations == 0) {
+		outErr = "Invalid benchmark settings!";
+		return {};
+	}
+	for(auto format : settings.formats) {
+		switch(format) {
+		case uimg::Format::RGB32:
+		case uimg::Format::RGBA32:
+		case uimg::Format::RGB16:
+		case uimg::Format::RGBA16:
+			break;
+		default:
+			outErr = "Unsupported benchmark format " + std::string {magic_enum::enum_name(format)} + "!";
+			return {};
+		}
+	}
+
+	Result result {};
+	for(auto &[w, h] : settings.resolutions) {
+		if(w == 0 || h == 0) {
+			outErr = "Invalid benchmark resolution!";
+			return {};
+		}
+		auto scene = generate_synthetic_scene(w, h, settings.noiseLevel, settings.seed);
+		auto psnrNoisy = CalcPsnr(scene.noisy.data(), scene.groundTruth.data(), w, h);
+		for(auto format : settings.formats) {
+			auto noisyData = convert_to_format(scene.noisy, format);
+			auto albedoData = convert_to_format(scene.albedo, format);
+			auto normalData = convert_to_format(scene.normal, format);
+			std::vector<uint8_t> outputData(noisyData.size());
+
+			auto runCase = [&](AuxInputs auxInputs, bool lightmap) -> bool {
+				denoise::Info info {};
+				info.width = w;
+				info.height = h;
+				info.lightmap = lightmap;
+				info.numThreads = settings.numThreads;
+
+				denoise::ImageInputs inputs {};
+				inputs.beautyImage = {noisyData.data(), format};
+				if(auxInputs != AuxInputs::None)
+					inputs.albedoImage = {albedoData.data(), format};
+				if(auxInputs == AuxInputs::AlbedoNormal)
+					inputs.normalImage = {normalData.data(), format};
+				denoise::ImageData output {outputData.data(), format};
+
+				// A separate cache per case, so the cold run includes the device and filter creation
+				denoise::DenoiserCache cache {};
+				denoise::Denoiser denoiser {cache};
+				Case c {};
+				c.width = w;
+				c.height = h;
+				c.format = format;
+				c.auxInputs = auxInputs;
+				c.lightmap = lightmap;
+				c.psnrNoisy = psnrNoisy;
+				auto tStart = std::chrono::steady_clock::now();
+				if(!denoiser.Denoise(info, inputs, output)) {
+					outErr = "Denoising failed for " + std::to_string(w) + "x" + std::to_string(h) + " " + std::string {magic_enum::enum_name(format)} + "!";
+					return false;
+				}
+				auto tEnd = std::chrono::steady_clock::now();
+				c.coldDuration = std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - tStart);
+
+				tStart = std::chrono::steady_clock::now();
+				for(uint32_t i = 0; i < settings.iterations; ++i) {
+					// A failed run would skew the timings and leave a stale output behind, so the whole case has to fail
+					if(!denoiser.Denoise(info, inputs, output)) {
+						outErr = "Denoising failed for " + std::to_string(w) + "x" + std::to_string(h) + " " + std::string {magic_enum::enum_name(format)} + " in timed run " + std::to_string(i) + "!";
+						return false;
+					}
+				}
+				tEnd = std::chrono::steady_clock::now();
+				c.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - tStart) / settings.iterations;
+				auto seconds = std::chrono::duration<double>(c.duration).count();
+				c.megapixelsPerSecond = (seconds > 0.0) ? (static_cast<double>(w) * h / 1'000'000.0 / seconds) : 0.0;
+
+				auto denoised = convert_to_rgb(outputData, format);
+				c.psnr = CalcPsnr(denoised.data(), scene.groundTruth.data(), w, h);
+				c.ssim = CalcSsim(denoised.data(), scene.groundTruth.data(), w, h);
+				result.cases.push_back(c);
+				return true;
+			};
+			for(auto auxInputs : settings.auxInputs) {
+				if(!runCase(auxInputs, false))
+					return {};
+			}
+			if(settings.includeLightmap && !runCase(AuxInputs::None, true))
+				return {};
+		}
+	}
+	return result;
+}
+
+std::string pragma::scenekit::DenoiserBenchmark::Result::ToJson() const
+{
+	// Durations are written in milliseconds
+	auto toMs = [](std::chrono::nanoseconds t) { return static_cast<double>(t.count()) / 1'000'000.0; };
+	std::stringstream ss;
+	ss << "{\"cases\":[";
+	for(size_t i = 0; i < cases.size(); ++i) {
+		auto &c = cases[i];
+		if(i > 0)
+			ss << ",";
+		ss << "{\"width\":" << c.width << ",\"height\":" << c.height;
+		ss << ",\"format\":\"" << magic_enum::enum_name(c.format) << "\"";
+		ss << ",\"aux_inputs\":\"" << magic_enum::enum_name(c.auxInputs) << "\"";
+		ss << ",\"lightmap\":" << (c.lightmap ? "true" : "false");
+		ss << ",\"cold_ms\":" << toMs(c.coldDuration);
+		ss << ",\"mean_ms\":" << toMs(c.duration);
+		ss << ",\"mpix_per_s\":" << c.megapixelsPerSecond;
+		ss << ",\"psnr_noisy_db\":" << c.psnrNoisy;
+		ss << ",\"psnr_db\":" << c.psnr;
+		ss << ",\"ssim\":" << c.ssim;
+		ss << "}";
+	}
+	ss << "]}";
+	return ss.str();
+}
+
+std::optional<pragma::scenekit::DenoiserBenchmark::Result> pragma::scenekit::DenoiserBenchmark::Result::FromJson(const std::string &json, std::string &outErr)
+{
+	// Only has to understand the flat layout written by ToJson
+	size_t pos = 0;
+	auto skipWhitespace = [&]() {
+		while(pos < json.size() && std::isspace(static_cast<unsigned char>(json[pos])))
+			++pos;
+	};
+	auto readString = [&](std::string &outStr) -> bool {
+		if(pos >= json.size() || json[pos] != '"')
+			return false;
+		auto end = json.find('"', pos + 1);
+		if(end == std::string::npos)
+			return false;
+		outStr = json.substr(pos + 1, end - pos - 1);
+		pos = end + 1;
+		return true;
+	};
+	pos = json.find("\"cases\"");
+	if(pos != std::string::npos)
+		pos = json.find('[', pos);
+	if(pos == std::string::npos) {
+		outErr = "Missing cases array!";
+		return {};
+	}
+	++pos;
+	Result result {};
+	auto fromMs = [](double ms) { return std::chrono::nanoseconds {static_cast<int64_t>(ms * 1'000'000.0)}; };
+	for(;;) {
+		skipWhitespace();
+		if(pos < json.size() && json[pos] == ',') {
+			++pos;
+			skipWhitespace();
+		}
+		if(pos < json.size() && json[pos] == ']')
+			break;
+		if(pos >= json.size() || json[pos] != '{') {
+			outErr = "Expected case object at offset " + std::to_string(pos) + "!";
+			return {};
+		}
+		++pos;
+		Case c {};
+		for(;;) {
+			skipWhitespace();
+			if(pos < json.size() && json[pos] == ',') {
+				++pos;
+				skipWhitespace();
+			}
+			if(pos < json.size() && json[pos] == '}') {
+				++pos;
+				break;
+			}
+			std::string key;
+			if(!readString(key)) {
+				outErr = "Expected key at offset " + std::to_string(pos) + "!";
+				return {};
+			}
+			skipWhitespace();
+			if(pos >= json.size() || json[pos] != ':') {
+				outErr = "Expected ':' after key '" + key + "'!";
+				return {};
+			}
+			++pos;
+			skipWhitespace();
+			std::string value;
+			if(pos < json.size() && json[pos] == '"') {
+				if(!readString(value)) {
+					outErr = "Unterminated value for key '" + key + "'!";
+					return {};
+				}
+			}
+			else {
+				auto end = json.find_first_of(",}", pos);
+				if(end == std::string::npos) {
+					outErr = "Unterminated value for key '" + key + "'!";
+					return {};
+				}
+				value = json.substr(pos, end - pos);
+				while(!value.empty() && std::isspace(static_cast<unsigned char>(value.back())))
+					value.pop_back();
+				pos = end;
+			}
+			auto toNumber = [&value]() { return std::strtod(value.c_str(), nullptr); };
+			if(key == "width")
+				c.width = static_cast<uint32_t>(toNumber());
+			else if(key == "height")
+				c.height = static_cast<uint32_t>(toNumber());
+			else if(key == "format") {
+				auto format = magic_enum::enum_cast<uimg::Format>(value);
+				if(!format.has_value()) {
+					outErr = "Unknown format '" + value + "'!";
+					return {};
+				}
+				c.format = *format;
+			}
+			else if(key == "aux_inputs") {
+				auto auxInputs = magic_enum::enum_cast<AuxInputs>(value);
+				if(!auxInputs.has_value()) {
+					outErr = "Unknown auxiliary inputs '" + value + "'!";
+					return {};
+				}
+				c.auxInputs = *auxInputs;
+			}
+			else if(key == "lightmap")
+				c.lightmap = (value == "true");
+			else if(key == "cold_ms")
+				c.coldDuration = fromMs(toNumber());
+			else if(key == "mean_ms")
+				c.duration = fromMs(toNumber());
+			else if(key == "mpix_per_s")
+				c.megapixelsPerSecond = toNumber();
+			else if(key == "psnr_noisy_db")
+				c.psnrNoisy = toNumber();
+			else if(key == "psnr_db")
+				c.psnr = toNumber();
+			else if(key == "ssim")
+				c.ssim = toNumber();
+		}
+		result.cases.push_back(c);
+	}
+	return result;
+}
+
+std::vector<std::string> pragma::scenekit::DenoiserBenchmark::CheckRegressions(const Result &result, const RegressionThresholds &thresholds, const Result *optBaseline)
+{
+	std::vector<std::string> failures;
+	for(auto &c : result.cases) {
+		auto name = std::to_string(c.width) + "x" + std::to_string(c.height) + " " + std::string {magic_enum::enum_name(c.format)} + " " + std::string {magic_enum::enum_name(c.auxInputs)} + (c.lightmap ? " lightmap" : "");
+		auto addFailure = [&](const std::string &msg) { failures.push_back(name + ": " + msg); };
+		if(c.psnr - c.psnrNoisy < thresholds.minPsnrGain)
+			addFailure("PSNR gain of " + std::to_string(c.psnr - c.psnrNoisy) + " dB is below " + std::to_string(thresholds.minPsnrGain) + " dB");
+		if(c.ssim < thresholds.minSsim)
+			addFailure("SSIM of " + std::to_string(c.ssim) + " is below " + std::to_string(thresholds.minSsim));
+		if(!optBaseline)
+			continue;
+		auto it = std::find_if(optBaseline->cases.begin(), optBaseline->cases.end(), [&c](const Case &other) {
+			return other.width == c.width && other.height == c.height && other.format == c.format && other.auxInputs == c.auxInputs && other.lightmap == c.lightmap;
+		});
+		if(it == optBaseline->cases.end())
+			continue;
+		if(c.psnr < it->psnr - thresholds.psnrTolerance)
+			addFailure("PSNR of " + std::to_string(c.psnr) + " dB is more than " + std::to_string(thresholds.psnrTolerance) + " dB below the baseline (" + std::to_string(it->psnr) + " dB)");
+		if(c.ssim < it->ssim - thresholds.ssimTolerance)
+			addFailure("SSIM of " + std::to_string(c.ssim) + " is more than " + std::to_string(thresholds.ssimTolerance) + " below the baseline (" + std::to_string(it->ssim) + ")");
+		if(thresholds.maxSlowdown > 0.0 && it->duration.count() > 0 && static_cast<double>(c.duration.count()) > static_cast<double>(it->duration.count()) * thresholds.maxSlowdown)
+			addFailure("Mean duration is more than " + std::to_string(thresholds.maxSlowdown) + " times the baseline");
+	}
+	return failures;
+}
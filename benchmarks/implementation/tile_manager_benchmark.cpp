@@ -0,0 +1,399 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <util_image_types.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIRENDER_BENCHMARK_TSC
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define UNIRENDER_BENCHMARK_TSC
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <psapi.h>
+#endif
+
+module pragma.scenekit.benchmarks;
+
+import :tile_manager;
+import pragma.scenekit;
+
+uint64_t pragma::scenekit::TileManagerBenchmark::GetPeakResidentSetSize()
+{
+#ifdef __linux__
+	rusage usage {};
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1'024; // Kilobytes on Linux
+#elif defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters {};
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	return 0;
+#endif
+}
+
+// Fills a tile with a smooth gradient and per-sample noise, so every sample actually changes the tile contents
+static void fill_synthetic_tile(float *data, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t sample)
+{
+	auto seed = (x * 73'856'093u) ^ (y * 19'349'663u) ^ (sample * 83'492'791u);
+	for(uint32_t py = 0; py < h; ++py) {
+		for(uint32_t px = 0; px < w; ++px, data += 4) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			auto noise = static_cast<float>(seed & 0xFFFF) / 65'535.f - 0.5f;
+			data[0] = static_cast<float>(x + px) / 1'024.f + noise * 0.2f;
+			data[1] = static_cast<float>(y + py) / 1'024.f + noise * 0.2f;
+			data[2] = 0.5f + noise * 0.2f;
+			data[3] = 1.f;
+		}
+	}
+}
+
+std::optional<pragma::scenekit::TileManagerBenchmark::Result> pragma::scenekit::TileManagerBenchmark::Run(const Settings &settings, std::string &outErr)
+{
+	if(settings.width == 0 || settings.height == 0 || settings.tileWidth == 0 || settings.tileHeight == 0 || settings.producerThreadCount == 0) {
+		outErr = "Invalid benchmark settings!";
+		return {};
+	}
+	std::shared_ptr<util::ocio::ColorProcessor> colorProcessor = nullptr;
+	if(settings.colorTransform.has_value()) {
+		colorProcessor = create_color_transform_processor(*settings.colorTransform, outErr);
+		if(!colorProcessor)
+			return {};
+	}
+
+	auto tileManager = std::make_unique<TileManager>();
+	tileManager->Initialize(settings.width, settings.height, settings.tileWidth, settings.tileHeight, true, 0.f, DEFAULT_GAMMA, colorProcessor.get(), settings.tileManagerSettings);
+	auto numTilesPerAxis = tileManager->GetTilesPerAxisCount();
+	// Producers follow the dispatch order of the tile manager, just like a render device would
+	auto dispatchOrder = tileManager->GetTileDispatchOrder();
+	tileManager->ResetStatistics();
+
+	auto tStart = std::chrono::steady_clock::now();
+	std::atomic<uint32_t> activeProducers = settings.producerThreadCount;
+	std::vector<std::thread> producers;
+	producers.reserve(settings.producerThreadCount);
+	for(uint32_t threadIdx = 0; threadIdx < settings.producerThreadCount; ++threadIdx) {
+		producers.emplace_back([&, threadIdx]() {
+			for(uint32_t sample = 0; sample < settings.sampleCount; ++sample) {
+				for(auto i = threadIdx; i < dispatchOrder.size(); i += settings.producerThreadCount) {
+					auto tileIndex = dispatchOrder[i];
+					TileManager::TileData tile {};
+					tile.x = static_cast<uint16_t>((tileIndex % numTilesPerAxis.x) * settings.tileWidth);
+					tile.y = static_cast<uint16_t>((tileIndex / numTilesPerAxis.x) * settings.tileHeight);
+					tile.w = static_cast<uint16_t>(std::min<uint32_t>(settings.tileWidth, settings.width - tile.x));
+					tile.h = static_cast<uint16_t>(std::min<uint32_t>(settings.tileHeight, settings.height - tile.y));
+					tile.sample = static_cast<uint16_t>(sample);
+					tile.index = static_cast<uint16_t>(tileIndex);
+					tile.data = tileManager->AcquireTileBuffer(tile.w, tile.h);
+					fill_synthetic_tile(reinterpret_cast<float *>(tile.data.data()), tile.x, tile.y, tile.w, tile.h, sample);
+					tileManager->AddInputTile(std::move(tile));
+				}
+			}
+			--activeProducers;
+		});
+	}
+
+	// Emulated viewer
+	auto &stats = tileManager->GetStatistics();
+	auto isComplete = [&]() {
+		if(activeProducers > 0)
+			return false;
+		auto numReceived = stats.GetCounter(TileStatistics::Counter::TilesReceived);
+		auto numFinished = stats.GetCounter(TileStatistics::Counter::TilesProcessed) + stats.GetCounter(TileStatistics::Counter::TilesDiscarded) + stats.GetCounter(TileStatistics::Counter::TilesSuperseded);
+		return numFinished >= numReceived;
+	};
+	for(;;) {
+		auto complete = isComplete();
+		tileManager->ReleaseTileBatch(tileManager->GetRenderedTileBatch());
+		if(complete)
+			break;
+		std::this_thread::sleep_for(settings.consumerPollInterval);
+	}
+	auto tEnd = std::chrono::steady_clock::now();
+	for(auto &t : producers)
+		t.join();
+
+	Result result {};
+	result.tilesProduced = stats.GetCounter(TileStatistics::Counter::TilesReceived);
+	result.tilesProcessed = stats.GetCounter(TileStatistics::Counter::TilesProcessed);
+	result.tilesDelivered = stats.GetCounter(TileStatistics::Counter::TilesDelivered);
+	result.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - tStart);
+	auto seconds = std::chrono::duration<double>(result.duration).count();
+	result.tilesPerSecond = (seconds > 0.0) ? (result.tilesProcessed / seconds) : 0.0;
+	auto &latency = stats.GetHistogram(TileStatistics::Stage::Total);
+	result.latencyP50 = latency.GetPercentile(50.0);
+	result.latencyP99 = latency.GetPercentile(99.0);
+	result.statisticsJson = tileManager->GetStatisticsJson();
+	tileManager->Cancel();
+	tileManager->Wait();
+	tileManager = nullptr;
+	result.peakResidentSetSize = GetPeakResidentSetSize();
+	return result;
+}
+
+pragma::scenekit::TileManagerBenchmark::QueueContentionResult pragma::scenekit::TileManagerBenchmark::RunQueueContention(const QueueContentionSettings &settings)
+{
+	QueueContentionResult result {};
+	auto numProducers = std::max(settings.producerThreadCount, 1u);
+	auto numConsumers = std::max(settings.consumerThreadCount, 1u);
+	auto numTiles = static_cast<uint64_t>(numProducers) * settings.tilesPerProducer;
+	auto tileSize = static_cast<size_t>(settings.tileWidth) * settings.tileHeight * 4 * sizeof(float);
+	// Every producer owns a range of tile slots, like the tiles of a render device
+	constexpr uint32_t SLOTS_PER_PRODUCER = 64;
+	auto makeTile = [&settings, tileSize](uint32_t index, uint32_t sample) {
+		TileManager::TileData tile {};
+		tile.w = static_cast<uint16_t>(settings.tileWidth);
+		tile.h = static_cast<uint16_t>(settings.tileHeight);
+		tile.index = static_cast<uint16_t>(index);
+		tile.sample = static_cast<uint16_t>(sample);
+		tile.data.resize(tileSize, static_cast<uint8_t>(sample));
+		return tile;
+	};
+	auto run = [numProducers, numConsumers, numTiles](const std::function<void(uint32_t)> &produce, const std::function<void(std::atomic<uint64_t> &, std::atomic<uint64_t> &)> &consume) {
+		std::atomic<uint64_t> numConsumed = 0;
+		std::atomic<uint64_t> checksum = 0;
+		std::vector<std::thread> threads;
+		threads.reserve(numProducers + numConsumers);
+		auto tStart = std::chrono::steady_clock::now();
+		for(uint32_t i = 0; i < numConsumers; ++i)
+			threads.emplace_back([&]() { consume(numConsumed, checksum); });
+		for(uint32_t i = 0; i < numProducers; ++i)
+			threads.emplace_back(produce, i);
+		for(auto &t : threads)
+			t.join();
+		QueueContentionResult::Entry entry {};
+		entry.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart);
+		auto seconds = std::chrono::duration<double>(entry.duration).count();
+		entry.tilesPerSecond = (seconds > 0.0) ? (numTiles / seconds) : 0.0;
+		return entry;
+	};
+
+	{
+		std::mutex mutex;
+		std::vector<TileManager::TileData> slots(numProducers * SLOTS_PER_PRODUCER);
+		std::queue<size_t> queue;
+		result.mutexQueue = run(
+		  [&](uint32_t producerIdx) {
+			  for(uint32_t i = 0; i < settings.tilesPerProducer; ++i) {
+				  auto index = producerIdx * SLOTS_PER_PRODUCER + (i % SLOTS_PER_PRODUCER);
+				  auto tile = makeTile(index, i);
+				  std::scoped_lock lock {mutex};
+				  slots[index] = std::move(tile);
+				  queue.push(index);
+			  }
+		  },
+		  [&](std::atomic<uint64_t> &numConsumed, std::atomic<uint64_t> &checksum) {
+			  while(numConsumed < numTiles) {
+				  TileManager::TileData tile;
+				  auto popped = false;
+				  {
+					  std::scoped_lock lock {mutex};
+					  if(!queue.empty()) {
+						  auto index = queue.front();
+						  queue.pop();
+						  tile = slots[index];
+						  popped = true;
+					  }
+				  }
+				  if(!popped) {
+					  // Same back-off as the MpmcQueue consumers, so idle consumers don't keep the producers from acquiring the mutex
+					  std::this_thread::yield();
+					  continue;
+				  }
+				  checksum += tile.data.front();
+				  ++numConsumed;
+			  }
+		  });
+	}
+	{
+		MpmcQueue<TileManager::TileData> queue {static_cast<size_t>(numProducers) * SLOTS_PER_PRODUCER * 4};
+		result.mpmcQueue = run(
+		  [&](uint32_t producerIdx) {
+			  for(uint32_t i = 0; i < settings.tilesPerProducer; ++i) {
+				  auto tile = makeTile(producerIdx * SLOTS_PER_PRODUCER + (i % SLOTS_PER_PRODUCER), i);
+				  while(!queue.TryPush(std::move(tile)))
+					  std::this_thread::yield();
+			  }
+		  },
+		  [&](std::atomic<uint64_t> &numConsumed, std::atomic<uint64_t> &checksum) {
+			  TileManager::TileData tile;
+			  while(numConsumed < numTiles) {
+				  if(!queue.TryPop(tile)) {
+					  std::this_thread::yield();
+					  continue;
+				  }
+				  checksum += tile.data.front();
+				  ++numConsumed;
+			  }
+		  });
+	}
+	return result;
+}
+
+namespace {
+	// Unfused reference: Flip, clear alpha and copy into the destination rectangle as separate passes
+	template<typename T>
+	void reference_blit_tile(const T *src, uint32_t w, uint32_t h, T *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha, T alphaOne)
+	{
+		std::vector<T> tmp(src, src + static_cast<size_t>(w) * h * 4);
+		std::vector<T> flipped(tmp.size());
+		for(uint32_t y = 0; y < h; ++y) {
+			for(uint32_t x = 0; x < w; ++x) {
+				auto srcX = flipHorizontally ? (w - 1 - x) : x;
+				auto srcY = flipVertically ? (h - 1 - y) : y;
+				std::memcpy(&flipped[(static_cast<size_t>(y) * w + x) * 4], &tmp[(static_cast<size_t>(srcY) * w + srcX) * 4], sizeof(T) * 4);
+			}
+		}
+		if(clearAlpha) {
+			for(size_t i = 3; i < flipped.size(); i += 4)
+				flipped[i] = alphaOne;
+		}
+		for(uint32_t y = 0; y < h; ++y)
+			std::memcpy(dst + static_cast<size_t>(y) * dstRowPixelCount * 4, &flipped[static_cast<size_t>(y) * w * 4], sizeof(T) * w * 4);
+	}
+	template<typename T>
+	uint64_t count_mismatches(const std::vector<T> &a, const std::vector<T> &b)
+	{
+		uint64_t n = 0;
+		for(size_t i = 0; i < a.size(); ++i) {
+			if(std::memcmp(&a[i], &b[i], sizeof(T)) != 0)
+				++n;
+		}
+		return n;
+	}
+	uint64_t read_time_stamp_counter()
+	{
+#ifdef UNIRENDER_BENCHMARK_TSC
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+};
+
+std::vector<pragma::scenekit::TileManagerBenchmark::KernelResult> pragma::scenekit::TileManagerBenchmark::RunKernels(const KernelSettings &settings)
+{
+	std::vector<KernelResult> results;
+	auto w = std::max(settings.tileWidth, 1u);
+	auto h = std::max(settings.tileHeight, 1u);
+	auto iterations = std::max(settings.iterations, 1u);
+	auto numValues = static_cast<size_t>(w) * h * 4;
+	// The destination rectangle is part of an image that is twice as wide as the tile, like a tile within the progressive image
+	auto dstRowPixelCount = w * 2;
+	auto numDstValues = static_cast<size_t>(dstRowPixelCount) * h * 4;
+
+	std::vector<float> src32(numValues);
+	fill_synthetic_tile(src32.data(), 0, 0, w, h, 0);
+	for(size_t i = 3; i < src32.size(); i += 4)
+		src32[i] = 0.5f; // Has to be cleared by the kernels
+	std::vector<uint16_t> src16(numValues);
+	tile_kernels::convert_float_to_half(src32.data(), src16.data(), numValues);
+
+	auto measure = [&](const std::string &name, uint64_t bytesPerTile, const std::function<void()> &kernel, const std::function<uint64_t()> &verify) {
+		kernel(); // Warm-up
+		auto tStart = std::chrono::steady_clock::now();
+		auto cStart = read_time_stamp_counter();
+		for(uint32_t i = 0; i < iterations; ++i)
+			kernel();
+		auto cEnd = read_time_stamp_counter();
+		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart);
+		KernelResult result {};
+		result.name = name;
+		result.bytesPerTile = bytesPerTile;
+		result.durationPerTile = duration / iterations;
+		auto totalBytes = static_cast<double>(bytesPerTile) * iterations;
+		result.nanosecondsPerByte = duration.count() / totalBytes;
+		result.cyclesPerByte = (cEnd - cStart) / totalBytes;
+		result.mismatchCount = verify();
+		results.push_back(result);
+	};
+
+	// Float tiles
+	{
+		std::vector<float> dst(numDstValues, 0.f);
+		std::vector<float> ref(numDstValues, 0.f);
+		reference_blit_tile(src32.data(), w, h, ref.data(), dstRowPixelCount, settings.flipHorizontally, settings.flipVertically, true, 1.f);
+		auto bytes = numValues * sizeof(float) * 2;
+		measure("blit_tile_rgba32f", bytes, [&]() { tile_kernels::blit_tile_rgba32f(src32.data(), w, h, dst.data(), dstRowPixelCount, settings.flipHorizontally, settings.flipVertically); }, [&]() { return count_mismatches(dst, ref); });
+
+		std::vector<float> refDst(numDstValues, 0.f);
+		measure(
+		  "reference_blit_rgba32f", bytes, [&]() { reference_blit_tile(src32.data(), w, h, refDst.data(), dstRowPixelCount, settings.flipHorizontally, settings.flipVertically, true, 1.f); }, [&]() { return count_mismatches(refDst, ref); });
+
+		std::vector<float> inPlace = src32;
+		std::vector<float> inPlaceRef(numValues);
+		reference_blit_tile(src32.data(), w, h, inPlaceRef.data(), w, settings.flipHorizontally, settings.flipVertically, true, 1.f);
+		measure(
+		  "transform_tile_rgba32f", numValues * sizeof(float) * 2,
+		  [&]() {
+			  // An even number of flips restores the original tile, so every iteration operates on the same data
+			  tile_kernels::transform_tile_rgba32f(inPlace.data(), w, h, settings.flipHorizontally, settings.flipVertically);
+		  },
+		  [&]() {
+			  inPlace = src32;
+			  tile_kernels::transform_tile_rgba32f(inPlace.data(), w, h, settings.flipHorizontally, settings.flipVertically);
+			  return count_mismatches(inPlace, inPlaceRef);
+		  });
+	}
+	// Half tiles
+	{
+		std::vector<uint16_t> dst(numDstValues, 0);
+		std::vector<uint16_t> ref(numDstValues, 0);
+		reference_blit_tile(src16.data(), w, h, ref.data(), dstRowPixelCount, settings.flipHorizontally, settings.flipVertically, true, tile_kernels::float_to_half(1.f));
+		measure(
+		  "blit_tile_rgba16f", numValues * sizeof(uint16_t) * 2, [&]() { tile_kernels::blit_tile_rgba16f(src16.data(), w, h, dst.data(), dstRowPixelCount, settings.flipHorizontally, settings.flipVertically); },
+		  [&]() { return count_mismatches(dst, ref); });
+	}
+	// Precision conversion of completed tiles
+	{
+		std::vector<uint16_t> half(numValues);
+		std::vector<float> full(numValues);
+		measure(
+		  "convert_float_to_half", numValues * (sizeof(float) + sizeof(uint16_t)), [&]() { tile_kernels::convert_float_to_half(src32.data(), half.data(), numValues); },
+		  [&]() {
+			  uint64_t n = 0;
+			  for(size_t i = 0; i < numValues; ++i)
+				  n += (half[i] != tile_kernels::float_to_half(src32[i])) ? 1 : 0;
+			  return n;
+		  });
+		measure(
+		  "convert_half_to_float", numValues * (sizeof(float) + sizeof(uint16_t)), [&]() { tile_kernels::convert_half_to_float(src16.data(), full.data(), numValues); },
+		  [&]() {
+			  uint64_t n = 0;
+			  for(size_t i = 0; i < numValues; ++i)
+				  n += (full[i] != tile_kernels::half_to_float(src16[i])) ? 1 : 0;
+			  return n;
+		  });
+	}
+	return results;
+}
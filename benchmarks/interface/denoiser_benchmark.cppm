@@ -0,0 +1,82 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_types.hpp>
+#include <cinttypes>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+export module pragma.scenekit.benchmarks:denoiser;
+
+import pragma.scenekit;
+
+export namespace pragma::scenekit {
+	// Denoises synthetic noisy images with a known ground truth, to measure the throughput and quality of the denoiser.
+	// Every combination of resolution, format and auxiliary inputs is run as a separate case, so regressions can be narrowed down.
+	struct DenoiserBenchmark {
+		enum class AuxInputs : uint8_t { None = 0, Albedo, AlbedoNormal };
+		struct Settings {
+			std::vector<std::pair<uint32_t, uint32_t>> resolutions {{256, 256}, {1280, 720}, {1920, 1080}};
+			// Used for the beauty, auxiliary and output images. 16-bit formats are half precision floats.
+			std::vector<uimg::Format> formats {uimg::Format::RGB32, uimg::Format::RGBA32, uimg::Format::RGBA16};
+			std::vector<AuxInputs> auxInputs {AuxInputs::None, AuxInputs::Albedo, AuxInputs::AlbedoNormal};
+			// Additionally runs every resolution and format in lightmap mode (which doesn't use auxiliary inputs)
+			bool includeLightmap = true;
+			// Number of timed runs per case, after the first (cold) run which includes creating the denoiser device and filter
+			uint32_t iterations = 3;
+			// Standard deviation of the relative noise of the synthetic input
+			float noiseLevel = 0.25f;
+			uint32_t seed = 1;
+			uint32_t numThreads = 0; // See denoise::Info::numThreads
+		};
+		struct Case {
+			uint32_t width = 0;
+			uint32_t height = 0;
+			uimg::Format format = uimg::Format::RGB32;
+			AuxInputs auxInputs = AuxInputs::None;
+			bool lightmap = false;
+			std::chrono::nanoseconds coldDuration {0}; // First run, including device and filter creation
+			std::chrono::nanoseconds duration {0};     // Average of the timed runs
+			double megapixelsPerSecond = 0.0;          // Based on the average duration
+			// Compared against the ground truth. PSNR in dB with a peak of 1, SSIM of the luminance.
+			double psnrNoisy = 0.0;
+			double psnr = 0.0;
+			double ssim = 0.0;
+		};
+		struct Result {
+			std::vector<Case> cases;
+			std::string ToJson() const;
+			// Parses the output of ToJson, e.g. a stored baseline
+			static std::optional<Result> FromJson(const std::string &json, std::string &outErr);
+		};
+		static std::optional<Result> Run(const Settings &settings, std::string &outErr);
+
+		// Quality thresholds every case has to meet. The baseline tolerances only apply to cases that are also part of the baseline
+		// (matched by resolution, format, auxiliary inputs and lightmap mode).
+		struct RegressionThresholds {
+			double minPsnrGain = 6.0; // Minimum PSNR improvement over the noisy input in dB
+			double minSsim = 0.8;
+			double psnrTolerance = 0.5; // Maximum PSNR drop in dB compared to the baseline
+			double ssimTolerance = 0.01;
+			// Maximum ratio between the mean duration and the baseline's, 0 = disabled. Timings depend on the machine, so this should
+			// only be enabled if the baseline has been recorded on the same hardware.
+			double maxSlowdown = 0.0;
+		};
+		// Returns a description of every threshold a case has failed, or an empty vector if there are no regressions
+		static std::vector<std::string> CheckRegressions(const Result &result, const RegressionThresholds &thresholds, const Result *optBaseline = nullptr);
+
+		// Image quality metrics for tightly packed RGB float images. Values are clamped to [0,1].
+		static double CalcPsnr(const float *rgb, const float *rgbReference, uint32_t width, uint32_t height);
+		// Mean SSIM of the luminance over 8x8 windows with a stride of 4 pixels
+		static double CalcSsim(const float *rgb, const float *rgbReference, uint32_t width, uint32_t height);
+	};
+};
@@ -0,0 +1,92 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+export module pragma.scenekit.benchmarks:tile_manager;
+
+import pragma.scenekit;
+
+export namespace pragma::scenekit {
+	// Drives a TileManager with synthetic tiles from multiple producer threads, which emulate the render devices.
+	// Doesn't require Cycles or a GPU, so the post-processing path can be tuned in isolation.
+	struct TileManagerBenchmark {
+		struct Settings {
+			uint32_t width = 1920;
+			uint32_t height = 1080;
+			uint32_t tileWidth = 64;
+			uint32_t tileHeight = 64;
+			uint32_t sampleCount = 16; // Number of progressive samples per tile
+			uint32_t producerThreadCount = 4;
+			// Interval at which the emulated viewer retrieves rendered tiles through GetRenderedTileBatch
+			std::chrono::microseconds consumerPollInterval {1'000};
+			// If set, tiles will be run through the color transform processor during post-processing
+			std::optional<ColorTransformProcessorCreateInfo> colorTransform {};
+			TileManager::Settings tileManagerSettings {};
+		};
+		struct Result {
+			uint64_t tilesProduced = 0;
+			uint64_t tilesProcessed = 0;
+			uint64_t tilesDelivered = 0;
+			std::chrono::nanoseconds duration {0};
+			double tilesPerSecond = 0.0;
+			// End-to-end latency (tile added -> tile retrieved by the consumer)
+			std::chrono::nanoseconds latencyP50 {0};
+			std::chrono::nanoseconds latencyP99 {0};
+			uint64_t peakResidentSetSize = 0; // In bytes, for the entire process
+			std::string statisticsJson;
+		};
+		static std::optional<Result> Run(const Settings &settings, std::string &outErr);
+
+		// Compares the input tile queue designs in isolation: A mutex-guarded index queue with per-tile slots, which copies every tile out of its slot
+		// while holding the lock (the previous design), and the lock-free MpmcQueue, which moves the tiles through the queue.
+		struct QueueContentionSettings {
+			uint32_t producerThreadCount = 4;
+			uint32_t consumerThreadCount = 10;
+			uint32_t tilesPerProducer = 50'000;
+			// Small tiles maximize the contention on the queue
+			uint32_t tileWidth = 16;
+			uint32_t tileHeight = 16;
+		};
+		struct QueueContentionResult {
+			struct Entry {
+				std::chrono::nanoseconds duration {0};
+				double tilesPerSecond = 0.0;
+			};
+			Entry mutexQueue {};
+			Entry mpmcQueue {};
+		};
+		static QueueContentionResult RunQueueContention(const QueueContentionSettings &settings);
+
+		// Times the per-tile kernels (see tile_kernels) on tiles that fit into the cache, and verifies every result against a scalar reference implementation
+		// of the unfused flip, alpha clear and copy passes.
+		struct KernelSettings {
+			uint32_t tileWidth = 64;
+			uint32_t tileHeight = 64;
+			uint32_t iterations = 10'000;
+			bool flipHorizontally = true;
+			bool flipVertically = true;
+		};
+		struct KernelResult {
+			std::string name;
+			uint64_t bytesPerTile = 0; // Bytes read and written per tile
+			std::chrono::nanoseconds durationPerTile {0};
+			double nanosecondsPerByte = 0.0;
+			double cyclesPerByte = 0.0; // Time stamp counter cycles, 0 if there's no time stamp counter on this platform
+			uint64_t mismatchCount = 0; // Values that differ from the reference implementation
+		};
+		static std::vector<KernelResult> RunKernels(const KernelSettings &settings);
+		// Peak resident set size of the current process in bytes, or 0 if unavailable
+		static uint64_t GetPeakResidentSetSize();
+	};
+};
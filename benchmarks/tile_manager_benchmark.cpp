@@ -0,0 +1,121 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Standalone driver for pragma::scenekit::TileManagerBenchmark.
+// Usage: unirender_tile_manager_benchmark [--mode=all|tiles|queue|kernels] [--width=N] [--height=N] [--tile-width=N] [--tile-height=N]
+//                                         [--samples=N] [--producers=N] [--workers=N] [--color-transform=<config>] [--iterations=N] [--json]
+
+#include "benchmark_args.hpp"
+#include <cinttypes>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+import pragma.scenekit;
+import pragma.scenekit.benchmarks;
+
+static double to_milliseconds(std::chrono::nanoseconds t) { return std::chrono::duration<double, std::milli>(t).count(); }
+
+int main(int argc, char *argv[])
+{
+	using Benchmark = pragma::scenekit::TileManagerBenchmark;
+	using unirender::benchmark::get_arg_value;
+	using unirender::benchmark::parse_uint;
+	std::string mode = "all";
+	auto printJson = false;
+	Benchmark::Settings settings {};
+	Benchmark::QueueContentionSettings queueSettings {};
+	Benchmark::KernelSettings kernelSettings {};
+	for(int i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		auto valid = true;
+		if(arg == "--json")
+			printJson = true;
+		else if(auto v = get_arg_value(arg, "--mode"))
+			mode = *v;
+		else if(auto v = get_arg_value(arg, "--width"))
+			valid = parse_uint(*v, settings.width);
+		else if(auto v = get_arg_value(arg, "--height"))
+			valid = parse_uint(*v, settings.height);
+		else if(auto v = get_arg_value(arg, "--tile-width")) {
+			valid = parse_uint(*v, settings.tileWidth);
+			kernelSettings.tileWidth = settings.tileWidth;
+		}
+		else if(auto v = get_arg_value(arg, "--tile-height")) {
+			valid = parse_uint(*v, settings.tileHeight);
+			kernelSettings.tileHeight = settings.tileHeight;
+		}
+		else if(auto v = get_arg_value(arg, "--samples"))
+			valid = parse_uint(*v, settings.sampleCount);
+		else if(auto v = get_arg_value(arg, "--producers")) {
+			valid = parse_uint(*v, settings.producerThreadCount);
+			queueSettings.producerThreadCount = settings.producerThreadCount;
+		}
+		else if(auto v = get_arg_value(arg, "--workers")) {
+			valid = parse_uint(*v, settings.tileManagerSettings.workerCount);
+			queueSettings.consumerThreadCount = settings.tileManagerSettings.workerCount;
+		}
+		else if(auto v = get_arg_value(arg, "--iterations"))
+			valid = parse_uint(*v, kernelSettings.iterations);
+		else if(auto v = get_arg_value(arg, "--color-transform")) {
+			pragma::scenekit::ColorTransformProcessorCreateInfo colorTransform {};
+			colorTransform.config = *v;
+			settings.colorTransform = colorTransform;
+		}
+		else
+			valid = false;
+		if(!valid) {
+			std::cout << "Invalid argument '" << arg << "'!" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if(mode != "all" && mode != "tiles" && mode != "queue" && mode != "kernels") {
+		std::cout << "Unknown mode '" << mode << "'!" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	auto success = true;
+	if(mode == "all" || mode == "tiles") {
+		std::string err;
+		auto result = Benchmark::Run(settings, err);
+		if(!result) {
+			std::cout << "Tile manager benchmark failed: " << err << std::endl;
+			success = false;
+		}
+		else {
+			std::cout << "Tile manager: " << settings.width << "x" << settings.height << ", " << settings.tileWidth << "x" << settings.tileHeight << " tiles, " << settings.sampleCount << " samples" << std::endl;
+			std::cout << "  produced: " << result->tilesProduced << ", processed: " << result->tilesProcessed << ", delivered: " << result->tilesDelivered << std::endl;
+			std::cout << "  duration: " << to_milliseconds(result->duration) << " ms, " << result->tilesPerSecond << " tiles/s" << std::endl;
+			std::cout << "  latency p50: " << to_milliseconds(result->latencyP50) << " ms, p99: " << to_milliseconds(result->latencyP99) << " ms" << std::endl;
+			std::cout << "  peak resident set size: " << (result->peakResidentSetSize / (1'024 * 1'024)) << " MiB" << std::endl;
+			if(printJson)
+				std::cout << result->statisticsJson << std::endl;
+		}
+	}
+	if(mode == "all" || mode == "queue") {
+		auto result = Benchmark::RunQueueContention(queueSettings);
+		std::cout << "Queue contention: " << queueSettings.producerThreadCount << " producers, " << queueSettings.consumerThreadCount << " consumers" << std::endl;
+		std::cout << "  mutex queue: " << to_milliseconds(result.mutexQueue.duration) << " ms, " << result.mutexQueue.tilesPerSecond << " tiles/s" << std::endl;
+		std::cout << "  mpmc queue: " << to_milliseconds(result.mpmcQueue.duration) << " ms, " << result.mpmcQueue.tilesPerSecond << " tiles/s" << std::endl;
+	}
+	if(mode == "all" || mode == "kernels") {
+		std::cout << "Kernels: " << kernelSettings.tileWidth << "x" << kernelSettings.tileHeight << " tiles, " << kernelSettings.iterations << " iterations" << std::endl;
+		for(auto &result : Benchmark::RunKernels(kernelSettings)) {
+			std::cout << "  " << result.name << ": " << result.durationPerTile.count() << " ns/tile, " << result.nanosecondsPerByte << " ns/byte";
+			if(result.cyclesPerByte > 0.0)
+				std::cout << ", " << result.cyclesPerByte << " cycles/byte";
+			if(result.mismatchCount > 0) {
+				std::cout << ", " << result.mismatchCount << " MISMATCHES";
+				success = false;
+			}
+			std::cout << std::endl;
+		}
+	}
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
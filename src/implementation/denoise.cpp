@@ -9,11 +9,28 @@ module;
 
 #include <util_image_buffer.hpp>
 #include <OpenImageDenoise/oidn.hpp>
+#include <mathutil/umat.h>
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstring>
+#include <unordered_map>
+#include <numeric>
+#include <bit>
 
 module pragma.scenekit;
 
 import :denoise;
+import :tile_kernels;
 
 static std::optional<oidn::Format> get_oidn_format(uimg::Format format)
 {
@@ -32,42 +49,256 @@ static std::optional<oidn::Format> get_oidn_format(uimg::Format format)
 	return {};
 }
 
-pragma::scenekit::denoise::Denoiser::Denoiser()
+namespace {
+	class CoreBudget {
+	  public:
+		static CoreBudget &Get()
+		{
+			static CoreBudget budget {};
+			return budget;
+		}
+		void SetCoreCount(uint32_t numCores)
+		{
+			{
+				std::scoped_lock lock {m_mutex};
+				m_numCores = numCores;
+			}
+			m_condition.notify_all();
+		}
+		uint32_t GetCoreCount() const
+		{
+			std::scoped_lock lock {m_mutex};
+			return m_numCores;
+		}
+		// Blocks until the cores are available. Returns the number of reserved cores, which is clamped to the budget.
+		uint32_t Reserve(uint32_t numCores)
+		{
+			std::unique_lock lock {m_mutex};
+			if(m_numCores == 0)
+				return numCores; // Unlimited
+			numCores = std::min(numCores, m_numCores);
+			m_condition.wait(lock, [this, &numCores]() {
+				if(m_numCores == 0)
+					return true;
+				numCores = std::min(numCores, m_numCores);
+				return m_numCoresInUse + numCores <= m_numCores;
+			});
+			m_numCoresInUse += numCores;
+			return numCores;
+		}
+		void Release(uint32_t numCores)
+		{
+			{
+				std::scoped_lock lock {m_mutex};
+				m_numCoresInUse -= std::min(numCores, m_numCoresInUse);
+			}
+			m_condition.notify_all();
+		}
+	  private:
+		mutable std::mutex m_mutex;
+		std::condition_variable m_condition;
+		uint32_t m_numCores = 0;
+		uint32_t m_numCoresInUse = 0;
+	};
+	class CoreReservation {
+	  public:
+		CoreReservation(uint32_t numCores) : m_numCores {CoreBudget::Get().Reserve(numCores)} {}
+		~CoreReservation() { CoreBudget::Get().Release(m_numCores); }
+		CoreReservation(const CoreReservation &) = delete;
+		CoreReservation &operator=(const CoreReservation &) = delete;
+		uint32_t GetCoreCount() const { return m_numCores; }
+	  private:
+		uint32_t m_numCores;
+	};
+};
+
+void pragma::scenekit::denoise::set_core_budget(uint32_t numCores) { CoreBudget::Get().SetCoreCount(numCores); }
+uint32_t pragma::scenekit::denoise::get_core_budget() { return CoreBudget::Get().GetCoreCount(); }
+
+struct pragma::scenekit::denoise::DenoiserCache::Entry {
+	Key key {};
+	std::shared_ptr<oidn::DeviceRef> device = nullptr;
+	oidn::FilterRef filter {};
+};
+
+pragma::scenekit::denoise::DenoiserCache::Lease::Lease(DenoiserCache &cache, std::unique_ptr<Entry> entry) : m_cache {&cache}, m_entry {std::move(entry)} {}
+pragma::scenekit::denoise::DenoiserCache::Lease::Lease(Lease &&other) : m_cache {other.m_cache}, m_entry {std::move(other.m_entry)} {}
+pragma::scenekit::denoise::DenoiserCache::Lease &pragma::scenekit::denoise::DenoiserCache::Lease::operator=(Lease &&other)
+{
+	if(this == &other)
+		return *this;
+	Release();
+	m_cache = other.m_cache;
+	m_entry = std::move(other.m_entry);
+	return *this;
+}
+pragma::scenekit::denoise::DenoiserCache::Lease::~Lease() { Release(); }
+oidn::DeviceRef &pragma::scenekit::denoise::DenoiserCache::Lease::GetDevice() { return *m_entry->device; }
+oidn::FilterRef &pragma::scenekit::denoise::DenoiserCache::Lease::GetFilter() { return m_entry->filter; }
+void pragma::scenekit::denoise::DenoiserCache::Lease::Release()
 {
-	auto device = oidn::newDevice();
-	const char *errMsg;
-	if(device.getError(errMsg) != oidn::Error::None)
+	if(!m_entry)
 		return;
-	/*device.setErrorFunction([](void *userPtr,oidn::Error code,const char *message) {
-		std::cout<<"Error: "<<message<<std::endl;
-		});
-	device.set("verbose",true);*/
-	device.commit();
-	m_device = std::make_unique<oidn::DeviceRef>(device);
+	m_cache->Release(std::move(m_entry));
+	m_entry = nullptr;
+}
+
+pragma::scenekit::denoise::DenoiserCache &pragma::scenekit::denoise::DenoiserCache::Get()
+{
+	static DenoiserCache cache {};
+	return cache;
+}
+
+pragma::scenekit::denoise::DenoiserCache::DenoiserCache() {}
+pragma::scenekit::denoise::DenoiserCache::~DenoiserCache() { Clear(); }
+
+pragma::scenekit::denoise::DenoiserCache::DeviceInfo *pragma::scenekit::denoise::DenoiserCache::FindDeviceInfo(const oidn::DeviceRef &device)
+{
+	auto it = std::find_if(m_devices.begin(), m_devices.end(), [&device](const DeviceInfo &info) { return info.device.get() == &device; });
+	return (it != m_devices.end()) ? &*it : nullptr;
+}
+
+pragma::scenekit::denoise::DenoiserCache::Lease pragma::scenekit::denoise::DenoiserCache::Acquire(const Key &key)
+{
+	std::shared_ptr<oidn::DeviceRef> device = nullptr;
+	{
+		std::scoped_lock lock {m_mutex};
+		// Most recently used filter with a matching configuration
+		auto it = std::find_if(m_idleEntries.rbegin(), m_idleEntries.rend(), [&key](const std::unique_ptr<Entry> &entry) { return entry->key == key; });
+		if(it != m_idleEntries.rend()) {
+			auto entry = std::move(*it);
+			m_idleEntries.erase(std::next(it).base());
+			++FindDeviceInfo(*entry->device)->leaseCount;
+			++m_statistics.filterHits;
+			return Lease {*this, std::move(entry)};
+		}
+		++m_statistics.filterMisses;
+		auto itDevice = std::find_if(m_devices.begin(), m_devices.end(), [&key](const DeviceInfo &info) { return info.leaseCount == 0 && info.numThreads == key.numThreads && info.setAffinity == key.setAffinity; });
+		if(itDevice != m_devices.end()) {
+			++itDevice->leaseCount;
+			device = itDevice->device;
+		}
+	}
+	if(!device) {
+		// Device creation is slow, so it's done without holding the lock
+		auto newDevice = oidn::newDevice();
+		const char *errMsg;
+		if(newDevice.getError(errMsg) != oidn::Error::None) {
+			std::cout << "Unable to create denoising device: " << errMsg << std::endl;
+			return {};
+		}
+		// Device parameters have to be set before the device is committed
+		newDevice.set("numThreads", static_cast<int>(key.numThreads));
+		newDevice.set("setAffinity", key.setAffinity);
+		newDevice.commit();
+		device = std::make_shared<oidn::DeviceRef>(newDevice);
+
+		std::scoped_lock lock {m_mutex};
+		m_devices.push_back({device, key.numThreads, key.setAffinity, 1});
+		++m_statistics.devicesCreated;
+	}
+	auto entry = std::make_unique<Entry>();
+	entry->key = key;
+	entry->device = device;
+	entry->filter = device->newFilter(key.lightmap ? "RTLightmap" : "RT");
+	return Lease {*this, std::move(entry)};
+}
+
+void pragma::scenekit::denoise::DenoiserCache::Release(std::unique_ptr<Entry> entry)
+{
+	std::scoped_lock lock {m_mutex};
+	auto *deviceInfo = FindDeviceInfo(*entry->device);
+	if(deviceInfo && deviceInfo->leaseCount > 0)
+		--deviceInfo->leaseCount;
+	m_idleEntries.push_back(std::move(entry));
+	EvictExcessEntries();
+}
+
+void pragma::scenekit::denoise::DenoiserCache::EvictExcessEntries()
+{
+	while(m_idleEntries.size() > m_maxIdleFilterCount)
+		m_idleEntries.erase(m_idleEntries.begin());
+	// Devices are kept as long as they have cached filters, or are in use
+	for(auto it = m_devices.begin(); it != m_devices.end();) {
+		auto &info = *it;
+		auto hasFilters = std::any_of(m_idleEntries.begin(), m_idleEntries.end(), [&info](const std::unique_ptr<Entry> &entry) { return entry->device == info.device; });
+		if(info.leaseCount == 0 && !hasFilters && m_devices.size() > 1)
+			it = m_devices.erase(it);
+		else
+			++it;
+	}
+}
+
+void pragma::scenekit::denoise::DenoiserCache::SetMaxIdleFilterCount(size_t count)
+{
+	std::scoped_lock lock {m_mutex};
+	m_maxIdleFilterCount = count;
+	EvictExcessEntries();
+}
+
+void pragma::scenekit::denoise::DenoiserCache::Clear()
+{
+	std::scoped_lock lock {m_mutex};
+	m_idleEntries.clear();
+	m_devices.erase(std::remove_if(m_devices.begin(), m_devices.end(), [](const DeviceInfo &info) { return info.leaseCount == 0; }), m_devices.end());
 }
 
+pragma::scenekit::denoise::DenoiserCache::Statistics pragma::scenekit::denoise::DenoiserCache::GetStatistics() const
+{
+	std::scoped_lock lock {m_mutex};
+	return m_statistics;
+}
+
+////////////
+
+pragma::scenekit::denoise::Denoiser::Denoiser() : Denoiser {DenoiserCache::Get()} {}
+pragma::scenekit::denoise::Denoiser::Denoiser(DenoiserCache &cache) : m_cache {&cache} {}
+
 bool pragma::scenekit::denoise::Denoiser::Denoise(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback)
 {
-	if(m_device == nullptr)
+	if(denoise.tileSize > 0 && (denoise.width > denoise.tileSize || denoise.height > denoise.tileSize))
+		return DenoiseTiled(denoise, inputImages, outputImage, fProgressCallback);
+	auto numThreads = (denoise.numThreads > 0) ? denoise.numThreads : std::max(std::thread::hardware_concurrency(), 1u);
+	// Released when the denoising is complete, the reservation may be smaller than requested
+	CoreReservation coreReservation {numThreads};
+
+	DenoiserCache::Key key {};
+	key.numThreads = coreReservation.GetCoreCount();
+	key.setAffinity = denoise.setAffinity;
+	key.lightmap = denoise.lightmap;
+	key.hdr = denoise.hdr;
+	key.width = denoise.width;
+	key.height = denoise.height;
+	key.beautyFormat = inputImages.beautyImage.format;
+	key.outputFormat = outputImage.format;
+	if(denoise.lightmap == false) {
+		if(inputImages.albedoImage.data)
+			key.albedoFormat = inputImages.albedoImage.format;
+		if(inputImages.normalImage.data)
+			key.normalFormat = inputImages.normalImage.format;
+	}
+	auto lease = m_cache->Acquire(key);
+	if(!lease.IsValid())
 		return false;
-	oidn::FilterRef filter = m_device->newFilter(denoise.lightmap ? "RTLightmap" : "RT");
+	auto &device = lease.GetDevice();
+	auto &filter = lease.GetFilter();
 
 	auto beautyFormat = get_oidn_format(inputImages.beautyImage.format);
 	if(!beautyFormat)
 		return false;
-	filter.setImage("color", inputImages.beautyImage.data, *beautyFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.beautyImage.format));
+	filter.setImage("color", inputImages.beautyImage.data, *beautyFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.beautyImage.format), inputImages.beautyImage.rowStride);
 	if(denoise.lightmap == false) {
 		if(inputImages.albedoImage.data) {
 			auto albedoFormat = get_oidn_format(inputImages.albedoImage.format);
 			if(!albedoFormat)
 				return false;
-			filter.setImage("albedo", inputImages.albedoImage.data, *albedoFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.albedoImage.format));
+			filter.setImage("albedo", inputImages.albedoImage.data, *albedoFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.albedoImage.format), inputImages.albedoImage.rowStride);
 		}
 		if(inputImages.normalImage.data) {
 			auto normalFormat = get_oidn_format(inputImages.normalImage.format);
 			if(!normalFormat)
 				return false;
-			filter.setImage("normal", inputImages.normalImage.data, *normalFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.normalImage.format));
+			filter.setImage("normal", inputImages.normalImage.data, *normalFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(inputImages.normalImage.format), inputImages.normalImage.rowStride);
 		}
 
 		filter.set("hdr", denoise.hdr);
@@ -75,7 +306,7 @@ bool pragma::scenekit::denoise::Denoiser::Denoise(const Info &denoise, const Ima
 	auto outputFormat = get_oidn_format(outputImage.format);
 	if(!outputFormat)
 		return false;
-	filter.setImage("output", outputImage.data, *outputFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(outputImage.format));
+	filter.setImage("output", outputImage.data, *outputFormat, denoise.width, denoise.height, 0u, uimg::ImageBuffer::GetPixelSize(outputImage.format), outputImage.rowStride);
 
 	std::unique_ptr<std::function<bool(float)>> ptrProgressCallback = nullptr;
 	if(fProgressCallback) {
@@ -93,9 +324,12 @@ bool pragma::scenekit::denoise::Denoiser::Denoise(const Info &denoise, const Ima
 	filter.commit();
 
 	filter.execute();
+	// The filter is returned to the cache, so it must not keep a pointer to our callback
+	if(ptrProgressCallback)
+		filter.setProgressMonitorFunction(nullptr);
 
 	const char *errorMessage;
-	if(m_device->getError(errorMessage) != oidn::Error::None) {
+	if(device.getError(errorMessage) != oidn::Error::None) {
 		std::cout << "Denoising failed: " << errorMessage << std::endl;
 		return false;
 	}
@@ -103,16 +337,207 @@ bool pragma::scenekit::denoise::Denoiser::Denoise(const Info &denoise, const Ima
 	return true;
 }
 
+namespace {
+	// Linear ramps across the overlap of neighboring tiles, the weights of all tiles covering a pixel add up to 1
+	float get_tile_blend_weight(uint32_t p, uint32_t coreStart, uint32_t coreEnd, uint32_t imageSize, uint32_t overlap)
+	{
+		auto w = 1.f;
+		if(overlap == 0)
+			return w;
+		auto rampSize = static_cast<float>(overlap * 2);
+		if(coreStart > 0)
+			w = std::min(w, (static_cast<float>(p) - static_cast<float>(coreStart - overlap) + 0.5f) / rampSize);
+		if(coreEnd < imageSize)
+			w = std::min(w, (static_cast<float>(coreEnd + overlap) - static_cast<float>(p) - 0.5f) / rampSize);
+		return std::clamp(w, 0.f, 1.f);
+	}
+	uint32_t get_row_stride(const pragma::scenekit::denoise::ImageData &img, uint32_t width) { return (img.rowStride > 0) ? img.rowStride : static_cast<uint32_t>(uimg::ImageBuffer::GetPixelSize(img.format) * width); }
+	uint8_t *get_pixel_ptr(const pragma::scenekit::denoise::ImageData &img, uint32_t width, uint32_t x, uint32_t y)
+	{
+		return img.data + static_cast<size_t>(y) * get_row_stride(img, width) + static_cast<size_t>(x) * uimg::ImageBuffer::GetPixelSize(img.format);
+	}
+	// Number of bytes from the first to the last byte of an image, including the stride padding between rows
+	size_t get_image_extent(const pragma::scenekit::denoise::ImageData &img, uint32_t width, uint32_t height)
+	{
+		if(height == 0)
+			return 0;
+		return static_cast<size_t>(height - 1) * get_row_stride(img, width) + static_cast<size_t>(width) * uimg::ImageBuffer::GetPixelSize(img.format);
+	}
+	bool do_images_overlap(const pragma::scenekit::denoise::ImageData &a, const pragma::scenekit::denoise::ImageData &b, uint32_t width, uint32_t height)
+	{
+		if(!a.data || !b.data)
+			return false;
+		auto a0 = reinterpret_cast<uintptr_t>(a.data);
+		auto b0 = reinterpret_cast<uintptr_t>(b.data);
+		return a0 < b0 + get_image_extent(b, width, height) && b0 < a0 + get_image_extent(a, width, height);
+	}
+	bool is_half_format(uimg::Format format) { return get_oidn_format(format) == oidn::Format::Half3; }
+	void read_rgb(const uint8_t *px, bool half, float *outRgb)
+	{
+		if(half) {
+			for(uint32_t c = 0; c < 3; ++c)
+				outRgb[c] = pragma::scenekit::tile_kernels::half_to_float(reinterpret_cast<const uint16_t *>(px)[c]);
+			return;
+		}
+		std::memcpy(outRgb, px, sizeof(float) * 3);
+	}
+	void write_rgb(uint8_t *px, bool half, const float *rgb)
+	{
+		if(half) {
+			for(uint32_t c = 0; c < 3; ++c)
+				reinterpret_cast<uint16_t *>(px)[c] = pragma::scenekit::tile_kernels::float_to_half(rgb[c]);
+			return;
+		}
+		std::memcpy(px, rgb, sizeof(float) * 3);
+	}
+};
+
+bool pragma::scenekit::denoise::Denoiser::DenoiseTiled(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback)
+{
+	auto w = denoise.width;
+	auto h = denoise.height;
+	auto tileSize = denoise.tileSize;
+	auto overlap = std::min(denoise.tileOverlap, tileSize / 2);
+	auto numTilesX = (w + tileSize - 1) / tileSize;
+	auto numTilesY = (h + tileSize - 1) / tileSize;
+	auto outputHalf = is_half_format(outputImage.format);
+
+	// The rows of tiles are denoised from top to bottom, and the results are blended in a float band that spans one row of tiles and the overlap above and below.
+	// Rows of the band are written to the output once all tiles covering them are complete, at which point no pending tile reads them as input anymore.
+	// This makes in-place denoising safe as long as the output has the same layout as the input. Inputs that share memory with the output in any other way are copied.
+	auto tileInputImages = inputImages;
+	std::array<std::vector<uint8_t>, 3> inputCopies;
+	std::array<ImageData *, 3> inputs {&tileInputImages.beautyImage, &tileInputImages.albedoImage, &tileInputImages.normalImage};
+	for(size_t i = 0; i < inputs.size(); ++i) {
+		auto &img = *inputs[i];
+		if(!do_images_overlap(img, outputImage, w, h) || (img.data == outputImage.data && get_row_stride(img, w) == get_row_stride(outputImage, w)))
+			continue;
+		inputCopies[i].assign(img.data, img.data + get_image_extent(img, w, h));
+		img = {inputCopies[i].data(), img.format, get_row_stride(img, w)};
+	}
+	auto bandHeight = std::min(tileSize + overlap * 2, h);
+	std::vector<float> band(static_cast<size_t>(w) * bandHeight * 3, 0.f);
+	uint32_t bandY0 = 0; // First image row in the band
+	auto getBandPixel = [&](uint32_t x, uint32_t y) { return band.data() + (static_cast<size_t>(y - bandY0) * w + x) * 3; };
+
+	auto numThreads = (denoise.numThreads > 0) ? denoise.numThreads : std::max(std::thread::hardware_concurrency(), 1u);
+	auto numThreadsPerTile = std::max(numThreads / std::max(denoise.maxConcurrentTiles, 1u), 1u);
+
+	std::atomic<uint32_t> numTilesCompleted = 0;
+	std::atomic<bool> failed = false;
+	auto numTiles = numTilesX * numTilesY;
+	for(uint32_t ty = 0; ty < numTilesY && !failed; ++ty) {
+		// Tiles that are two tiles apart never overlap (overlap <= tileSize / 2), so every other tile of the row can be denoised in parallel
+		for(uint32_t phase = 0; phase < 2 && !failed; ++phase) {
+			std::vector<uint32_t> phaseTiles;
+			for(auto tx = phase; tx < numTilesX; tx += 2)
+				phaseTiles.push_back(tx);
+			std::atomic<uint32_t> nextTile = 0;
+			// Reports the progress of the tiles that are currently being denoised, and aborts them if another tile has failed or the callback has cancelled the operation
+			auto tileProgressCallback = [&](float tileProgress) -> bool {
+				if(failed)
+					return false;
+				if(fProgressCallback && !fProgressCallback((static_cast<float>(numTilesCompleted) + tileProgress) / static_cast<float>(numTiles))) {
+					failed = true; // Cancelled
+					return false;
+				}
+				return true;
+			};
+			auto processTiles = [&]() {
+				std::vector<float> tileOutput;
+				for(;;) {
+					auto idx = nextTile++;
+					if(idx >= phaseTiles.size() || failed)
+						break;
+					auto tx = phaseTiles[idx];
+					auto coreX0 = tx * tileSize;
+					auto coreY0 = ty * tileSize;
+					auto coreX1 = std::min(coreX0 + tileSize, w);
+					auto coreY1 = std::min(coreY0 + tileSize, h);
+					auto x0 = (coreX0 > overlap) ? (coreX0 - overlap) : 0;
+					auto y0 = (coreY0 > overlap) ? (coreY0 - overlap) : 0;
+					auto x1 = std::min(coreX1 + overlap, w);
+					auto y1 = std::min(coreY1 + overlap, h);
+					auto tileW = x1 - x0;
+					auto tileH = y1 - y0;
+
+					// The inputs are passed to the denoiser as strided views into the full images, no copies required
+					auto getTileView = [&](const ImageData &img) -> ImageData {
+						if(!img.data)
+							return {};
+						return {get_pixel_ptr(img, w, x0, y0), img.format, get_row_stride(img, w)};
+					};
+					ImageInputs tileInputs {};
+					tileInputs.beautyImage = getTileView(tileInputImages.beautyImage);
+					tileInputs.albedoImage = getTileView(tileInputImages.albedoImage);
+					tileInputs.normalImage = getTileView(tileInputImages.normalImage);
+					tileOutput.resize(static_cast<size_t>(tileW) * tileH * 3);
+					ImageData tileOutputImage {reinterpret_cast<uint8_t *>(tileOutput.data()), uimg::Format::RGB32};
+
+					auto tileInfo = denoise;
+					tileInfo.width = tileW;
+					tileInfo.height = tileH;
+					tileInfo.tileSize = 0;
+					tileInfo.numThreads = numThreadsPerTile;
+					if(!Denoise(tileInfo, tileInputs, tileOutputImage, tileProgressCallback) || failed) {
+						failed = true;
+						break;
+					}
+
+					for(auto y = y0; y < y1; ++y) {
+						auto wy = get_tile_blend_weight(y, coreY0, coreY1, h, overlap);
+						for(auto x = x0; x < x1; ++x) {
+							auto weight = wy * get_tile_blend_weight(x, coreX0, coreX1, w, overlap);
+							if(weight <= 0.f)
+								continue;
+							auto *dst = getBandPixel(x, y);
+							auto *src = tileOutput.data() + ((y - y0) * tileW + (x - x0)) * 3;
+							for(uint32_t c = 0; c < 3; ++c)
+								dst[c] += src[c] * weight;
+						}
+					}
+					auto completed = ++numTilesCompleted;
+					if(fProgressCallback && !fProgressCallback(static_cast<float>(completed) / static_cast<float>(numTiles)))
+						failed = true; // Cancelled
+				}
+			};
+			auto numThreads = std::min<uint32_t>(std::max(denoise.maxConcurrentTiles, 1u), static_cast<uint32_t>(phaseTiles.size()));
+			std::vector<std::thread> threads;
+			for(uint32_t i = 1; i < numThreads; ++i)
+				threads.emplace_back(processTiles);
+			processTiles();
+			for(auto &t : threads)
+				t.join();
+		}
+		if(failed)
+			break;
+
+		// Everything above the overlap with the next row of tiles is complete
+		auto completeY1 = (ty + 1 < numTilesY) ? ((ty + 1) * tileSize - overlap) : h;
+		for(auto y = bandY0; y < completeY1; ++y) {
+			for(uint32_t x = 0; x < w; ++x)
+				write_rgb(get_pixel_ptr(outputImage, w, x, y), outputHalf, getBandPixel(x, y));
+		}
+		// The remaining rows are moved to the top of the band
+		auto numCompleteValues = static_cast<size_t>(completeY1 - bandY0) * w * 3;
+		std::copy(band.begin() + numCompleteValues, band.end(), band.begin());
+		std::fill(band.end() - numCompleteValues, band.end(), 0.f);
+		bandY0 = completeY1;
+	}
+	return !failed;
+}
+
 bool pragma::scenekit::denoise::denoise(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback)
 {
 	Denoiser denoiser {};
 	return denoiser.Denoise(denoise, inputImages, outputImage, fProgressCallback);
 }
 
-bool pragma::scenekit::denoise::denoise(const Info &denoiseInfo, uimg::ImageBuffer &imgBuffer, uimg::ImageBuffer *optImgBufferAlbedo, uimg::ImageBuffer *optImgBufferNormal, const std::function<bool(float)> &fProgressCallback)
+pragma::scenekit::denoise::BatchItem pragma::scenekit::denoise::make_batch_item(const Info &denoise, uimg::ImageBuffer &imgBuffer, uimg::ImageBuffer *optImgBufferAlbedo, uimg::ImageBuffer *optImgBufferNormal)
 {
-	Denoiser denoiser {};
-	ImageInputs inputs {};
+	BatchItem item {};
+	item.info = denoise;
+	auto &inputs = item.inputImages;
 	inputs.beautyImage.data = static_cast<uint8_t *>(imgBuffer.GetData());
 	inputs.beautyImage.format = imgBuffer.GetFormat();
 
@@ -125,9 +550,554 @@ bool pragma::scenekit::denoise::denoise(const Info &denoiseInfo, uimg::ImageBuff
 		inputs.normalImage.format = optImgBufferNormal->GetFormat();
 	}
 
-	ImageData output {};
+	auto &output = item.outputImage;
 	output.data = static_cast<uint8_t *>(imgBuffer.GetData());
 	output.format = imgBuffer.GetFormat();
+	return item;
+}
+
+bool pragma::scenekit::denoise::denoise(const Info &denoiseInfo, uimg::ImageBuffer &imgBuffer, uimg::ImageBuffer *optImgBufferAlbedo, uimg::ImageBuffer *optImgBufferNormal, const std::function<bool(float)> &fProgressCallback)
+{
+	Denoiser denoiser {};
+	auto item = make_batch_item(denoiseInfo, imgBuffer, optImgBufferAlbedo, optImgBufferNormal);
+	return denoiser.Denoise(item.info, item.inputImages, item.outputImage, fProgressCallback);
+}
 
-	return denoiser.Denoise(denoiseInfo, inputs, output, fProgressCallback);
+bool pragma::scenekit::denoise::denoise_batch(const std::vector<BatchItem> &items, uint32_t numThreads, const std::function<bool(float)> &fProgressCallback, uint32_t maxConcurrentItems)
+{
+	if(items.empty())
+		return true;
+	if(numThreads == 0)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	auto numConcurrentItems = std::min<uint32_t>(std::max(maxConcurrentItems, 1u), static_cast<uint32_t>(items.size()));
+	auto numThreadsPerItem = std::max(numThreads / numConcurrentItems, 1u);
+
+	std::vector<float> itemProgress(items.size(), 0.f);
+	std::mutex progressMutex;
+	std::atomic<bool> cancelled = false;
+	std::atomic<bool> failed = false;
+	std::atomic<size_t> nextItem = 0;
+	auto processItems = [&]() {
+		Denoiser denoiser {};
+		for(;;) {
+			auto idx = nextItem++;
+			if(idx >= items.size() || failed || cancelled)
+				break;
+			auto info = items[idx].info;
+			info.numThreads = numThreadsPerItem;
+			auto res = denoiser.Denoise(info, items[idx].inputImages, items[idx].outputImage, [&, idx](float progress) -> bool {
+				if(cancelled)
+					return false;
+				if(!fProgressCallback)
+					return true;
+				std::scoped_lock lock {progressMutex};
+				itemProgress[idx] = progress;
+				auto totalProgress = 0.f;
+				for(auto p : itemProgress)
+					totalProgress += p;
+				if(!fProgressCallback(totalProgress / static_cast<float>(itemProgress.size())))
+					cancelled = true;
+				return !cancelled;
+			});
+			if(!res)
+				failed = true;
+		}
+	};
+	std::vector<std::thread> threads;
+	threads.reserve(numConcurrentItems - 1);
+	for(uint32_t i = 1; i < numConcurrentItems; ++i)
+		threads.emplace_back(processItems);
+	processItems();
+	for(auto &t : threads)
+		t.join();
+	return !failed && !cancelled;
+}
+
+struct pragma::scenekit::denoise::DenoiseJob::State {
+	std::atomic<float> progress = 0.f;
+	std::atomic<bool> cancelled = false;
+};
+
+pragma::scenekit::denoise::DenoiseJob pragma::scenekit::denoise::DenoiseJob::Start(std::function<bool(const std::function<bool(float)> &)> fDenoise, std::function<bool(float)> fProgressCallback)
+{
+	DenoiseJob job {};
+	auto state = std::make_shared<State>();
+	job.m_state = state;
+	job.m_future = std::async(std::launch::async, [state, fDenoise = std::move(fDenoise), fProgressCallback = std::move(fProgressCallback)]() -> bool {
+		if(state->cancelled)
+			return false;
+		auto res = fDenoise([&state, &fProgressCallback](float progress) -> bool {
+			state->progress = progress;
+			if(state->cancelled)
+				return false;
+			if(fProgressCallback && !fProgressCallback(progress)) {
+				state->cancelled = true;
+				return false;
+			}
+			return true;
+		});
+		if(!res || state->cancelled)
+			return false;
+		state->progress = 1.f;
+		return true;
+	}).share();
+	return job;
+}
+bool pragma::scenekit::denoise::DenoiseJob::IsComplete() const { return m_future.valid() && m_future.wait_for(std::chrono::seconds {0}) == std::future_status::ready; }
+float pragma::scenekit::denoise::DenoiseJob::GetProgress() const { return m_state ? m_state->progress.load() : 0.f; }
+void pragma::scenekit::denoise::DenoiseJob::Cancel()
+{
+	if(m_state)
+		m_state->cancelled = true;
+}
+bool pragma::scenekit::denoise::DenoiseJob::IsCancelled() const { return m_state && m_state->cancelled; }
+bool pragma::scenekit::denoise::DenoiseJob::Wait() const
+{
+	if(!m_future.valid())
+		return false;
+	return m_future.get();
+}
+
+pragma::scenekit::denoise::DenoiseJob pragma::scenekit::denoise::denoise_async(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, std::function<bool(float)> fProgressCallback)
+{
+	return DenoiseJob::Start(
+	  [denoise, inputImages, outputImage](const std::function<bool(float)> &fJobProgressCallback) -> bool {
+		  Denoiser denoiser {};
+		  return denoiser.Denoise(denoise, inputImages, outputImage, fJobProgressCallback);
+	  },
+	  std::move(fProgressCallback));
+}
+pragma::scenekit::denoise::DenoiseJob pragma::scenekit::denoise::denoise_batch_async(std::vector<BatchItem> items, uint32_t numThreads, std::function<bool(float)> fProgressCallback, uint32_t maxConcurrentItems)
+{
+	return DenoiseJob::Start([items = std::move(items), numThreads, maxConcurrentItems](const std::function<bool(float)> &fJobProgressCallback) -> bool { return denoise_batch(items, numThreads, fJobProgressCallback, maxConcurrentItems); },
+	  std::move(fProgressCallback));
+}
+
+namespace {
+	float read_channel(const uint8_t *px, bool half, uint32_t channel)
+	{
+		if(half)
+			return pragma::scenekit::tile_kernels::half_to_float(reinterpret_cast<const uint16_t *>(px)[channel]);
+		return reinterpret_cast<const float *>(px)[channel];
+	}
+	void write_channel(uint8_t *px, bool half, uint32_t channel, float value)
+	{
+		if(half)
+			reinterpret_cast<uint16_t *>(px)[channel] = pragma::scenekit::tile_kernels::float_to_half(value);
+		else
+			reinterpret_cast<float *>(px)[channel] = value;
+	}
+};
+
+pragma::scenekit::denoise::TemporalDenoiser::TemporalDenoiser(const Settings &settings) : m_settings {settings} {}
+void pragma::scenekit::denoise::TemporalDenoiser::Reset()
+{
+	m_history.clear();
+	m_historyDepth.clear();
+	m_historyLength.clear();
+}
+bool pragma::scenekit::denoise::TemporalDenoiser::Denoise(const Info &denoise, const FrameInputs &inputs, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback)
+{
+	auto w = denoise.width;
+	auto h = denoise.height;
+	auto numPixels = static_cast<size_t>(w) * h;
+	if(w != m_width || h != m_height) {
+		Reset();
+		m_width = w;
+		m_height = h;
+	}
+
+	// Spatial pass
+	m_current.resize(numPixels * 3);
+	ImageData currentImage {reinterpret_cast<uint8_t *>(m_current.data()), uimg::Format::RGB32};
+	if(!m_denoiser.Denoise(denoise, inputs.images, currentImage, fProgressCallback))
+		return false;
+
+	auto hasHistory = !m_history.empty();
+	auto hasDepth = (inputs.depthImage.data != nullptr);
+	auto useDepth = hasDepth && !m_historyDepth.empty();
+	auto motionHalf = is_half_format(inputs.motionImage.format);
+	auto depthHalf = is_half_format(inputs.depthImage.format);
+	auto outputHalf = is_half_format(outputImage.format);
+	auto getDepth = [&](uint32_t x, uint32_t y) { return read_channel(get_pixel_ptr(inputs.depthImage, w, x, y), depthHalf, 0); };
+
+	if(m_historyLength.size() != numPixels)
+		m_historyLength.assign(numPixels, 0.f);
+	m_nextHistory.resize(numPixels * 3);
+	m_nextHistoryLength.resize(numPixels);
+	std::vector<float> nextHistoryDepth;
+	if(hasDepth)
+		nextHistoryDepth.resize(numPixels);
+
+	for(uint32_t y = 0; y < h; ++y) {
+		for(uint32_t x = 0; x < w; ++x) {
+			auto idx = static_cast<size_t>(y) * w + x;
+			auto *cur = &m_current[idx * 3];
+			std::array<float, 3> result {cur[0], cur[1], cur[2]};
+			auto depth = hasDepth ? getDepth(x, y) : 0.f;
+			if(hasDepth)
+				nextHistoryDepth[idx] = depth;
+			auto historyLength = 0.f;
+
+			if(hasHistory) {
+				// Position of the pixel in the previous frame
+				auto sx = static_cast<float>(x);
+				auto sy = static_cast<float>(y);
+				if(inputs.motionImage.data) {
+					auto *px = get_pixel_ptr(inputs.motionImage, w, x, y);
+					sx += read_channel(px, motionHalf, 0);
+					sy += read_channel(px, motionHalf, 1);
+				}
+				if(std::isfinite(sx) && std::isfinite(sy) && sx > -1.f && sy > -1.f && sx < static_cast<float>(w) && sy < static_cast<float>(h)) {
+					// Bilinear reprojection, taps outside of the image or with mismatching depth are discarded
+					auto x0 = static_cast<int32_t>(std::floor(sx));
+					auto y0 = static_cast<int32_t>(std::floor(sy));
+					auto fx = sx - static_cast<float>(x0);
+					auto fy = sy - static_cast<float>(y0);
+					std::array<float, 3> history {0.f, 0.f, 0.f};
+					auto totalWeight = 0.f;
+					for(uint32_t tap = 0; tap < 4; ++tap) {
+						auto tx = x0 + static_cast<int32_t>(tap & 1);
+						auto ty = y0 + static_cast<int32_t>(tap >> 1);
+						if(tx < 0 || ty < 0 || tx >= static_cast<int32_t>(w) || ty >= static_cast<int32_t>(h))
+							continue;
+						auto tapIdx = static_cast<size_t>(ty) * w + tx;
+						if(useDepth && std::abs(m_historyDepth[tapIdx] - depth) > m_settings.depthTolerance * std::max(std::abs(depth), 1e-4f))
+							continue;
+						auto weight = ((tap & 1) ? fx : (1.f - fx)) * ((tap >> 1) ? fy : (1.f - fy));
+						for(uint32_t c = 0; c < 3; ++c)
+							history[c] += m_history[tapIdx * 3 + c] * weight;
+						historyLength += m_historyLength[tapIdx] * weight;
+						totalWeight += weight;
+					}
+					if(totalWeight > 1e-3f) {
+						for(auto &v : history)
+							v /= totalWeight;
+						historyLength /= totalWeight;
+						if(m_settings.neighborhoodClamp) {
+							std::array<float, 3> minColor {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+							std::array<float, 3> maxColor {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+							for(auto ny = (y > 0) ? (y - 1) : y; ny <= std::min(y + 1, h - 1); ++ny) {
+								for(auto nx = (x > 0) ? (x - 1) : x; nx <= std::min(x + 1, w - 1); ++nx) {
+									auto *n = &m_current[(static_cast<size_t>(ny) * w + nx) * 3];
+									for(uint32_t c = 0; c < 3; ++c) {
+										minColor[c] = std::min(minColor[c], n[c]);
+										maxColor[c] = std::max(maxColor[c], n[c]);
+									}
+								}
+							}
+							for(uint32_t c = 0; c < 3; ++c)
+								history[c] = std::clamp(history[c], minColor[c], maxColor[c]);
+						}
+						// Exponential moving average, which starts out as a plain average of the accumulated frames
+						auto alpha = std::max(m_settings.blendFactor, 1.f / (historyLength + 1.f));
+						for(uint32_t c = 0; c < 3; ++c)
+							result[c] = history[c] + (result[c] - history[c]) * alpha;
+					}
+					else
+						historyLength = 0.f;
+				}
+			}
+			m_nextHistoryLength[idx] = historyLength + 1.f;
+			std::memcpy(&m_nextHistory[idx * 3], result.data(), sizeof(float) * 3);
+			write_rgb(get_pixel_ptr(outputImage, w, x, y), outputHalf, result.data());
+		}
+	}
+	// The history can't be updated in place, since the reprojection may read from anywhere in the previous frame
+	std::swap(m_history, m_nextHistory);
+	std::swap(m_historyLength, m_nextHistoryLength);
+	m_historyDepth = std::move(nextHistoryDepth);
+	return true;
+}
+
+void pragma::scenekit::denoise::compute_camera_motion_vectors(const ImageData &positionImage, uint32_t width, uint32_t height, const Mat4 &prevViewProjection, const ImageData &outMotionImage)
+{
+	auto positionHalf = is_half_format(positionImage.format);
+	auto motionHalf = is_half_format(outMotionImage.format);
+	// Guaranteed to be rejected by the reprojection
+	auto invalidOffset = -static_cast<float>(std::max(width, height)) * 2.f;
+	for(uint32_t y = 0; y < height; ++y) {
+		for(uint32_t x = 0; x < width; ++x) {
+			std::array<float, 3> pos;
+			read_rgb(get_pixel_ptr(positionImage, width, x, y), positionHalf, pos.data());
+			auto clipPos = prevViewProjection * Vector4 {pos[0], pos[1], pos[2], 1.f};
+			auto *px = get_pixel_ptr(outMotionImage, width, x, y);
+			if(clipPos.w <= 0.f) {
+				write_channel(px, motionHalf, 0, invalidOffset);
+				write_channel(px, motionHalf, 1, invalidOffset);
+				continue;
+			}
+			// NDC to pixel coordinates of the previous frame (top row first), relative to the pixel center
+			auto prevX = (clipPos.x / clipPos.w * 0.5f + 0.5f) * static_cast<float>(width) - 0.5f;
+			auto prevY = (0.5f - clipPos.y / clipPos.w * 0.5f) * static_cast<float>(height) - 0.5f;
+			write_channel(px, motionHalf, 0, prevX - static_cast<float>(x));
+			write_channel(px, motionHalf, 1, prevY - static_cast<float>(y));
+		}
+	}
+}
+
+pragma::scenekit::denoise::ChartMask pragma::scenekit::denoise::generate_chart_mask(const std::vector<Vector2> &lightmapUvs, const std::vector<int> &triangles, uint32_t width, uint32_t height, bool flipV)
+{
+	ChartMask mask {};
+	mask.width = width;
+	mask.height = height;
+	mask.chartIds.resize(static_cast<size_t>(width) * height, ChartMask::NO_CHART);
+	auto numVerts = lightmapUvs.size();
+	if(numVerts == 0 || width == 0 || height == 0)
+		return mask;
+
+	std::vector<uint32_t> parents(numVerts);
+	std::iota(parents.begin(), parents.end(), 0u);
+	auto findRoot = [&parents](uint32_t i) {
+		while(parents[i] != i) {
+			parents[i] = parents[parents[i]];
+			i = parents[i];
+		}
+		return i;
+	};
+	auto unite = [&parents, &findRoot](uint32_t a, uint32_t b) {
+		a = findRoot(a);
+		b = findRoot(b);
+		if(a != b)
+			parents[b] = a;
+	};
+	// Vertices that have been split for other attributes (e.g. hard normals) are still connected if their lightmap uvs are identical
+	std::unordered_map<uint64_t, uint32_t> uvVertices;
+	uvVertices.reserve(numVerts);
+	for(uint32_t i = 0; i < numVerts; ++i) {
+		auto &uv = lightmapUvs[i];
+		auto key = (static_cast<uint64_t>(std::bit_cast<uint32_t>(uv.x)) << 32) | std::bit_cast<uint32_t>(uv.y);
+		auto it = uvVertices.find(key);
+		if(it == uvVertices.end())
+			uvVertices.insert(it, {key, i});
+		else
+			unite(it->second, i);
+	}
+	auto isValidTriangle = [&triangles, numVerts](size_t i) {
+		for(size_t j = 0; j < 3; ++j) {
+			auto idx = triangles[i + j];
+			if(idx < 0 || static_cast<size_t>(idx) >= numVerts)
+				return false;
+		}
+		return true;
+	};
+	for(size_t i = 0; i + 2 < triangles.size(); i += 3) {
+		if(!isValidTriangle(i))
+			continue;
+		unite(triangles[i], triangles[i + 1]);
+		unite(triangles[i], triangles[i + 2]);
+	}
+
+	auto toTexelSpace = [width, height, flipV](const Vector2 &uv) {
+		auto v = flipV ? (1.f - uv.y) : uv.y;
+		return Vector2 {uv.x * static_cast<float>(width) - 0.5f, v * static_cast<float>(height) - 0.5f};
+	};
+	auto edge = [](const Vector2 &a, const Vector2 &b, const Vector2 &p) { return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x); };
+	std::vector<uint32_t> rootChartIds(numVerts, ChartMask::NO_CHART);
+	for(size_t i = 0; i + 2 < triangles.size(); i += 3) {
+		if(!isValidTriangle(i))
+			continue;
+		auto &chartId = rootChartIds[findRoot(triangles[i])];
+		if(chartId == ChartMask::NO_CHART)
+			chartId = ++mask.chartCount;
+
+		auto p0 = toTexelSpace(lightmapUvs[triangles[i]]);
+		auto p1 = toTexelSpace(lightmapUvs[triangles[i + 1]]);
+		auto p2 = toTexelSpace(lightmapUvs[triangles[i + 2]]);
+		auto area = edge(p0, p1, p2);
+		if(std::abs(area) < std::numeric_limits<float>::epsilon())
+			continue;
+		auto x0 = std::max(std::ceil(std::min({p0.x, p1.x, p2.x})), 0.f);
+		auto y0 = std::max(std::ceil(std::min({p0.y, p1.y, p2.y})), 0.f);
+		auto x1 = std::min(std::floor(std::max({p0.x, p1.x, p2.x})), static_cast<float>(width - 1));
+		auto y1 = std::min(std::floor(std::max({p0.y, p1.y, p2.y})), static_cast<float>(height - 1));
+		if(x0 > x1 || y0 > y1)
+			continue;
+		// Texel centers on an edge are included, regardless of the winding order
+		auto sign = (area > 0.f) ? 1.f : -1.f;
+		for(auto y = static_cast<uint32_t>(y0); y <= static_cast<uint32_t>(y1); ++y) {
+			for(auto x = static_cast<uint32_t>(x0); x <= static_cast<uint32_t>(x1); ++x) {
+				Vector2 p {static_cast<float>(x), static_cast<float>(y)};
+				if(edge(p1, p2, p) * sign < 0.f || edge(p2, p0, p) * sign < 0.f || edge(p0, p1, p) * sign < 0.f)
+					continue;
+				mask.chartIds[static_cast<size_t>(y) * width + x] = chartId;
+			}
+		}
+	}
+	return mask;
+}
+
+namespace {
+	// Dilation steps on RGBA float texels, stops early once there's nothing left to fill
+	void dilate_texels(std::vector<float> &texels, std::vector<uint32_t> &chartIds, uint32_t w, uint32_t h, uint32_t steps)
+	{
+		if(steps == 0)
+			return;
+		auto dstTexels = texels;
+		auto dstChartIds = chartIds;
+		for(uint32_t i = 0; i < steps; ++i) {
+			if(pragma::scenekit::tile_kernels::dilate_rgba32f(texels.data(), chartIds.data(), dstTexels.data(), dstChartIds.data(), w, h) == 0)
+				break;
+			texels = dstTexels;
+			chartIds = dstChartIds;
+		}
+	}
+	// Chart regions are rounded up to a multiple of this size, so that charts of similar sizes can re-use a cached denoiser filter
+	constexpr uint32_t CHART_REGION_SIZE_GRANULARITY = 32;
+};
+
+bool pragma::scenekit::denoise::denoise_lightmap_charts(const Info &denoise, const ImageData &inputImage, const ImageData &outputImage, const ChartMask &chartMask, const ChartDenoiseInfo &chartInfo,
+  const std::function<bool(float)> &fProgressCallback)
+{
+	auto w = denoise.width;
+	auto h = denoise.height;
+	auto numTexels = static_cast<size_t>(w) * h;
+	if(chartMask.width != w || chartMask.height != h || chartMask.chartIds.size() != numTexels) {
+		std::cout << "Unable to denoise lightmap charts: Chart mask resolution " << chartMask.width << "x" << chartMask.height << " does not match image resolution " << w << "x" << h << "!" << std::endl;
+		return false;
+	}
+
+	// Working copy in RGBA float, which is the format the dilation kernel operates on
+	std::vector<float> texels(numTexels * 4);
+	auto inputHalf = is_half_format(inputImage.format);
+	for(uint32_t y = 0; y < h; ++y) {
+		for(uint32_t x = 0; x < w; ++x) {
+			auto *texel = &texels[(static_cast<size_t>(y) * w + x) * 4];
+			read_rgb(get_pixel_ptr(inputImage, w, x, y), inputHalf, texel);
+			texel[3] = 1.f;
+		}
+	}
+	auto result = texels;
+
+	auto info = denoise;
+	info.lightmap = true;
+	auto margin = chartInfo.isolationMargin;
+	if(chartInfo.mode == ChartMode::Masked) {
+		auto chartIds = chartMask.chartIds;
+		dilate_texels(result, chartIds, w, h, margin);
+		ImageData img {reinterpret_cast<uint8_t *>(result.data()), uimg::Format::RGBA32};
+		ImageInputs inputs {};
+		inputs.beautyImage = img;
+		Denoiser denoiser {};
+		if(!denoiser.Denoise(info, inputs, img, fProgressCallback))
+			return false;
+	}
+	else {
+		struct Bounds {
+			uint32_t x0 = std::numeric_limits<uint32_t>::max();
+			uint32_t y0 = std::numeric_limits<uint32_t>::max();
+			uint32_t x1 = 0;
+			uint32_t y1 = 0;
+		};
+		std::vector<Bounds> chartBounds(chartMask.chartCount + 1);
+		for(uint32_t y = 0; y < h; ++y) {
+			for(uint32_t x = 0; x < w; ++x) {
+				auto chartId = chartMask.chartIds[static_cast<size_t>(y) * w + x];
+				if(chartId == ChartMask::NO_CHART || chartId > chartMask.chartCount)
+					continue;
+				auto &bounds = chartBounds[chartId];
+				bounds.x0 = std::min(bounds.x0, x);
+				bounds.y0 = std::min(bounds.y0, y);
+				bounds.x1 = std::max(bounds.x1, x + 1);
+				bounds.y1 = std::max(bounds.y1, y + 1);
+			}
+		}
+		auto alignExtent = [](uint32_t &start, uint32_t end, uint32_t size) {
+			auto extent = std::min((((end - start) + CHART_REGION_SIZE_GRANULARITY - 1) / CHART_REGION_SIZE_GRANULARITY) * CHART_REGION_SIZE_GRANULARITY, size);
+			start = std::min(start, size - extent);
+			return extent;
+		};
+
+		auto numConcurrentCharts = std::clamp(chartInfo.maxConcurrentCharts, 1u, std::max(chartMask.chartCount, 1u));
+		auto numThreads = (denoise.numThreads > 0) ? denoise.numThreads : std::max(std::thread::hardware_concurrency(), 1u);
+		info.numThreads = std::max(numThreads / numConcurrentCharts, 1u);
+
+		std::atomic<uint32_t> nextChart = 1;
+		std::atomic<uint32_t> numChartsDone = 0;
+		std::atomic<bool> cancelled = false;
+		std::atomic<bool> failed = false;
+		std::mutex progressMutex;
+		auto denoiseCharts = [&]() {
+			for(;;) {
+				auto chartId = nextChart++;
+				if(chartId > chartMask.chartCount || cancelled || failed)
+					break;
+				auto &bounds = chartBounds[chartId];
+				if(bounds.x0 < bounds.x1) {
+					auto x0 = (bounds.x0 > margin) ? (bounds.x0 - margin) : 0;
+					auto y0 = (bounds.y0 > margin) ? (bounds.y0 - margin) : 0;
+					auto rw = alignExtent(x0, std::min(bounds.x1 + margin, w), w);
+					auto rh = alignExtent(y0, std::min(bounds.y1 + margin, h), h);
+
+					// Everything around the chart (including other charts) is replaced with texels dilated from the chart itself
+					std::vector<float> regionTexels(static_cast<size_t>(rw) * rh * 4, 0.f);
+					std::vector<uint32_t> regionChartIds(static_cast<size_t>(rw) * rh, ChartMask::NO_CHART);
+					for(uint32_t y = 0; y < rh; ++y) {
+						for(uint32_t x = 0; x < rw; ++x) {
+							auto idx = static_cast<size_t>(y0 + y) * w + (x0 + x);
+							if(chartMask.chartIds[idx] != chartId)
+								continue;
+							auto regionIdx = static_cast<size_t>(y) * rw + x;
+							std::memcpy(&regionTexels[regionIdx * 4], &texels[idx * 4], sizeof(float) * 4);
+							regionChartIds[regionIdx] = chartId;
+						}
+					}
+					dilate_texels(regionTexels, regionChartIds, rw, rh, margin);
+
+					auto regionInfo = info;
+					regionInfo.width = rw;
+					regionInfo.height = rh;
+					ImageData img {reinterpret_cast<uint8_t *>(regionTexels.data()), uimg::Format::RGBA32};
+					ImageInputs inputs {};
+					inputs.beautyImage = img;
+					Denoiser denoiser {};
+					if(!denoiser.Denoise(regionInfo, inputs, img, [&cancelled](float progress) -> bool { return !cancelled; })) {
+						failed = true;
+						break;
+					}
+					// Charts don't overlap, so the threads never write the same texels
+					for(uint32_t y = 0; y < rh; ++y) {
+						for(uint32_t x = 0; x < rw; ++x) {
+							auto idx = static_cast<size_t>(y0 + y) * w + (x0 + x);
+							if(chartMask.chartIds[idx] == chartId)
+								std::memcpy(&result[idx * 4], &regionTexels[(static_cast<size_t>(y) * rw + x) * 4], sizeof(float) * 3);
+						}
+					}
+				}
+				auto progress = static_cast<float>(++numChartsDone) / static_cast<float>(chartMask.chartCount);
+				if(fProgressCallback) {
+					std::scoped_lock lock {progressMutex};
+					if(!fProgressCallback(progress))
+						cancelled = true;
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		threads.reserve(numConcurrentCharts - 1);
+		for(uint32_t i = 1; i < numConcurrentCharts; ++i)
+			threads.emplace_back(denoiseCharts);
+		denoiseCharts();
+		for(auto &t : threads)
+			t.join();
+		if(failed || cancelled)
+			return false;
+	}
+
+	// Texels outside of the charts aren't part of the result, apart from the dilated border
+	auto chartIds = chartMask.chartIds;
+	auto filled = result;
+	for(size_t i = 0; i < numTexels; ++i) {
+		if(chartIds[i] == ChartMask::NO_CHART)
+			std::fill_n(&filled[i * 4], 4, 0.f);
+	}
+	dilate_texels(filled, chartIds, w, h, chartInfo.dilation);
+	auto outputHalf = is_half_format(outputImage.format);
+	for(uint32_t y = 0; y < h; ++y) {
+		for(uint32_t x = 0; x < w; ++x) {
+			auto idx = static_cast<size_t>(y) * w + x;
+			if(chartIds[idx] != ChartMask::NO_CHART)
+				write_rgb(get_pixel_ptr(outputImage, w, x, y), outputHalf, &filled[idx * 4]);
+		}
+	}
+	return true;
 }
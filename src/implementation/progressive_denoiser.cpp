@@ -0,0 +1,252 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_buffer.hpp>
+#include <util_ocio.hpp>
+#include <cinttypes>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+module pragma.scenekit;
+
+import :progressive_denoiser;
+import :denoise;
+
+// Dirty regions are rounded up to a multiple of this size, so that consecutive passes are more likely to re-use a cached denoiser filter
+static constexpr uint32_t REGION_SIZE_GRANULARITY = 128;
+// Number of revisions for which the changed region is kept, viewers that fall further behind have to re-read the full image
+static constexpr size_t MAX_CHANGED_RECT_HISTORY = 64;
+
+pragma::scenekit::ProgressiveDenoiser::ProgressiveDenoiser(TileManager &tileManager, const Settings &settings) : m_tileManager {tileManager}, m_settings {settings} {}
+pragma::scenekit::ProgressiveDenoiser::~ProgressiveDenoiser() { Stop(); }
+
+void pragma::scenekit::ProgressiveDenoiser::Start()
+{
+	if(m_running)
+		return;
+	m_running = true;
+	m_thread = std::thread {[this]() { Run(); }};
+}
+void pragma::scenekit::ProgressiveDenoiser::Stop()
+{
+	{
+		std::scoped_lock lock {m_wakeMutex};
+		m_running = false;
+	}
+	m_wakeCondition.notify_all();
+	if(m_thread.joinable())
+		m_thread.join();
+}
+void pragma::scenekit::ProgressiveDenoiser::Reset() { m_resetRequested = true; }
+
+pragma::scenekit::ProgressiveDenoiser::Result pragma::scenekit::ProgressiveDenoiser::GetResult(uint64_t sinceRevision) const
+{
+	std::scoped_lock lock {m_resultMutex};
+	auto result = m_result;
+	if(!result.image || sinceRevision >= result.revision) {
+		result.rect = {};
+		return result;
+	}
+	result.rect = {0, 0, result.image->GetWidth(), result.image->GetHeight()};
+	if(sinceRevision == 0 || m_changedRects.empty() || m_changedRects.front().first > sinceRevision + 1)
+		return result;
+	uint32_t x0 = std::numeric_limits<uint32_t>::max();
+	uint32_t y0 = std::numeric_limits<uint32_t>::max();
+	uint32_t x1 = 0;
+	uint32_t y1 = 0;
+	for(auto &[revision, rect] : m_changedRects) {
+		if(revision <= sinceRevision)
+			continue;
+		x0 = std::min(x0, rect.x);
+		y0 = std::min(y0, rect.y);
+		x1 = std::max(x1, rect.x + rect.w);
+		y1 = std::max(y1, rect.y + rect.h);
+	}
+	result.rect = {x0, y0, x1 - x0, y1 - y0};
+	return result;
+}
+
+void pragma::scenekit::ProgressiveDenoiser::Run()
+{
+	while(m_running) {
+		auto tStart = std::chrono::steady_clock::now();
+		if(DenoisePass())
+			m_lastPassDuration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart).count();
+
+		std::unique_lock lock {m_wakeMutex};
+		m_wakeCondition.wait_until(lock, tStart + m_settings.interval, [this]() { return !m_running; });
+	}
+}
+
+bool pragma::scenekit::ProgressiveDenoiser::InitializeImages()
+{
+	auto progressiveImage = m_tileManager.GetPreviewLevel(0);
+	if(!progressiveImage)
+		return false;
+	auto w = progressiveImage->GetWidth();
+	auto h = progressiveImage->GetHeight();
+	auto format = progressiveImage->GetFormat();
+	if(m_inputImage && m_inputImage->GetWidth() == w && m_inputImage->GetHeight() == h && m_inputImage->GetFormat() == format)
+		return true;
+	auto createImage = [w, h, format]() {
+		auto img = uimg::ImageBuffer::Create(w, h, format);
+		std::memset(img->GetData(), 0, img->GetSize());
+		return img;
+	};
+	auto hasAov = [this](const std::optional<PassType> &type) {
+		if(!type.has_value())
+			return false;
+		auto &aovs = m_tileManager.GetAovs();
+		return std::find_if(aovs.begin(), aovs.end(), [&type](const TileManager::AovInfo &aov) { return aov.type == *type; }) != aovs.end();
+	};
+	m_inputImage = createImage();
+	m_denoisedImage = createImage();
+	m_denoisedImage->ClearAlpha();
+	// The denoiser only accepts normals in combination with albedo
+	m_albedoImage = hasAov(m_settings.albedoPass) ? createImage() : nullptr;
+	m_normalImage = (m_albedoImage && hasAov(m_settings.normalPass)) ? createImage() : nullptr;
+	m_tileRevisions.clear();
+	return true;
+}
+
+bool pragma::scenekit::ProgressiveDenoiser::DenoisePass()
+{
+	if(m_resetRequested.exchange(false))
+		m_tileRevisions.clear();
+	if(!InitializeImages())
+		return false;
+	std::vector<std::pair<PassType, uimg::ImageBuffer *>> aovImages;
+	if(m_albedoImage)
+		aovImages.push_back({*m_settings.albedoPass, m_albedoImage.get()});
+	if(m_normalImage)
+		aovImages.push_back({*m_settings.normalPass, m_normalImage.get()});
+	auto rects = m_tileManager.CopyCompletedTiles(m_tileRevisions, *m_inputImage, aovImages);
+	if(rects.empty())
+		return false;
+
+	auto w = m_inputImage->GetWidth();
+	auto h = m_inputImage->GetHeight();
+	TileManager::TileRect region {0, 0, w, h};
+	if(m_settings.dirtyRegionsOnly) {
+		uint32_t x0 = std::numeric_limits<uint32_t>::max();
+		uint32_t y0 = std::numeric_limits<uint32_t>::max();
+		uint32_t x1 = 0;
+		uint32_t y1 = 0;
+		for(auto &rect : rects) {
+			x0 = std::min(x0, rect.x);
+			y0 = std::min(y0, rect.y);
+			x1 = std::max(x1, rect.x + rect.w);
+			y1 = std::max(y1, rect.y + rect.h);
+		}
+		auto margin = m_settings.dirtyRegionMargin;
+		x0 = (x0 > margin) ? (x0 - margin) : 0;
+		y0 = (y0 > margin) ? (y0 - margin) : 0;
+		x1 = std::min(x1 + margin, w);
+		y1 = std::min(y1 + margin, h);
+
+		auto alignExtent = [](uint32_t &start, uint32_t end, uint32_t size) {
+			auto extent = std::min((((end - start) + REGION_SIZE_GRANULARITY - 1) / REGION_SIZE_GRANULARITY) * REGION_SIZE_GRANULARITY, size);
+			start = std::min(start, size - extent);
+			return extent;
+		};
+		region.w = alignExtent(x0, x1, w);
+		region.h = alignExtent(y0, y1, h);
+		region.x = x0;
+		region.y = y0;
+	}
+
+	denoise::Info info {};
+	info.width = region.w;
+	info.height = region.h;
+	info.numThreads = m_settings.numThreads;
+	// Runs next to the renderer
+	info.setAffinity = false;
+
+	// Strided views of the region, nothing is copied
+	auto pixelSize = uimg::ImageBuffer::GetPixelSize(m_inputImage->GetFormat());
+	auto getRegionView = [&region, w, pixelSize](uimg::ImageBuffer &img) {
+		denoise::ImageData imgData {};
+		imgData.data = static_cast<uint8_t *>(img.GetData()) + (static_cast<size_t>(region.y) * w + region.x) * pixelSize;
+		imgData.format = img.GetFormat();
+		imgData.rowStride = static_cast<uint32_t>(w * pixelSize);
+		return imgData;
+	};
+	denoise::ImageInputs inputs {};
+	inputs.beautyImage = getRegionView(*m_inputImage);
+	if(m_albedoImage)
+		inputs.albedoImage = getRegionView(*m_albedoImage);
+	if(m_normalImage)
+		inputs.normalImage = getRegionView(*m_normalImage);
+
+	denoise::Denoiser denoiser {};
+	if(!denoiser.Denoise(info, inputs, getRegionView(*m_denoisedImage), [this](float) -> bool { return m_running; }))
+		return false;
+	Publish(region);
+	return true;
+}
+
+void pragma::scenekit::ProgressiveDenoiser::Publish(const TileManager::TileRect &rect)
+{
+	auto format = m_denoisedImage->GetFormat();
+	auto w = m_denoisedImage->GetWidth();
+	auto pixelSize = uimg::ImageBuffer::GetPixelSize(format);
+	auto copyRows = [](const uint8_t *src, size_t srcRowStride, uint8_t *dst, size_t dstRowStride, uint32_t rowSize, uint32_t rowCount) {
+		for(uint32_t y = 0; y < rowCount; ++y)
+			std::memcpy(dst + y * dstRowStride, src + y * srcRowStride, rowSize);
+	};
+	auto imgRowStride = static_cast<size_t>(w) * pixelSize;
+	auto regionRowStride = static_cast<size_t>(rect.w) * pixelSize;
+	auto regionOffset = static_cast<size_t>(rect.y) * imgRowStride + static_cast<size_t>(rect.x) * pixelSize;
+
+	// Only the changed region goes through the color transform
+	auto regionImg = uimg::ImageBuffer::Create(rect.w, rect.h, format);
+	copyRows(static_cast<const uint8_t *>(m_denoisedImage->GetData()) + regionOffset, imgRowStride, static_cast<uint8_t *>(regionImg->GetData()), regionRowStride, regionRowStride, rect.h);
+	auto *colorProcessor = m_settings.applyColorTransform ? m_tileManager.GetColorTransformProcessor() : nullptr;
+	if(colorProcessor) {
+		std::string err;
+		if(colorProcessor->Apply(*regionImg, err) == false)
+			std::cout << "Unable to apply color transform to denoised preview: " << err << std::endl;
+	}
+
+	std::scoped_lock lock {m_resultMutex};
+	auto &img = m_result.image;
+	auto changedRect = rect;
+	if(img && (img->GetWidth() != w || img->GetHeight() != m_denoisedImage->GetHeight() || img->GetFormat() != format)) {
+		// The layout has changed (e.g. after the tile manager has been re-initialized with a different resolution), none of the previous contents can be kept
+		img = nullptr;
+	}
+	if(!img) {
+		changedRect = {0, 0, w, m_denoisedImage->GetHeight()};
+		m_changedRects.clear();
+	}
+	if(!img || img.use_count() > 1) {
+		// The previous result may still be in use by a viewer, so it can't be modified
+		auto newImg = uimg::ImageBuffer::Create(w, m_denoisedImage->GetHeight(), format);
+		if(img)
+			std::memcpy(newImg->GetData(), img->GetData(), img->GetSize());
+		else {
+			std::memset(newImg->GetData(), 0, newImg->GetSize());
+			newImg->ClearAlpha();
+		}
+		img = newImg;
+	}
+	copyRows(static_cast<const uint8_t *>(regionImg->GetData()), regionRowStride, static_cast<uint8_t *>(img->GetData()) + regionOffset, imgRowStride, regionRowStride, rect.h);
+	m_result.revision = ++m_revision;
+	m_result.rect = changedRect;
+	m_changedRects.push_back({m_result.revision, changedRect});
+	if(m_changedRects.size() > MAX_CHANGED_RECT_HISTORY)
+		m_changedRects.pop_front();
+}
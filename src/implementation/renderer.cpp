@@ -8,6 +8,8 @@
 module;
 
 #include <iostream>
+#include <algorithm>
+#include <mutex>
 #include <util_image_buffer.hpp>
 #include <util_ocio.hpp>
 #include <sharedutils/util_path.hpp>
@@ -174,24 +176,32 @@ util::EventReply pragma::scenekit::Renderer::HandleRenderStage(RenderWorker &wor
 	switch(stage) {
 	case ImageRenderStage::Denoise:
 		{
-			auto denoiseImg = [this, eyeStage, &worker](uimg::ImageBuffer &imgBuf, bool lightmap) {
+			// All images of this stage are independent of each other, so they're denoised concurrently in the background.
+			// The jobs are waited for right before the respective image is needed, which allows denoising to overlap with the color transform
+			// of other passes, and (for stereo renders) the left eye to be denoised while the right eye is being rendered.
+			std::vector<denoise::BatchItem> denoiseBatch;
+			std::vector<std::shared_ptr<uimg::ImageBuffer>> denoiseImages;
+			auto addDenoiseImage = [this, eyeStage, &denoiseBatch, &denoiseImages](const std::shared_ptr<uimg::ImageBuffer> &imgBuf, bool lightmap) {
 				auto albedoImageBuffer = GetResultImageBuffer(PassType::Albedo, eyeStage);
 				auto normalImageBuffer = GetResultImageBuffer(PassType::Normals, eyeStage);
 
 				denoise::Info denoiseInfo {};
-				denoiseInfo.width = imgBuf.GetWidth();
-				denoiseInfo.height = imgBuf.GetHeight();
+				denoiseInfo.width = imgBuf->GetWidth();
+				denoiseInfo.height = imgBuf->GetHeight();
 				denoiseInfo.lightmap = lightmap;
-				denoise::denoise(denoiseInfo, imgBuf, albedoImageBuffer.get(), normalImageBuffer.get(), [this, &worker](float progress) -> bool { return !worker.IsCancelled(); });
+				// The denoiser may run next to the renderer, so thread placement is left to the OS scheduler
+				denoiseInfo.setAffinity = false;
+				denoiseBatch.push_back(denoise::make_batch_item(denoiseInfo, *imgBuf, albedoImageBuffer.get(), normalImageBuffer.get()));
+				denoiseImages.push_back(imgBuf);
 			};
 			if(Scene::IsLightmapRenderMode(m_scene->GetRenderMode())) {
 				switch(m_scene->GetRenderMode()) {
 				case Scene::RenderMode::BakeDiffuseLighting:
-					denoiseImg(*GetResultImageBuffer(PassType::Diffuse, eyeStage), true);
+					addDenoiseImage(GetResultImageBuffer(PassType::Diffuse, eyeStage), true);
 					break;
 				case Scene::RenderMode::BakeDiffuseLightingSeparate:
-					denoiseImg(*GetResultImageBuffer(PassType::DiffuseDirect, eyeStage), true);
-					denoiseImg(*GetResultImageBuffer(PassType::DiffuseIndirect, eyeStage), true);
+					addDenoiseImage(GetResultImageBuffer(PassType::DiffuseDirect, eyeStage), true);
+					addDenoiseImage(GetResultImageBuffer(PassType::DiffuseIndirect, eyeStage), true);
 					break;
 				}
 			}
@@ -207,13 +217,23 @@ util::EventReply pragma::scenekit::Renderer::HandleRenderStage(RenderWorker &wor
 						resultImageBuffer = GetResultImageBuffer(PassType::Albedo, eyeStage);
 					else if(dbgNormals)
 						resultImageBuffer = GetResultImageBuffer(PassType::Normals, eyeStage);
-					else {
-						denoiseImg(*resultImageBuffer, false);
-						if(ShouldDumpRenderStageImages())
-							DumpImage("denoise", *resultImageBuffer, uimg::ImageFormat::HDR);
-					}
+					else
+						addDenoiseImage(resultImageBuffer, false);
 				}
 			}
+			std::shared_ptr<const denoise::ChartMask> chartMask = nullptr;
+			if(Scene::IsLightmapRenderMode(m_scene->GetRenderMode()) && !denoiseImages.empty())
+				chartMask = CreateLightmapChartMask(denoiseImages.front()->GetWidth(), denoiseImages.front()->GetHeight());
+			// The albedo and normal images are read by all jobs of this stage, so they must not be post-processed before the jobs have completed
+			std::vector<std::shared_ptr<uimg::ImageBuffer>> auxImages;
+			if(!denoiseImages.empty()) {
+				for(auto type : {PassType::Albedo, PassType::Normals}) {
+					auto &auxImageBuffer = GetResultImageBuffer(type, eyeStage);
+					if(auxImageBuffer)
+						auxImages.push_back(auxImageBuffer);
+				}
+			}
+			StartDenoiseJobs(worker, denoiseBatch, denoiseImages, auxImages, ShouldDumpRenderStageImages() && !Scene::IsLightmapRenderMode(m_scene->GetRenderMode()), chartMask);
 
 			if(UpdateStereoEye(worker, stage, eyeStage)) {
 				if(optResult)
@@ -229,6 +249,7 @@ util::EventReply pragma::scenekit::Renderer::HandleRenderStage(RenderWorker &wor
 				auto &resultImageBuffer = pair.second[umath::to_integral((eyeStage != StereoEye::None) ? eyeStage : StereoEye::Left)];
 				if(!resultImageBuffer)
 					continue;
+				WaitForDenoiseJobs(resultImageBuffer.get());
 				if(ShouldDumpRenderStageImages())
 					DumpImage("raw_output", *resultImageBuffer, uimg::ImageFormat::PNG);
 				if(m_colorTransformProcessor) // TODO: Should we really apply color transform if we're not denoising?
@@ -256,6 +277,7 @@ util::EventReply pragma::scenekit::Renderer::HandleRenderStage(RenderWorker &wor
 		}
 	case ImageRenderStage::MergeStereoscopic:
 		{
+			WaitForDenoiseJobs();
 			auto passType = get_main_pass_type(m_scene->GetRenderMode());
 			if(passType.has_value()) {
 				auto &imgLeft = GetResultImageBuffer(*passType, StereoEye::Left);
@@ -275,6 +297,7 @@ util::EventReply pragma::scenekit::Renderer::HandleRenderStage(RenderWorker &wor
 		}
 	case ImageRenderStage::Finalize:
 		// We're done here
+		WaitForDenoiseJobs();
 		CloseRenderScene();
 		if(optResult)
 			*optResult = RenderStageResult::Complete;
@@ -345,11 +368,100 @@ pragma::scenekit::Object *pragma::scenekit::Renderer::FindObject(const std::stri
 }
 void pragma::scenekit::Renderer::OnParallelWorkerCancelled()
 {
+	CancelDenoiseJobs();
 	SetCancelled();
 	// m_session->set_pause(true);
 	// StopRendering();
 }
+void pragma::scenekit::Renderer::StartDenoiseJobs(RenderWorker &worker, const std::vector<denoise::BatchItem> &items, const std::vector<std::shared_ptr<uimg::ImageBuffer>> &images,
+  const std::vector<std::shared_ptr<uimg::ImageBuffer>> &auxImages, bool dumpImages, const std::shared_ptr<const denoise::ChartMask> &chartMask)
+{
+	if(items.empty())
+		return;
+	// The jobs are cancelled while the job mutex is locked, so no job can be started after the render has been cancelled
+	std::scoped_lock lock {m_denoiseJobMutex};
+	if(worker.IsCancelled())
+		return;
+	m_denoiseJobsCancelled = false;
+	auto fProgressCallback = [this](float) -> bool { return !m_denoiseJobsCancelled; };
+	// All images of this stage are denoised by one job, which shares the thread budget between them
+	denoise::DenoiseJob job {};
+	if(chartMask && m_lightmapChartDenoiseInfo.has_value()) {
+		// Only lightmap images have a chart mask. The charts of an image are already denoised concurrently, so the images are denoised one after another with all threads.
+		// The job shares ownership of the chart mask, the images are kept alive by the pending job entries
+		job = denoise::DenoiseJob::Start(
+		  [items, chartMask, chartInfo = *m_lightmapChartDenoiseInfo](const std::function<bool(float)> &fJobProgressCallback) -> bool {
+			  for(size_t i = 0; i < items.size(); ++i) {
+				  auto info = items[i].info;
+				  info.numThreads = 0;
+				  auto res = denoise::denoise_lightmap_charts(info, items[i].inputImages.beautyImage, items[i].outputImage, *chartMask, chartInfo,
+				    [&fJobProgressCallback, i, numItems = items.size()](float progress) -> bool { return fJobProgressCallback((static_cast<float>(i) + progress) / static_cast<float>(numItems)); });
+				  if(!res)
+					  return false;
+			  }
+			  return true;
+		  },
+		  std::move(fProgressCallback));
+	}
+	else
+		job = denoise::denoise_batch_async(items, 0, std::move(fProgressCallback));
+	// Copies of the job handle refer to the same job, so waiting for any of the images waits for the whole stage
+	for(auto &image : images)
+		m_denoiseJobs.push_back({image, auxImages, job, dumpImages});
+}
+void pragma::scenekit::Renderer::SetLightmapChartDenoising(const std::optional<denoise::ChartDenoiseInfo> &chartInfo, bool flipV)
+{
+	m_lightmapChartDenoiseInfo = chartInfo;
+	m_lightmapChartMaskFlipV = flipV;
+}
+std::shared_ptr<const pragma::scenekit::denoise::ChartMask> pragma::scenekit::Renderer::CreateLightmapChartMask(uint32_t width, uint32_t height) const
+{
+	if(!m_lightmapChartDenoiseInfo.has_value())
+		return nullptr;
+	auto *bakeTargetName = m_scene->GetBakeTargetName();
+	auto *o = bakeTargetName ? FindObject(*bakeTargetName) : nullptr;
+	if(!o) {
+		std::cout << "Unable to create lightmap chart mask: Bake target not found! Falling back to regular lightmap denoising..." << std::endl;
+		return nullptr;
+	}
+	auto &mesh = o->GetMesh();
+	auto chartMask = std::make_shared<denoise::ChartMask>(denoise::generate_chart_mask(mesh.GetLightmapUvs(), mesh.GetTriangles(), width, height, m_lightmapChartMaskFlipV));
+	if(chartMask->chartCount == 0) {
+		std::cout << "Unable to create lightmap chart mask: Bake target has no lightmap uvs! Falling back to regular lightmap denoising..." << std::endl;
+		return nullptr;
+	}
+	return chartMask;
+}
+void pragma::scenekit::Renderer::WaitForDenoiseJobs(const uimg::ImageBuffer *imgBuf)
+{
+	std::vector<PendingDenoiseJob> jobs;
+	{
+		std::scoped_lock lock {m_denoiseJobMutex};
+		for(auto it = m_denoiseJobs.begin(); it != m_denoiseJobs.end();) {
+			if(imgBuf && it->image.get() != imgBuf && std::find_if(it->auxImages.begin(), it->auxImages.end(), [imgBuf](const std::shared_ptr<uimg::ImageBuffer> &auxImage) { return auxImage.get() == imgBuf; }) == it->auxImages.end()) {
+				++it;
+				continue;
+			}
+			jobs.push_back(std::move(*it));
+			it = m_denoiseJobs.erase(it);
+		}
+	}
+	for(auto &pendingJob : jobs) {
+		if(!pendingJob.job.Wait())
+			continue;
+		if(pendingJob.dump)
+			DumpImage("denoise", *pendingJob.image, uimg::ImageFormat::HDR);
+	}
+}
+void pragma::scenekit::Renderer::CancelDenoiseJobs()
+{
+	std::scoped_lock lock {m_denoiseJobMutex};
+	m_denoiseJobsCancelled = true;
+	for(auto &pendingJob : m_denoiseJobs)
+		pendingJob.job.Cancel();
+}
 std::vector<pragma::scenekit::TileManager::TileData> pragma::scenekit::Renderer::GetRenderedTileBatch() { return m_tileManager.GetRenderedTileBatch(); }
+void pragma::scenekit::Renderer::ReleaseTileBatch(std::vector<pragma::scenekit::TileManager::TileData> &&tiles) { m_tileManager.ReleaseTileBatch(std::move(tiles)); }
 void pragma::scenekit::Renderer::AddActorToActorMap(WorldObject &obj) { Scene::AddActorToActorMap(m_actorMap, obj); }
 bool pragma::scenekit::Renderer::Initialize()
 {
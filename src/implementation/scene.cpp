@@ -8,6 +8,7 @@
 module;
 
 #include <optional>
+#include <algorithm>
 #include <iostream>
 #include <fsys/filesystem.h>
 #include <sharedutils/datastream.h>
@@ -46,6 +47,7 @@ import :constants;
 import :light;
 import :shader;
 import :denoise;
+import :tile_kernels;
 import :model_cache;
 import :object;
 import :mesh;
@@ -308,39 +310,32 @@ std::optional<std::string> pragma::scenekit::Scene::GetAbsSkyPath(const std::str
 
 static uint32_t calc_pixel_offset(uint32_t imgWidth, uint32_t xOffset, uint32_t yOffset) { return yOffset * imgWidth + xOffset; }
 
-static bool row_contains_visible_pixels(const float *inOutImgData, uint32_t pxStartOffset, uint32_t w)
-{
-	for(auto x = decltype(w) {0u}; x < w; ++x) {
-		if(inOutImgData[(pxStartOffset + x) * 4 + 3] > 0.f)
-			return true;
-	}
-	return false;
-}
-
-static bool col_contains_visible_pixels(const float *inOutImgData, uint32_t pxStartOffset, uint32_t h, uint32_t imgWidth)
-{
-	for(auto y = decltype(h) {0u}; y < h; ++y) {
-		if(inOutImgData[(pxStartOffset + (y * imgWidth)) * 4 + 3] > 0.f)
-			return true;
-	}
-	return false;
-}
-
 static void shrink_area_to_fit(const float *inOutImgData, uint32_t imgWidth, uint32_t &xOffset, uint32_t &yOffset, uint32_t &w, uint32_t &h)
 {
-	while(h > 0 && row_contains_visible_pixels(inOutImgData, calc_pixel_offset(imgWidth, xOffset, yOffset), w) == false) {
-		++yOffset;
-		--h;
+	// Single row-major pass: Rows without visible pixels are trimmed from the top and bottom, while the horizontal extent is
+	// the union of the visible ranges of the remaining rows.
+	uint32_t first, last;
+	auto minX = w;
+	auto maxX = 0u;
+	auto top = h;
+	auto bottom = 0u;
+	for(auto y = decltype(h) {0u}; y < h; ++y) {
+		if(pragma::scenekit::tile_kernels::find_visible_pixel_range_rgba32f(inOutImgData + calc_pixel_offset(imgWidth, xOffset, yOffset + y) * 4, w, first, last) == false)
+			continue;
+		top = std::min(top, y);
+		bottom = y;
+		minX = std::min(minX, first);
+		maxX = std::max(maxX, last);
 	}
-	while(h > 0 && row_contains_visible_pixels(inOutImgData, calc_pixel_offset(imgWidth, xOffset, yOffset + h - 1), w) == false)
-		--h;
-
-	while(w > 0 && col_contains_visible_pixels(inOutImgData, calc_pixel_offset(imgWidth, xOffset, yOffset), h, imgWidth) == false) {
-		++xOffset;
-		--w;
+	if(top == h) {
+		w = 0;
+		h = 0;
+		return;
 	}
-	while(w > 0 && col_contains_visible_pixels(inOutImgData, calc_pixel_offset(imgWidth, xOffset + w - 1, yOffset), h, imgWidth) == false)
-		--w;
+	xOffset += minX;
+	yOffset += top;
+	w = maxX - minX + 1;
+	h = bottom - top + 1;
 }
 
 void pragma::scenekit::Scene::DenoiseHDRImageArea(uimg::ImageBuffer &imgBuffer, uint32_t imgWidth, uint32_t imgHeight, uint32_t xOffset, uint32_t yOffset, uint32_t w, uint32_t h) const
@@ -357,92 +352,30 @@ void pragma::scenekit::Scene::DenoiseHDRImageArea(uimg::ImageBuffer &imgBuffer,
 	// Sanity check
 	auto pxStartOffset = calc_pixel_offset(imgWidth, xOffset, yOffset);
 	for(auto y = decltype(h) {0u}; y < h; ++y) {
-		for(auto x = decltype(w) {0u}; x < w; ++x) {
-			auto srcPxIdx = pxStartOffset + y * imgWidth + x;
-			auto a = imgData[srcPxIdx * 4 + 3];
-			if(a < 1.f) {
-				// This should be unreachable, but just in case...
-				// If this case does occur, that means there are transparent pixels WITHIN the image area, which are not
-				// part of a transparent border!
-				std::cerr << "ERROR: Image area for denoising contains transparent pixel at (" << x << "," << y << ") with alpha of " << a << "! This is not allowed!" << std::endl;
-			}
+		auto *row = imgData + (pxStartOffset + y * imgWidth) * 4;
+		auto x = tile_kernels::find_first_translucent_pixel_rgba32f(row, w);
+		if(x < w) {
+			// This should be unreachable, but just in case...
+			// If this case does occur, that means there are transparent pixels WITHIN the image area, which are not
+			// part of a transparent border!
+			std::cerr << "ERROR: Image area for denoising contains transparent pixel at (" << x << "," << y << ") with alpha of " << row[x * 4 + 3] << "! This is not allowed!" << std::endl;
 		}
 	}
 
-	// White areas
-	/*for(auto y=decltype(h){0u};y<h;++y)
-	{
-	for(auto x=decltype(w){0u};x<w;++x)
-	{
-	auto srcPxIdx = pxStartOffset +y *imgWidth +x;
-	auto dstPxIdx = y *w +x;
-	if(inOutImgData[srcPxIdx *4 +3] == 0.f)
-	{
-	inOutImgData[srcPxIdx *4 +0] = 0.f;
-	inOutImgData[srcPxIdx *4 +1] = 0.f;
-	inOutImgData[srcPxIdx *4 +2] = 0.f;
-	inOutImgData[srcPxIdx *4 +3] = 1.f;
-	}
-	else
-	{
-	inOutImgData[srcPxIdx *4 +0] = 1.f;
-	inOutImgData[srcPxIdx *4 +1] = 1.f;
-	inOutImgData[srcPxIdx *4 +2] = 1.f;
-	inOutImgData[srcPxIdx *4 +3] = 1.f;
-	}
-	}
-	}*/
-
-	std::vector<float> imgAreaData {};
-	imgAreaData.resize(w * h * 3);
-	// Extract the area from the image data
-	for(auto y = decltype(h) {0u}; y < h; ++y) {
-		for(auto x = decltype(w) {0u}; x < w; ++x) {
-			auto srcPxIdx = pxStartOffset + y * imgWidth + x;
-			auto dstPxIdx = y * w + x;
-			for(uint8_t i = 0; i < 3; ++i)
-				imgAreaData.at(dstPxIdx * 3 + i) = imgData[srcPxIdx * 4 + i];
-		}
-	}
-
-	// Denoise the extracted area
+	// The area is denoised in place: The denoiser reads and writes the RGB channels of the sub-rectangle directly through a strided view
+	// of the image, the alpha channel is skipped and left untouched.
 	denoise::Info denoiseInfo {};
 	denoiseInfo.width = w;
 	denoiseInfo.height = h;
 
 	denoise::ImageData denoiseImgData {};
-	denoiseImgData.data = reinterpret_cast<uint8_t *>(imgAreaData.data());
-	denoiseImgData.format = uimg::Format::RGB32;
+	denoiseImgData.data = reinterpret_cast<uint8_t *>(imgData + pxStartOffset * 4);
+	denoiseImgData.format = uimg::Format::RGBA32;
+	denoiseImgData.rowStride = imgWidth * 4 * sizeof(float);
 
 	denoise::ImageInputs inputs {};
 	inputs.beautyImage = denoiseImgData;
 	denoise::denoise(denoiseInfo, inputs, denoiseImgData);
-
-	// Copy the denoised area back into the original image
-	for(auto y = decltype(h) {0u}; y < h; ++y) {
-		for(auto x = decltype(w) {0u}; x < w; ++x) {
-			auto srcPxIdx = pxStartOffset + y * imgWidth + x;
-			//if(inOutImgData[srcPxIdx *4 +3] == 0.f)
-			//	continue; // Alpha is zero; Skip this one
-			auto dstPxIdx = y * w + x;
-			//for(uint8_t i=0;i<3;++i)
-			//	inOutImgData[srcPxIdx *4 +i] = imgAreaData.at(dstPxIdx *3 +i);
-			/*if(inOutImgData[srcPxIdx *4 +3] == 0.f)
-			{
-			inOutImgData[srcPxIdx *4 +0] = 0.f;
-			inOutImgData[srcPxIdx *4 +1] = 0.f;
-			inOutImgData[srcPxIdx *4 +2] = 0.f;
-			inOutImgData[srcPxIdx *4 +3] = 1.f;
-			}
-			else
-			{
-			inOutImgData[srcPxIdx *4 +0] = 1.f;
-			inOutImgData[srcPxIdx *4 +1] = 1.f;
-			inOutImgData[srcPxIdx *4 +2] = 1.f;
-			inOutImgData[srcPxIdx *4 +3] = 1.f;
-			}*/
-		}
-	}
 }
 
 void pragma::scenekit::Scene::Close()
@@ -0,0 +1,287 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#endif
+
+module pragma.scenekit;
+
+import :shared_framebuffer;
+import :tile_kernels;
+
+static constexpr size_t PIXEL_SIZE = sizeof(float) * 4;
+// A writer that crashed mid-write leaves the tile's sequence odd forever, so readers must give up eventually
+static constexpr uint32_t MAX_READ_ATTEMPTS = 10'000;
+static size_t align_offset(size_t offset, size_t alignment) { return (offset + alignment - 1) / alignment * alignment; }
+
+#ifdef __linux__
+static std::string get_shm_name(const std::string &name) { return (!name.empty() && name.front() == '/') ? name : ("/" + name); }
+#endif
+
+std::unique_ptr<pragma::scenekit::SharedFramebuffer> pragma::scenekit::SharedFramebuffer::Create(const CreateInfo &createInfo, uint32_t width, uint32_t height, uint32_t tileWidth, uint32_t tileHeight, std::string &outErr)
+{
+	if(width == 0 || height == 0 || tileWidth == 0 || tileHeight == 0) {
+		outErr = "Invalid framebuffer dimensions!";
+		return nullptr;
+	}
+	auto tileCountX = (width + tileWidth - 1) / tileWidth;
+	auto tileCountY = (height + tileHeight - 1) / tileHeight;
+	auto numTiles = static_cast<size_t>(tileCountX) * tileCountY;
+	auto tileHeaderOffset = align_offset(sizeof(Header), 64);
+	auto pixelDataOffset = align_offset(tileHeaderOffset + numTiles * sizeof(TileHeader), 64);
+	auto size = pixelDataOffset + static_cast<size_t>(width) * height * PIXEL_SIZE;
+
+	auto fb = std::unique_ptr<SharedFramebuffer> {new SharedFramebuffer {}};
+	fb->m_createInfo = createInfo;
+	fb->m_owner = true;
+	if(!fb->Map(size, true, outErr))
+		return nullptr;
+	auto *header = new(fb->m_mapping) Header {};
+	header->version = VERSION;
+	header->width = width;
+	header->height = height;
+	header->tileWidth = tileWidth;
+	header->tileHeight = tileHeight;
+	header->tileCountX = tileCountX;
+	header->tileCountY = tileCountY;
+	header->tileHeaderOffset = tileHeaderOffset;
+	header->pixelDataOffset = pixelDataOffset;
+	header->frameIndex.store(0, std::memory_order_relaxed);
+	fb->m_header = header;
+	for(size_t i = 0; i < numTiles; ++i) {
+		auto *tileHeader = new(static_cast<uint8_t *>(fb->m_mapping) + tileHeaderOffset + i * sizeof(TileHeader)) TileHeader {};
+		tileHeader->sequence.store(0, std::memory_order_relaxed);
+		tileHeader->frameIndex = 0;
+		tileHeader->sample = NO_SAMPLE;
+	}
+	// Readers check the magic value to determine whether the framebuffer has been fully initialized
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = MAGIC;
+	return fb;
+}
+
+std::unique_ptr<pragma::scenekit::SharedFramebuffer> pragma::scenekit::SharedFramebuffer::Open(const CreateInfo &createInfo, std::string &outErr)
+{
+	auto fb = std::unique_ptr<SharedFramebuffer> {new SharedFramebuffer {}};
+	fb->m_createInfo = createInfo;
+	if(!fb->Map(0, false, outErr))
+		return nullptr;
+	fb->m_header = static_cast<Header *>(fb->m_mapping);
+	if(fb->m_mappingSize < sizeof(Header) || fb->m_header->magic != MAGIC || fb->m_header->version != VERSION) {
+		outErr = "Shared framebuffer '" + createInfo.name + "' is not a valid framebuffer or has an incompatible version!";
+		return nullptr;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	auto &header = *fb->m_header;
+	if(header.pixelDataOffset + static_cast<size_t>(header.width) * header.height * PIXEL_SIZE > fb->m_mappingSize) {
+		outErr = "Shared framebuffer '" + createInfo.name + "' is truncated!";
+		return nullptr;
+	}
+	return fb;
+}
+
+bool pragma::scenekit::SharedFramebuffer::Map(size_t size, bool create, std::string &outErr)
+{
+#ifdef __linux__
+	auto flags = create ? (O_CREAT | O_RDWR | O_TRUNC) : O_RDONLY;
+	if(m_createInfo.backing == Backing::SharedMemory)
+		m_fd = shm_open(get_shm_name(m_createInfo.name).c_str(), flags, 0600);
+	else
+		m_fd = open(m_createInfo.name.c_str(), flags, 0600);
+	if(m_fd == -1) {
+		outErr = "Unable to open '" + m_createInfo.name + "': " + std::strerror(errno);
+		return false;
+	}
+	if(create) {
+		if(ftruncate(m_fd, size) != 0) {
+			outErr = "Unable to resize '" + m_createInfo.name + "': " + std::strerror(errno);
+			return false;
+		}
+	}
+	else {
+		struct stat st {};
+		if(fstat(m_fd, &st) != 0) {
+			outErr = "Unable to query size of '" + m_createInfo.name + "': " + std::strerror(errno);
+			return false;
+		}
+		size = st.st_size;
+	}
+	auto *mapping = mmap(nullptr, size, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, m_fd, 0);
+	if(mapping == MAP_FAILED) {
+		outErr = "Unable to map '" + m_createInfo.name + "': " + std::strerror(errno);
+		return false;
+	}
+	m_mapping = mapping;
+	m_mappingSize = size;
+	return true;
+#elif defined(_WIN32)
+	auto isFile = (m_createInfo.backing == Backing::File);
+	if(isFile) {
+		m_fileHandle = CreateFileA(m_createInfo.name.c_str(), GENERIC_READ | (create ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(m_fileHandle == INVALID_HANDLE_VALUE) {
+			m_fileHandle = nullptr;
+			outErr = "Unable to open '" + m_createInfo.name + "': Error code " + std::to_string(GetLastError());
+			return false;
+		}
+	}
+	if(create)
+		m_mappingHandle = CreateFileMappingA(isFile ? m_fileHandle : INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size & 0xFFFF'FFFF), isFile ? nullptr : m_createInfo.name.c_str());
+	else if(isFile)
+		m_mappingHandle = CreateFileMappingA(m_fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	else
+		m_mappingHandle = OpenFileMappingA(FILE_MAP_READ, FALSE, m_createInfo.name.c_str());
+	if(!m_mappingHandle) {
+		outErr = "Unable to create file mapping for '" + m_createInfo.name + "': Error code " + std::to_string(GetLastError());
+		return false;
+	}
+	m_mapping = MapViewOfFile(m_mappingHandle, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, create ? size : 0);
+	if(!m_mapping) {
+		outErr = "Unable to map '" + m_createInfo.name + "': Error code " + std::to_string(GetLastError());
+		return false;
+	}
+	if(!create) {
+		MEMORY_BASIC_INFORMATION info {};
+		VirtualQuery(m_mapping, &info, sizeof(info));
+		size = info.RegionSize;
+	}
+	m_mappingSize = size;
+	return true;
+#else
+	outErr = "Shared framebuffers are not supported on this platform!";
+	return false;
+#endif
+}
+
+pragma::scenekit::SharedFramebuffer::~SharedFramebuffer()
+{
+#ifdef __linux__
+	if(m_mapping)
+		munmap(m_mapping, m_mappingSize);
+	if(m_fd != -1)
+		close(m_fd);
+	if(m_owner && m_createInfo.backing == Backing::SharedMemory)
+		shm_unlink(get_shm_name(m_createInfo.name).c_str());
+#elif defined(_WIN32)
+	if(m_mapping)
+		UnmapViewOfFile(m_mapping);
+	if(m_mappingHandle)
+		CloseHandle(m_mappingHandle);
+	if(m_fileHandle)
+		CloseHandle(m_fileHandle);
+#endif
+}
+
+pragma::scenekit::SharedFramebuffer::TileHeader &pragma::scenekit::SharedFramebuffer::GetTileHeader(uint32_t tileIndex) const { return *reinterpret_cast<TileHeader *>(static_cast<uint8_t *>(m_mapping) + m_header->tileHeaderOffset + tileIndex * sizeof(TileHeader)); }
+float *pragma::scenekit::SharedFramebuffer::GetPixelData() const { return reinterpret_cast<float *>(static_cast<uint8_t *>(m_mapping) + m_header->pixelDataOffset); }
+
+void pragma::scenekit::SharedFramebuffer::BeginFrame()
+{
+	if(m_owner)
+		m_header->frameIndex.fetch_add(1, std::memory_order_release);
+}
+
+void pragma::scenekit::SharedFramebuffer::WriteTile(uint32_t tileIndex, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t sample, const void *data, bool isHalfData)
+{
+	auto &header = *m_header;
+	if(!m_owner || tileIndex >= header.tileCountX * header.tileCountY || x + w > header.width || y + h > header.height)
+		return;
+	auto &tileHeader = GetTileHeader(tileIndex);
+
+	// Acquire the tile for writing by making its sequence odd. Multiple workers may write the same tile concurrently.
+	auto seq = tileHeader.sequence.load(std::memory_order_relaxed);
+	for(;;) {
+		if((seq & 1) != 0) {
+			std::this_thread::yield();
+			seq = tileHeader.sequence.load(std::memory_order_relaxed);
+			continue;
+		}
+		if(tileHeader.sequence.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+			break;
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+
+	auto frameIndex = header.frameIndex.load(std::memory_order_acquire);
+	if(tileHeader.frameIndex == frameIndex && tileHeader.sample != NO_SAMPLE && sample < tileHeader.sample) {
+		// We already have a newer sample
+		tileHeader.sequence.store(seq + 2, std::memory_order_release);
+		return;
+	}
+	tileHeader.frameIndex = frameIndex;
+	tileHeader.sample = sample;
+	tileHeader.x = static_cast<uint16_t>(x);
+	tileHeader.y = static_cast<uint16_t>(y);
+	tileHeader.w = static_cast<uint16_t>(w);
+	tileHeader.h = static_cast<uint16_t>(h);
+
+	auto *dst = GetPixelData() + (static_cast<size_t>(y) * header.width + x) * 4;
+	auto dstRowSize = static_cast<size_t>(header.width) * 4;
+	auto srcRowSize = static_cast<size_t>(w) * 4;
+	for(uint32_t row = 0; row < h; ++row, dst += dstRowSize) {
+		if(isHalfData)
+			tile_kernels::convert_half_to_float(static_cast<const uint16_t *>(data) + row * srcRowSize, dst, srcRowSize);
+		else
+			std::memcpy(dst, static_cast<const float *>(data) + row * srcRowSize, srcRowSize * sizeof(float));
+	}
+	tileHeader.sequence.store(seq + 2, std::memory_order_release);
+}
+
+bool pragma::scenekit::SharedFramebuffer::ReadTile(uint32_t tileIndex, TileHeader &outTileHeader, float *outData) const
+{
+	auto &header = *m_header;
+	if(tileIndex >= header.tileCountX * header.tileCountY)
+		return false;
+	auto &tileHeader = GetTileHeader(tileIndex);
+	for(uint32_t attempt = 0;; ++attempt) {
+		if(attempt == MAX_READ_ATTEMPTS)
+			return false;
+		auto seq = tileHeader.sequence.load(std::memory_order_acquire);
+		if((seq & 1) != 0) {
+			std::this_thread::yield();
+			continue;
+		}
+		outTileHeader.sequence.store(seq, std::memory_order_relaxed);
+		outTileHeader.frameIndex = tileHeader.frameIndex;
+		outTileHeader.sample = tileHeader.sample;
+		outTileHeader.x = tileHeader.x;
+		outTileHeader.y = tileHeader.y;
+		// The values may be torn if a writer is active, so they have to be clamped to stay within bounds
+		outTileHeader.w = std::min<uint16_t>(tileHeader.w, header.tileWidth);
+		outTileHeader.h = std::min<uint16_t>(tileHeader.h, header.tileHeight);
+		if(outTileHeader.x + outTileHeader.w > header.width || outTileHeader.y + outTileHeader.h > header.height) {
+			outTileHeader.w = 0;
+			outTileHeader.h = 0;
+		}
+		auto *src = GetPixelData() + (static_cast<size_t>(outTileHeader.y) * header.width + outTileHeader.x) * 4;
+		auto rowSize = static_cast<size_t>(outTileHeader.w) * 4;
+		for(uint32_t row = 0; row < outTileHeader.h; ++row)
+			std::memcpy(outData + row * rowSize, src + row * header.width * 4, rowSize * sizeof(float));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(tileHeader.sequence.load(std::memory_order_relaxed) == seq)
+			break;
+	}
+	return outTileHeader.frameIndex == header.frameIndex.load(std::memory_order_acquire) && outTileHeader.sample != NO_SAMPLE;
+}
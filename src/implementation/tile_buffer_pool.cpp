@@ -0,0 +1,93 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_buffer.hpp>
+#include <mutex>
+
+module pragma.scenekit;
+
+import :tile_buffer_pool;
+
+uint64_t pragma::scenekit::TileBufferPool::GetKey(uint32_t w, uint32_t h, uimg::Format format) { return (static_cast<uint64_t>(w) << 40) | (static_cast<uint64_t>(h) << 16) | static_cast<uint64_t>(format); }
+size_t pragma::scenekit::TileBufferPool::GetBufferSize(uint32_t w, uint32_t h, uimg::Format format) { return static_cast<size_t>(w) * h * uimg::ImageBuffer::GetPixelSize(format); }
+
+std::vector<uint8_t> pragma::scenekit::TileBufferPool::Acquire(uint32_t w, uint32_t h, uimg::Format format)
+{
+	{
+		std::scoped_lock lock {m_mutex};
+		auto it = m_buffers.find(GetKey(w, h, format));
+		if(it != m_buffers.end() && !it->second.empty()) {
+			auto buffer = std::move(it->second.back());
+			it->second.pop_back();
+			++m_hits;
+			return buffer;
+		}
+	}
+	++m_misses;
+	return std::vector<uint8_t>(GetBufferSize(w, h, format));
+}
+
+void pragma::scenekit::TileBufferPool::Release(std::vector<uint8_t> &&buffer, uint32_t w, uint32_t h, uimg::Format format)
+{
+	if(buffer.size() != GetBufferSize(w, h, format) || buffer.empty()) {
+		++m_discarded;
+		return;
+	}
+	std::scoped_lock lock {m_mutex};
+	auto &buffers = m_buffers[GetKey(w, h, format)];
+	if(buffers.size() >= m_maxBuffersPerKey) {
+		++m_discarded;
+		return;
+	}
+	buffers.push_back(std::move(buffer));
+	++m_released;
+}
+
+void pragma::scenekit::TileBufferPool::Clear()
+{
+	std::scoped_lock lock {m_mutex};
+	m_buffers.clear();
+}
+
+void pragma::scenekit::TileBufferPool::SetMaxBuffersPerKey(uint32_t maxBuffers)
+{
+	std::scoped_lock lock {m_mutex};
+	m_maxBuffersPerKey = maxBuffers;
+	for(auto &pair : m_buffers) {
+		if(pair.second.size() > maxBuffers)
+			pair.second.resize(maxBuffers);
+	}
+}
+
+pragma::scenekit::TileBufferPool::Statistics pragma::scenekit::TileBufferPool::GetStatistics() const
+{
+	Statistics stats {};
+	stats.hits = m_hits;
+	stats.misses = m_misses;
+	stats.released = m_released;
+	stats.discarded = m_discarded;
+	return stats;
+}
+
+void pragma::scenekit::TileBufferPool::ResetStatistics()
+{
+	m_hits = 0;
+	m_misses = 0;
+	m_released = 0;
+	m_discarded = 0;
+}
+
+size_t pragma::scenekit::TileBufferPool::GetPooledBufferCount() const
+{
+	std::scoped_lock lock {m_mutex};
+	size_t count = 0;
+	for(auto &pair : m_buffers)
+		count += pair.second.size();
+	return count;
+}
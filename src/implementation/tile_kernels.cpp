@@ -0,0 +1,650 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <bit>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNIRENDER_TILE_KERNELS_SSE2
+#endif
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define UNIRENDER_TILE_KERNELS_F16C
+#elif defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+// F16C isn't enabled for the build, but can still be used if the CPU supports it
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UNIRENDER_TARGET_F16C
+#else
+#include <cpuid.h>
+#define UNIRENDER_TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+#define UNIRENDER_TILE_KERNELS_F16C_DISPATCH
+#endif
+
+module pragma.scenekit;
+
+import :tile_kernels;
+
+namespace {
+	constexpr uint32_t CHANNEL_COUNT = 4;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	// One RGBA float pixel fits exactly into one SSE register
+	struct PixelOps32f {
+		using Component = float;
+		using Pixel = __m128;
+		PixelOps32f(bool clearAlpha) : m_clearAlpha {clearAlpha}, m_rgbMask {_mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))}, m_alphaOne {_mm_set_ps(1.f, 0.f, 0.f, 0.f)} {}
+		Pixel Load(const float *px) const
+		{
+			auto v = _mm_loadu_ps(px);
+			return m_clearAlpha ? _mm_or_ps(_mm_and_ps(v, m_rgbMask), m_alphaOne) : v;
+		}
+		void Store(float *px, Pixel v) const { _mm_storeu_ps(px, v); }
+	  private:
+		bool m_clearAlpha;
+		__m128 m_rgbMask;
+		__m128 m_alphaOne;
+	};
+#else
+	struct PixelOps32f {
+		using Component = float;
+		struct Pixel {
+			float v[CHANNEL_COUNT];
+		};
+		PixelOps32f(bool clearAlpha) : m_clearAlpha {clearAlpha} {}
+		Pixel Load(const float *px) const
+		{
+			Pixel p;
+			std::memcpy(p.v, px, sizeof(p.v));
+			if(m_clearAlpha)
+				p.v[3] = 1.f;
+			return p;
+		}
+		void Store(float *px, const Pixel &p) const { std::memcpy(px, p.v, sizeof(p.v)); }
+	  private:
+		bool m_clearAlpha;
+	};
+#endif
+	// One RGBA half pixel fits into a 64-bit integer
+	struct PixelOps16f {
+		using Component = uint16_t;
+		using Pixel = uint64_t;
+		static constexpr uint64_t ALPHA_MASK = static_cast<uint64_t>(0xFFFF) << 48;
+		static constexpr uint64_t ALPHA_ONE = static_cast<uint64_t>(0x3C00) << 48; // 1.0 in half precision
+		PixelOps16f(bool clearAlpha) : m_clearAlpha {clearAlpha} {}
+		Pixel Load(const uint16_t *px) const
+		{
+			Pixel p;
+			std::memcpy(&p, px, sizeof(p));
+			return m_clearAlpha ? ((p & ~ALPHA_MASK) | ALPHA_ONE) : p;
+		}
+		void Store(uint16_t *px, Pixel p) const { std::memcpy(px, &p, sizeof(p)); }
+	  private:
+		bool m_clearAlpha;
+	};
+
+	template<class TOps>
+	void transform_row(const TOps &ops, const typename TOps::Component *src, typename TOps::Component *dst, uint32_t w, bool flipHorizontally)
+	{
+		if(flipHorizontally) {
+			auto *srcPx = src + (w - 1) * CHANNEL_COUNT;
+			for(uint32_t x = 0; x < w; ++x, srcPx -= CHANNEL_COUNT, dst += CHANNEL_COUNT)
+				ops.Store(dst, ops.Load(srcPx));
+			return;
+		}
+		uint32_t x = 0;
+		for(; x + 4 <= w; x += 4, src += CHANNEL_COUNT * 4, dst += CHANNEL_COUNT * 4) {
+			auto p0 = ops.Load(src);
+			auto p1 = ops.Load(src + CHANNEL_COUNT);
+			auto p2 = ops.Load(src + CHANNEL_COUNT * 2);
+			auto p3 = ops.Load(src + CHANNEL_COUNT * 3);
+			ops.Store(dst, p0);
+			ops.Store(dst + CHANNEL_COUNT, p1);
+			ops.Store(dst + CHANNEL_COUNT * 2, p2);
+			ops.Store(dst + CHANNEL_COUNT * 3, p3);
+		}
+		for(; x < w; ++x, src += CHANNEL_COUNT, dst += CHANNEL_COUNT)
+			ops.Store(dst, ops.Load(src));
+	}
+
+	// Transforms a single row in-place
+	template<class TOps>
+	void transform_row_in_place(const TOps &ops, typename TOps::Component *row, uint32_t w, bool flipHorizontally)
+	{
+		if(!flipHorizontally) {
+			transform_row(ops, row, row, w, false);
+			return;
+		}
+		for(uint32_t x = 0; x < w / 2; ++x) {
+			auto *a = row + x * CHANNEL_COUNT;
+			auto *b = row + (w - 1 - x) * CHANNEL_COUNT;
+			auto pa = ops.Load(a);
+			auto pb = ops.Load(b);
+			ops.Store(a, pb);
+			ops.Store(b, pa);
+		}
+		if((w % 2) != 0) {
+			auto *mid = row + (w / 2) * CHANNEL_COUNT;
+			ops.Store(mid, ops.Load(mid));
+		}
+	}
+
+	// Swaps two rows (and mirrors them if requested) in a single pass
+	template<class TOps>
+	void swap_rows(const TOps &ops, typename TOps::Component *rowA, typename TOps::Component *rowB, uint32_t w, bool flipHorizontally)
+	{
+		for(uint32_t x = 0; x < w; ++x) {
+			auto *a = rowA + x * CHANNEL_COUNT;
+			auto *b = rowB + (flipHorizontally ? (w - 1 - x) : x) * CHANNEL_COUNT;
+			auto pa = ops.Load(a);
+			auto pb = ops.Load(b);
+			ops.Store(a, pb);
+			ops.Store(b, pa);
+		}
+	}
+
+	template<class TOps>
+	void blit_tile(const typename TOps::Component *src, uint32_t w, uint32_t h, typename TOps::Component *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha)
+	{
+		TOps ops {clearAlpha};
+		auto srcRowSize = static_cast<size_t>(w) * CHANNEL_COUNT;
+		auto dstRowSize = static_cast<size_t>(dstRowPixelCount) * CHANNEL_COUNT;
+		for(uint32_t y = 0; y < h; ++y) {
+			auto *srcRow = src + (flipVertically ? (h - 1 - y) : y) * srcRowSize;
+			auto *dstRow = dst + y * dstRowSize;
+			transform_row(ops, srcRow, dstRow, w, flipHorizontally);
+		}
+	}
+
+	template<class TOps>
+	void transform_tile(typename TOps::Component *data, uint32_t w, uint32_t h, bool flipHorizontally, bool flipVertically, bool clearAlpha)
+	{
+		if(!flipHorizontally && !flipVertically && !clearAlpha)
+			return;
+		TOps ops {clearAlpha};
+		auto rowSize = static_cast<size_t>(w) * CHANNEL_COUNT;
+		if(!flipVertically) {
+			for(uint32_t y = 0; y < h; ++y)
+				transform_row_in_place(ops, data + y * rowSize, w, flipHorizontally);
+			return;
+		}
+		for(uint32_t y = 0; y < h / 2; ++y)
+			swap_rows(ops, data + y * rowSize, data + (h - 1 - y) * rowSize, w, flipHorizontally);
+		if((h % 2) != 0)
+			transform_row_in_place(ops, data + (h / 2) * rowSize, w, flipHorizontally);
+	}
+
+	// Averages 2x2 blocks of two source rows into w destination pixels. row0 and row1 point to the first source pixel of the block,
+	// srcW is the number of source pixels available from there on.
+	void downsample_row_rgba32f(const float *row0, const float *row1, uint32_t srcW, float *dst, uint32_t w)
+	{
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+		auto quarter = _mm_set1_ps(0.25f);
+		for(uint32_t x = 0; x < w; ++x, dst += CHANNEL_COUNT) {
+			auto sx0 = x * 2;
+			auto sx1 = std::min(sx0 + 1, srcW - 1);
+			auto top = _mm_add_ps(_mm_loadu_ps(row0 + sx0 * CHANNEL_COUNT), _mm_loadu_ps(row0 + sx1 * CHANNEL_COUNT));
+			auto bottom = _mm_add_ps(_mm_loadu_ps(row1 + sx0 * CHANNEL_COUNT), _mm_loadu_ps(row1 + sx1 * CHANNEL_COUNT));
+			_mm_storeu_ps(dst, _mm_mul_ps(_mm_add_ps(top, bottom), quarter));
+		}
+#else
+		for(uint32_t x = 0; x < w; ++x, dst += CHANNEL_COUNT) {
+			auto sx0 = x * 2;
+			auto sx1 = std::min(sx0 + 1, srcW - 1);
+			for(uint32_t c = 0; c < CHANNEL_COUNT; ++c)
+				dst[c] = (row0[sx0 * CHANNEL_COUNT + c] + row0[sx1 * CHANNEL_COUNT + c] + row1[sx0 * CHANNEL_COUNT + c] + row1[sx1 * CHANNEL_COUNT + c]) * 0.25f;
+		}
+#endif
+	}
+};
+
+uint16_t pragma::scenekit::tile_kernels::float_to_half(float f)
+{
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t absX = x & 0x7FFF'FFFF;
+	if(absX >= 0x7F80'0000) // Inf / NaN
+		return static_cast<uint16_t>(sign | 0x7C00 | ((absX > 0x7F80'0000) ? 0x200 : 0));
+	if(absX >= 0x477F'F000) // Rounds to a value larger than the largest half
+		return static_cast<uint16_t>(sign | 0x7C00);
+	if(absX < 0x3880'0000) {
+		// Half subnormal (or zero), the unit of the mantissa is 2^-24
+		float absF;
+		std::memcpy(&absF, &absX, sizeof(absF));
+		return static_cast<uint16_t>(sign | static_cast<uint32_t>(std::nearbyint(absF * 16'777'216.f)));
+	}
+	auto exp = (absX >> 23) - 127 + 15;
+	auto mantissa = absX & 0x007F'FFFF;
+	auto h = (exp << 10) | (mantissa >> 13);
+	// Round to nearest even, a carry will correctly propagate into the exponent
+	auto rem = mantissa & 0x1FFF;
+	if(rem > 0x1000 || (rem == 0x1000 && (h & 1) != 0))
+		++h;
+	return static_cast<uint16_t>(sign | h);
+}
+
+float pragma::scenekit::tile_kernels::half_to_float(uint16_t h)
+{
+	uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1F;
+	uint32_t mantissa = h & 0x3FF;
+	if(exp == 0) {
+		auto f = static_cast<float>(mantissa) * 5.9604644775390625e-8f; // 2^-24
+		return (sign != 0) ? -f : f;
+	}
+	uint32_t x;
+	if(exp == 31)
+		x = sign | 0x7F80'0000 | (mantissa << 13);
+	else
+		x = sign | ((exp - 15 + 127) << 23) | (mantissa << 13);
+	float f;
+	std::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+namespace {
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	// Bit manipulation variants of float_to_half and half_to_float for CPUs without F16C, with bit-identical results
+	__m128i float_to_half_sse2(__m128 v)
+	{
+		auto x = _mm_castps_si128(v);
+		auto sign = _mm_and_si128(x, _mm_set1_epi32(0x8000'0000));
+		x = _mm_xor_si128(x, sign);
+		// Inf / NaN, or rounds to a value larger than the largest half
+		auto isInfNan = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x477F'EFFF));
+		auto infNan = _mm_or_si128(_mm_set1_epi32(0x7C00), _mm_and_si128(_mm_cmpgt_epi32(x, _mm_set1_epi32(0x7F80'0000)), _mm_set1_epi32(0x200)));
+		// Half subnormal (or zero): Adding a magic number shifts the mantissa into place, rounding with the current (nearest even) rounding mode
+		auto isSubnormal = _mm_cmplt_epi32(x, _mm_set1_epi32(0x3880'0000));
+		auto subnormalMagic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+		auto subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(x), _mm_castsi128_ps(subnormalMagic))), subnormalMagic);
+		// Normal: Rebias the exponent and round to nearest even, a carry will correctly propagate into the exponent
+		auto mantissaOdd = _mm_and_si128(_mm_srli_epi32(x, 13), _mm_set1_epi32(1));
+		auto normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(((15 - 127) << 23) + 0xFFF)), mantissaOdd), 13);
+		auto h = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal), _mm_andnot_si128(isSubnormal, normal));
+		h = _mm_or_si128(_mm_and_si128(isInfNan, infNan), _mm_andnot_si128(isInfNan, h));
+		h = _mm_or_si128(h, _mm_srli_epi32(sign, 16));
+		// Sign-extend, so that the saturating pack keeps the lower 16 bits as they are
+		return _mm_srai_epi32(_mm_slli_epi32(h, 16), 16);
+	}
+	__m128 half_to_float_sse2(__m128i h)
+	{
+		auto x = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7FFF)), 13);
+		// Scaling by 2^112 rebiases the exponent, and also normalizes subnormals
+		auto f = _mm_mul_ps(_mm_castsi128_ps(x), _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23)));
+		auto isInfNan = _mm_cmpge_ps(f, _mm_castsi128_ps(_mm_set1_epi32((127 + 16) << 23)));
+		f = _mm_or_ps(f, _mm_and_ps(isInfNan, _mm_castsi128_ps(_mm_set1_epi32(0x7F80'0000))));
+		return _mm_or_ps(f, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16)));
+	}
+	size_t convert_float_to_half_sse2(const float *src, uint16_t *dst, size_t count)
+	{
+		size_t i = 0;
+		for(; i + 8 <= count; i += 8) {
+			auto h = _mm_packs_epi32(float_to_half_sse2(_mm_loadu_ps(src + i)), float_to_half_sse2(_mm_loadu_ps(src + i + 4)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), h);
+		}
+		return i;
+	}
+	size_t convert_half_to_float_sse2(const uint16_t *src, float *dst, size_t count)
+	{
+		size_t i = 0;
+		auto zero = _mm_setzero_si128();
+		for(; i + 8 <= count; i += 8) {
+			auto h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+			_mm_storeu_ps(dst + i, half_to_float_sse2(_mm_unpacklo_epi16(h, zero)));
+			_mm_storeu_ps(dst + i + 4, half_to_float_sse2(_mm_unpackhi_epi16(h, zero)));
+		}
+		return i;
+	}
+#endif
+#ifdef UNIRENDER_TILE_KERNELS_F16C_DISPATCH
+	bool is_f16c_supported()
+	{
+		static const auto supported = []() {
+			// F16C instructions are VEX encoded, so the OS has to preserve the AVX state as well
+			constexpr uint32_t OSXSAVE = 1u << 27;
+			constexpr uint32_t AVX = 1u << 28;
+			constexpr uint32_t F16C = 1u << 29;
+			uint32_t ecx;
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 1);
+			ecx = static_cast<uint32_t>(info[2]);
+#else
+			uint32_t eax, ebx, edx;
+			if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+				return false;
+#endif
+			if((ecx & (OSXSAVE | AVX | F16C)) != (OSXSAVE | AVX | F16C))
+				return false;
+#ifdef _MSC_VER
+			auto xcr0 = _xgetbv(0);
+#else
+			uint32_t xcr0Lo, xcr0Hi;
+			__asm__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+			uint64_t xcr0 = xcr0Lo;
+#endif
+			return (xcr0 & 0x6) == 0x6; // SSE and AVX state
+		}();
+		return supported;
+	}
+	UNIRENDER_TARGET_F16C size_t convert_float_to_half_f16c(const float *src, uint16_t *dst, size_t count)
+	{
+		size_t i = 0;
+		for(; i + 8 <= count; i += 8)
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+		return i;
+	}
+	UNIRENDER_TARGET_F16C size_t convert_half_to_float_f16c(const uint16_t *src, float *dst, size_t count)
+	{
+		size_t i = 0;
+		for(; i + 8 <= count; i += 8)
+			_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))));
+		return i;
+	}
+#endif
+};
+
+void pragma::scenekit::tile_kernels::convert_float_to_half(const float *src, uint16_t *dst, size_t count)
+{
+	size_t i = 0;
+#if defined(UNIRENDER_TILE_KERNELS_F16C)
+	for(; i + 8 <= count; i += 8) {
+		auto v = _mm256_loadu_ps(src + i);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	}
+#elif defined(UNIRENDER_TILE_KERNELS_F16C_DISPATCH)
+	i = is_f16c_supported() ? convert_float_to_half_f16c(src, dst, count) : convert_float_to_half_sse2(src, dst, count);
+#elif defined(UNIRENDER_TILE_KERNELS_SSE2)
+	i = convert_float_to_half_sse2(src, dst, count);
+#endif
+	for(; i < count; ++i)
+		dst[i] = float_to_half(src[i]);
+}
+
+void pragma::scenekit::tile_kernels::convert_half_to_float(const uint16_t *src, float *dst, size_t count)
+{
+	size_t i = 0;
+#if defined(UNIRENDER_TILE_KERNELS_F16C)
+	for(; i + 8 <= count; i += 8) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(v));
+	}
+#elif defined(UNIRENDER_TILE_KERNELS_F16C_DISPATCH)
+	i = is_f16c_supported() ? convert_half_to_float_f16c(src, dst, count) : convert_half_to_float_sse2(src, dst, count);
+#elif defined(UNIRENDER_TILE_KERNELS_SSE2)
+	i = convert_half_to_float_sse2(src, dst, count);
+#endif
+	for(; i < count; ++i)
+		dst[i] = half_to_float(src[i]);
+}
+
+void pragma::scenekit::tile_kernels::blit_tile_rgba32f(const float *src, uint32_t w, uint32_t h, float *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha)
+{
+	blit_tile<PixelOps32f>(src, w, h, dst, dstRowPixelCount, flipHorizontally, flipVertically, clearAlpha);
+}
+
+void pragma::scenekit::tile_kernels::transform_tile_rgba32f(float *data, uint32_t w, uint32_t h, bool flipHorizontally, bool flipVertically, bool clearAlpha) { transform_tile<PixelOps32f>(data, w, h, flipHorizontally, flipVertically, clearAlpha); }
+
+void pragma::scenekit::tile_kernels::blit_tile_rgba16f(const uint16_t *src, uint32_t w, uint32_t h, uint16_t *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha)
+{
+	blit_tile<PixelOps16f>(src, w, h, dst, dstRowPixelCount, flipHorizontally, flipVertically, clearAlpha);
+}
+
+void pragma::scenekit::tile_kernels::transform_tile_rgba16f(uint16_t *data, uint32_t w, uint32_t h, bool flipHorizontally, bool flipVertically, bool clearAlpha) { transform_tile<PixelOps16f>(data, w, h, flipHorizontally, flipVertically, clearAlpha); }
+
+void pragma::scenekit::tile_kernels::downsample_rgba32f(const float *src, uint32_t srcW, uint32_t srcH, float *dst, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	auto srcRowSize = static_cast<size_t>(srcW) * CHANNEL_COUNT;
+	auto dstRowSize = static_cast<size_t>((srcW + 1) / 2) * CHANNEL_COUNT;
+	for(auto dy = y; dy < y + h; ++dy) {
+		auto sy0 = dy * 2;
+		auto sy1 = std::min(sy0 + 1, srcH - 1);
+		auto sx = x * 2;
+		downsample_row_rgba32f(src + sy0 * srcRowSize + sx * CHANNEL_COUNT, src + sy1 * srcRowSize + sx * CHANNEL_COUNT, srcW - sx, dst + dy * dstRowSize + x * CHANNEL_COUNT, w);
+	}
+}
+
+void pragma::scenekit::tile_kernels::downsample_rgba16f(const uint16_t *src, uint32_t srcW, uint32_t srcH, uint16_t *dst, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	// Filtering is done in single precision, only the source pixels covered by the rectangle are converted
+	auto srcRowSize = static_cast<size_t>(srcW) * CHANNEL_COUNT;
+	auto dstRowSize = static_cast<size_t>((srcW + 1) / 2) * CHANNEL_COUNT;
+	auto sx = x * 2;
+	auto srcPixelCount = std::min(w * 2, srcW - sx);
+	thread_local std::vector<float> scratch;
+	scratch.resize((srcPixelCount * 2 + w) * CHANNEL_COUNT);
+	auto *row0 = scratch.data();
+	auto *row1 = row0 + srcPixelCount * CHANNEL_COUNT;
+	auto *dstRow = row1 + srcPixelCount * CHANNEL_COUNT;
+	for(auto dy = y; dy < y + h; ++dy) {
+		auto sy0 = dy * 2;
+		auto sy1 = std::min(sy0 + 1, srcH - 1);
+		convert_half_to_float(src + sy0 * srcRowSize + sx * CHANNEL_COUNT, row0, srcPixelCount * CHANNEL_COUNT);
+		convert_half_to_float(src + sy1 * srcRowSize + sx * CHANNEL_COUNT, row1, srcPixelCount * CHANNEL_COUNT);
+		downsample_row_rgba32f(row0, row1, srcPixelCount, dstRow, w);
+		convert_float_to_half(dstRow, dst + dy * dstRowSize + x * CHANNEL_COUNT, w * CHANNEL_COUNT);
+	}
+}
+
+void pragma::scenekit::tile_kernels::sum_luminance_difference_rgba32f(const float *a, const float *b, size_t pixelCount, double &outSquaredDifferenceSum, double &outLuminanceSum)
+{
+	constexpr float wr = 0.2126f;
+	constexpr float wg = 0.7152f;
+	constexpr float wb = 0.0722f;
+	double sqDiffSum = 0.0;
+	double lumSum = 0.0;
+	size_t i = 0;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	// Four pixels at a time, transposed so that every register holds one channel
+	auto vwr = _mm_set1_ps(wr);
+	auto vwg = _mm_set1_ps(wg);
+	auto vwb = _mm_set1_ps(wb);
+	auto vSqDiffSum = _mm_setzero_ps();
+	auto vLumSum = _mm_setzero_ps();
+	for(; i + 4 <= pixelCount; i += 4) {
+		auto *pa = a + i * CHANNEL_COUNT;
+		auto *pb = b + i * CHANNEL_COUNT;
+		auto r = _mm_loadu_ps(pa);
+		auto g = _mm_loadu_ps(pa + 4);
+		auto bl = _mm_loadu_ps(pa + 8);
+		auto al = _mm_loadu_ps(pa + 12);
+		_MM_TRANSPOSE4_PS(r, g, bl, al);
+		auto lumA = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, vwr), _mm_mul_ps(g, vwg)), _mm_mul_ps(bl, vwb));
+		r = _mm_loadu_ps(pb);
+		g = _mm_loadu_ps(pb + 4);
+		bl = _mm_loadu_ps(pb + 8);
+		al = _mm_loadu_ps(pb + 12);
+		_MM_TRANSPOSE4_PS(r, g, bl, al);
+		auto lumB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, vwr), _mm_mul_ps(g, vwg)), _mm_mul_ps(bl, vwb));
+		auto diff = _mm_sub_ps(lumA, lumB);
+		vSqDiffSum = _mm_add_ps(vSqDiffSum, _mm_mul_ps(diff, diff));
+		vLumSum = _mm_add_ps(vLumSum, lumA);
+	}
+	float tmp[4];
+	_mm_storeu_ps(tmp, vSqDiffSum);
+	sqDiffSum = static_cast<double>(tmp[0]) + tmp[1] + tmp[2] + tmp[3];
+	_mm_storeu_ps(tmp, vLumSum);
+	lumSum = static_cast<double>(tmp[0]) + tmp[1] + tmp[2] + tmp[3];
+#endif
+	for(; i < pixelCount; ++i) {
+		auto *pa = a + i * CHANNEL_COUNT;
+		auto *pb = b + i * CHANNEL_COUNT;
+		auto lumA = pa[0] * wr + pa[1] * wg + pa[2] * wb;
+		auto lumB = pb[0] * wr + pb[1] * wg + pb[2] * wb;
+		auto diff = lumA - lumB;
+		sqDiffSum += diff * diff;
+		lumSum += lumA;
+	}
+	outSquaredDifferenceSum = sqDiffSum;
+	outLuminanceSum = lumSum;
+}
+
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+// Gathers the alpha channels of four consecutive RGBA float pixels into one register
+static __m128 load_alpha4(const float *px)
+{
+	auto t0 = _mm_unpackhi_ps(_mm_loadu_ps(px), _mm_loadu_ps(px + 4));      // b0 b1 a0 a1
+	auto t1 = _mm_unpackhi_ps(_mm_loadu_ps(px + 8), _mm_loadu_ps(px + 12)); // b2 b3 a2 a3
+	return _mm_movehl_ps(t1, t0);                                           // a0 a1 a2 a3
+}
+#endif
+
+bool pragma::scenekit::tile_kernels::find_visible_pixel_range_rgba32f(const float *row, uint32_t w, uint32_t &outFirst, uint32_t &outLast)
+{
+	uint32_t x = 0;
+	auto found = false;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	auto zero = _mm_setzero_ps();
+	for(; x + 4 <= w; x += 4) {
+		auto mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpgt_ps(load_alpha4(row + x * CHANNEL_COUNT), zero)));
+		if(mask != 0) {
+			x += std::countr_zero(mask);
+			found = true;
+			break;
+		}
+	}
+#endif
+	if(!found) {
+		for(; x < w; ++x) {
+			if(row[x * CHANNEL_COUNT + 3] > 0.f) {
+				found = true;
+				break;
+			}
+		}
+		if(!found)
+			return false;
+	}
+	outFirst = x;
+
+	// Search backwards for the last visible pixel, there is at least one at outFirst
+	auto end = w;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	// Unaligned remainder first, so the vectorized loop works on the same blocks as the forward search
+	for(auto blockEnd = w & ~3u; end > blockEnd; --end) {
+		if(row[(end - 1) * CHANNEL_COUNT + 3] > 0.f) {
+			outLast = end - 1;
+			return true;
+		}
+	}
+	for(; end >= 4; end -= 4) {
+		auto mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpgt_ps(load_alpha4(row + (end - 4) * CHANNEL_COUNT), zero)));
+		if(mask != 0) {
+			outLast = end - 4 + (std::bit_width(mask) - 1);
+			return true;
+		}
+	}
+#endif
+	for(; end > 0; --end) {
+		if(row[(end - 1) * CHANNEL_COUNT + 3] > 0.f)
+			break;
+	}
+	outLast = end - 1;
+	return true;
+}
+
+uint32_t pragma::scenekit::tile_kernels::find_first_translucent_pixel_rgba32f(const float *row, uint32_t w)
+{
+	uint32_t x = 0;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+	auto one = _mm_set1_ps(1.f);
+	for(; x + 4 <= w; x += 4) {
+		auto mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(load_alpha4(row + x * CHANNEL_COUNT), one)));
+		if(mask != 0)
+			return x + std::countr_zero(mask);
+	}
+#endif
+	for(; x < w; ++x) {
+		if(row[x * CHANNEL_COUNT + 3] < 1.f)
+			return x;
+	}
+	return w;
+}
+
+namespace {
+	// Horizontal pass of the 3x3 neighborhood of dilate_rgba32f for one row
+	struct DilateRow {
+		std::vector<float> sums;             // Sum of the texels with a chart within [x - 1, x + 1]
+		std::vector<uint32_t> counts;        // Number of texels with a chart within [x - 1, x + 1]
+		std::vector<uint32_t> firstChartIds; // Chart id of the first texel with a chart within [x - 1, x + 1], or 0
+		DilateRow(uint32_t w) : sums(static_cast<size_t>(w) * CHANNEL_COUNT, 0.f), counts(w, 0), firstChartIds(w, 0) {}
+	};
+	void sum_dilate_row(const float *src, const uint32_t *chartIds, uint32_t w, DilateRow &outRow)
+	{
+		// Texels without a chart contribute zero, texels outside of the row are treated the same way.
+		// Both paths add in the same order ((left + center) + right), so they produce the same results.
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+		auto loadMasked = [src, chartIds](uint32_t x) { return _mm_and_ps(_mm_loadu_ps(src + static_cast<size_t>(x) * CHANNEL_COUNT), _mm_castsi128_ps(_mm_set1_epi32(-static_cast<int32_t>(chartIds[x] != 0)))); };
+		auto left = _mm_setzero_ps();
+		auto center = loadMasked(0);
+		for(uint32_t x = 0; x < w; ++x) {
+			auto right = (x + 1 < w) ? loadMasked(x + 1) : _mm_setzero_ps();
+			_mm_storeu_ps(outRow.sums.data() + static_cast<size_t>(x) * CHANNEL_COUNT, _mm_add_ps(_mm_add_ps(left, center), right));
+			left = center;
+			center = right;
+		}
+#else
+		auto getMasked = [src, chartIds, w](int64_t x, uint32_t c) { return (x >= 0 && x < w && chartIds[x] != 0) ? src[static_cast<size_t>(x) * CHANNEL_COUNT + c] : 0.f; };
+		for(uint32_t x = 0; x < w; ++x) {
+			for(uint32_t c = 0; c < CHANNEL_COUNT; ++c)
+				outRow.sums[static_cast<size_t>(x) * CHANNEL_COUNT + c] = (getMasked(static_cast<int64_t>(x) - 1, c) + getMasked(x, c)) + getMasked(static_cast<int64_t>(x) + 1, c);
+		}
+#endif
+		for(uint32_t x = 0; x < w; ++x) {
+			auto left = (x > 0) ? chartIds[x - 1] : 0u;
+			auto right = (x + 1 < w) ? chartIds[x + 1] : 0u;
+			outRow.counts[x] = static_cast<uint32_t>(left != 0) + static_cast<uint32_t>(chartIds[x] != 0) + static_cast<uint32_t>(right != 0);
+			outRow.firstChartIds[x] = (left != 0) ? left : ((chartIds[x] != 0) ? chartIds[x] : right);
+		}
+	}
+};
+
+uint32_t pragma::scenekit::tile_kernels::dilate_rgba32f(const float *src, const uint32_t *srcChartIds, float *dst, uint32_t *dstChartIds, uint32_t w, uint32_t h)
+{
+	if(w == 0 || h == 0)
+		return 0;
+	// The 3x3 sum is separable: Every row is summed horizontally once, and the sums of the rows above and below are added to that.
+	// Only the horizontal sums of the last three rows are kept, rows outside of the image are all zero.
+	std::vector<DilateRow> rows(3, DilateRow {w});
+	DilateRow emptyRow {w};
+	auto getRow = [&](int64_t y) -> const DilateRow & { return (y >= 0 && y < h) ? rows[y % 3] : emptyRow; };
+	sum_dilate_row(src, srcChartIds, w, rows[0]);
+	uint32_t numFilled = 0;
+	for(uint32_t y = 0; y < h; ++y) {
+		if(y + 1 < h)
+			sum_dilate_row(src + static_cast<size_t>(y + 1) * w * CHANNEL_COUNT, srcChartIds + static_cast<size_t>(y + 1) * w, w, rows[(y + 1) % 3]);
+		auto &above = getRow(static_cast<int64_t>(y) - 1);
+		auto &center = getRow(y);
+		auto &below = getRow(static_cast<int64_t>(y) + 1);
+		for(uint32_t x = 0; x < w; ++x) {
+			auto idx = static_cast<size_t>(y) * w + x;
+			if(srcChartIds[idx] != 0)
+				continue;
+			auto count = above.counts[x] + center.counts[x] + below.counts[x];
+			if(count == 0)
+				continue;
+			auto offset = static_cast<size_t>(x) * CHANNEL_COUNT;
+#ifdef UNIRENDER_TILE_KERNELS_SSE2
+			auto sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(above.sums.data() + offset), _mm_loadu_ps(center.sums.data() + offset)), _mm_loadu_ps(below.sums.data() + offset));
+			_mm_storeu_ps(dst + idx * CHANNEL_COUNT, _mm_div_ps(sum, _mm_set1_ps(static_cast<float>(count))));
+#else
+			for(uint32_t c = 0; c < CHANNEL_COUNT; ++c)
+				dst[idx * CHANNEL_COUNT + c] = ((above.sums[offset + c] + center.sums[offset + c]) + below.sums[offset + c]) / static_cast<float>(count);
+#endif
+			dstChartIds[idx] = (above.firstChartIds[x] != 0) ? above.firstChartIds[x] : ((center.firstChartIds[x] != 0) ? center.firstChartIds[x] : below.firstChartIds[x]);
+			++numFilled;
+		}
+	}
+	return numFilled;
+}
@@ -0,0 +1,187 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+module pragma.scenekit;
+
+import :tile_statistics;
+
+uint32_t pragma::scenekit::LatencyHistogram::GetBucketIndex(uint64_t value)
+{
+	if(value < SUB_BUCKET_COUNT)
+		return static_cast<uint32_t>(value);
+	auto msb = static_cast<uint32_t>(std::bit_width(value)) - 1;
+	auto octave = msb - SUB_BUCKET_BITS + 1;
+	auto subBucket = static_cast<uint32_t>(value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+	return octave * SUB_BUCKET_COUNT + subBucket;
+}
+
+uint64_t pragma::scenekit::LatencyHistogram::GetBucketUpperBound(uint32_t index)
+{
+	if(index < SUB_BUCKET_COUNT)
+		return index;
+	auto octave = index / SUB_BUCKET_COUNT;
+	auto subBucket = index % SUB_BUCKET_COUNT;
+	auto lowerBound = static_cast<uint64_t>(SUB_BUCKET_COUNT + subBucket) << (octave - 1);
+	return lowerBound + ((static_cast<uint64_t>(1) << (octave - 1)) - 1);
+}
+
+void pragma::scenekit::LatencyHistogram::Record(std::chrono::nanoseconds t)
+{
+	auto value = static_cast<uint64_t>(std::max<int64_t>(t.count(), 0));
+	m_buckets[GetBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_total.fetch_add(value, std::memory_order_relaxed);
+	auto curMax = m_max.load(std::memory_order_relaxed);
+	while(value > curMax && !m_max.compare_exchange_weak(curMax, value, std::memory_order_relaxed))
+		;
+}
+
+void pragma::scenekit::LatencyHistogram::Reset()
+{
+	for(auto &bucket : m_buckets)
+		bucket.store(0, std::memory_order_relaxed);
+	m_count = 0;
+	m_total = 0;
+	m_max = 0;
+}
+
+std::chrono::nanoseconds pragma::scenekit::LatencyHistogram::GetMean() const
+{
+	auto count = GetCount();
+	return std::chrono::nanoseconds {(count > 0) ? static_cast<int64_t>(m_total.load(std::memory_order_relaxed) / count) : 0};
+}
+
+std::chrono::nanoseconds pragma::scenekit::LatencyHistogram::GetPercentile(double percentile) const
+{
+	// The buckets may be updated while we're iterating, so the total is taken from the buckets themselves
+	uint64_t count = 0;
+	for(auto &bucket : m_buckets)
+		count += bucket.load(std::memory_order_relaxed);
+	if(count == 0)
+		return std::chrono::nanoseconds {0};
+	auto target = static_cast<uint64_t>(std::ceil(std::clamp(percentile, 0.0, 100.0) / 100.0 * static_cast<double>(count)));
+	target = std::max<uint64_t>(target, 1);
+	uint64_t cumulative = 0;
+	for(uint32_t i = 0; i < BUCKET_COUNT; ++i) {
+		cumulative += m_buckets[i].load(std::memory_order_relaxed);
+		if(cumulative >= target)
+			return std::chrono::nanoseconds {static_cast<int64_t>(std::min(GetBucketUpperBound(i), m_max.load(std::memory_order_relaxed)))};
+	}
+	return GetMax();
+}
+
+////////////
+
+std::string_view pragma::scenekit::TileStatistics::GetStageName(Stage stage)
+{
+	switch(stage) {
+	case Stage::Queued:
+		return "queued";
+	case Stage::Initialize:
+		return "initialize";
+	case Stage::PostProcess:
+		return "post_process";
+	case Stage::AwaitingConsumer:
+		return "awaiting_consumer";
+	case Stage::Total:
+		return "total";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+std::string_view pragma::scenekit::TileStatistics::GetCounterName(Counter counter)
+{
+	switch(counter) {
+	case Counter::TilesReceived:
+		return "tiles_received";
+	case Counter::TilesProcessed:
+		return "tiles_processed";
+	case Counter::TilesDelivered:
+		return "tiles_delivered";
+	case Counter::TilesDiscarded:
+		return "tiles_discarded";
+	case Counter::TilesSuperseded:
+		return "tiles_superseded";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+pragma::scenekit::TileStatistics::TileStatistics() { Reset(); }
+
+void pragma::scenekit::TileStatistics::Reset()
+{
+	for(auto &histogram : m_histograms)
+		histogram.Reset();
+	for(auto &counter : m_counters)
+		counter.store(0, std::memory_order_relaxed);
+	m_startTime = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+std::chrono::nanoseconds pragma::scenekit::TileStatistics::GetElapsedTime() const
+{
+	auto startTime = std::chrono::steady_clock::time_point {std::chrono::steady_clock::duration {m_startTime.load(std::memory_order_relaxed)}};
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime);
+}
+
+double pragma::scenekit::TileStatistics::GetThroughput(Counter counter) const
+{
+	auto elapsed = std::chrono::duration<double>(GetElapsedTime()).count();
+	return (elapsed > 0.0) ? (static_cast<double>(GetCounter(counter)) / elapsed) : 0.0;
+}
+
+std::string pragma::scenekit::TileStatistics::ToJson(const std::vector<Gauge> &gauges) const
+{
+	// Latencies are written in microseconds
+	auto toUs = [](std::chrono::nanoseconds t) { return static_cast<double>(t.count()) / 1'000.0; };
+	std::stringstream ss;
+	ss << "{\"elapsed_s\":" << std::chrono::duration<double>(GetElapsedTime()).count();
+	ss << ",\"stages\":{";
+	for(size_t i = 0; i < m_histograms.size(); ++i) {
+		auto &histogram = m_histograms[i];
+		if(i > 0)
+			ss << ",";
+		ss << "\"" << GetStageName(static_cast<Stage>(i)) << "\":{";
+		ss << "\"count\":" << histogram.GetCount();
+		ss << ",\"mean_us\":" << toUs(histogram.GetMean());
+		ss << ",\"p50_us\":" << toUs(histogram.GetPercentile(50.0));
+		ss << ",\"p90_us\":" << toUs(histogram.GetPercentile(90.0));
+		ss << ",\"p99_us\":" << toUs(histogram.GetPercentile(99.0));
+		ss << ",\"max_us\":" << toUs(histogram.GetMax());
+		ss << "}";
+	}
+	ss << "},\"counters\":{";
+	for(size_t i = 0; i < m_counters.size(); ++i) {
+		auto counter = static_cast<Counter>(i);
+		if(i > 0)
+			ss << ",";
+		ss << "\"" << GetCounterName(counter) << "\":{\"count\":" << GetCounter(counter) << ",\"per_second\":" << GetThroughput(counter) << "}";
+	}
+	ss << "},\"gauges\":{";
+	for(size_t i = 0; i < gauges.size(); ++i) {
+		if(i > 0)
+			ss << ",";
+		ss << "\"" << gauges[i].first << "\":" << gauges[i].second;
+	}
+	ss << "}}";
+	return ss.str();
+}
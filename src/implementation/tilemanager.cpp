@@ -11,14 +11,47 @@ module;
 #include <util_image_buffer.hpp>
 #include <sharedutils/util.h>
 #include <cstring>
+#include <mutex>
+#include <atomic>
+#include <queue>
+#include <iterator>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <numbers>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#endif
 #include <sharedutils/ctpl_stl.h>
 
 module pragma.scenekit;
 
 import :tile_manager;
+import :tile_kernels;
 
 bool pragma::scenekit::TileManager::TileData::IsFloatData() const { return !IsHDRData(); }
 bool pragma::scenekit::TileManager::TileData::IsHDRData() const { return umath::is_flag_set(flags, Flags::HDRData); }
+uimg::Format pragma::scenekit::TileManager::TileData::GetFormat() const { return IsFloatData() ? uimg::Format::RGBA_FLOAT : uimg::Format::RGBA_HDR; }
+const pragma::scenekit::TileManager::AovPlane *pragma::scenekit::TileManager::TileData::FindAov(PassType type) const
+{
+	auto it = std::find_if(aovs.begin(), aovs.end(), [type](const AovPlane &aov) { return aov.type == type; });
+	return (it != aovs.end()) ? &*it : nullptr;
+}
+size_t pragma::scenekit::TileManager::TileData::GetByteSize() const
+{
+	auto size = data.size();
+	for(auto &aov : aovs)
+		size += aov.data.size();
+	return size;
+}
 
 pragma::scenekit::TileManager::~TileManager() { StopAndWait(); }
 
@@ -30,16 +63,118 @@ void pragma::scenekit::TileManager::StopAndWait()
 
 void pragma::scenekit::TileManager::SetState(State state)
 {
-	m_state = state;
+	{
+		std::scoped_lock lock {m_threadWaitMutex};
+		m_state = state;
+	}
 	m_threadWaitCondition.notify_all();
+
+	// Wake up producers that are waiting for space in the input queues
+	{
+		std::scoped_lock lock {m_inputSpaceMutex};
+	}
+	m_inputSpaceCondition.notify_all();
+
+	// Wake up workers that are waiting for the rendered tile backlog to be retrieved
+	{
+		std::scoped_lock lock {m_renderedTileMutex};
+	}
+	m_renderedTileCondition.notify_all();
 }
 
 void pragma::scenekit::TileManager::NotifyPendingWork()
 {
-	m_hasPendingWork = true;
+	ForwardLegacyInputTiles();
+	// Empty critical section to make sure a worker is either already waiting or will see the new tiles
+	// when evaluating its wait predicate
+	{
+		std::scoped_lock lock {m_threadWaitMutex};
+	}
 	m_threadWaitCondition.notify_all();
 }
 
+void pragma::scenekit::TileManager::ForwardLegacyInputTiles()
+{
+	std::vector<TileData> tiles;
+	{
+		std::scoped_lock lock {m_legacyInputTileMutex};
+		while(!m_legacyInputTileQueue.empty()) {
+			auto tileIndex = m_legacyInputTileQueue.front();
+			m_legacyInputTileQueue.pop();
+			// The same index may have been queued multiple times, in which case only the newest tile is still in the list
+			if(tileIndex >= m_legacyInputTiles.size() || m_legacyInputTiles[tileIndex].index == std::numeric_limits<uint16_t>::max())
+				continue;
+			tiles.push_back(std::move(m_legacyInputTiles[tileIndex]));
+			m_legacyInputTiles[tileIndex] = {};
+		}
+	}
+	for(auto &tile : tiles)
+		AddInputTile(std::move(tile));
+}
+
+void pragma::scenekit::TileManager::AddInputTile(TileData &&tile)
+{
+	if(tile.index >= m_numTiles)
+		return;
+	if(tile.arrivalTime == std::chrono::steady_clock::time_point {})
+		tile.arrivalTime = std::chrono::steady_clock::now();
+	m_statistics.Increment(TileStatistics::Counter::TilesReceived);
+
+	// Only the newest sample of a tile has to be post-processed, older samples that are still queued will be skipped by the workers
+	auto &latestSample = m_latestInputSamples[tile.index];
+	auto sample = static_cast<uint32_t>(tile.sample) + 1;
+	auto prevSample = latestSample.load(std::memory_order_relaxed);
+	while(prevSample < sample && !latestSample.compare_exchange_weak(prevSample, sample, std::memory_order_relaxed))
+		;
+	if(prevSample > sample) {
+		m_statistics.Increment(TileStatistics::Counter::TilesSuperseded);
+		ReleaseTile(std::move(tile));
+		return;
+	}
+
+	// The tile (including its pixel data) is moved into the queue, workers will take ownership of it when popping it
+	MpmcQueue<TileData> *queue;
+	{
+		// The priority levels may be replaced by UpdateTilePriorities
+		std::scoped_lock lock {m_tileOrderMutex};
+		queue = &m_inputTileQueues[(tile.index < m_tilePriorityLevels.size()) ? m_tilePriorityLevels[tile.index].load(std::memory_order_relaxed) : (PRIORITY_LEVEL_COUNT - 1)];
+	}
+	while(!queue->TryPush(std::move(tile))) {
+		// Queue is full, wait for the workers to catch up
+		std::unique_lock lock {m_inputSpaceMutex};
+		m_blockedProducerCount.fetch_add(1);
+		m_inputSpaceCondition.wait(lock, [this, queue]() { return m_state != State::Running || queue->GetSize() < queue->GetCapacity(); });
+		m_blockedProducerCount.fetch_sub(1);
+		if(m_state != State::Running) {
+			lock.unlock();
+			ReleaseTile(std::move(tile));
+			return;
+		}
+	}
+	{
+		std::scoped_lock lock {m_threadWaitMutex};
+		++m_inputTileGeneration;
+	}
+	// One tile only requires one worker
+	m_threadWaitCondition.notify_one();
+}
+
+std::vector<uint8_t> pragma::scenekit::TileManager::AcquireTileBuffer(uint32_t w, uint32_t h, uimg::Format format) { return m_tileBufferPool.Acquire(w, h, format); }
+void pragma::scenekit::TileManager::ReleaseTile(TileData &&tile)
+{
+	auto format = tile.GetFormat();
+	m_tileBufferPool.Release(std::move(tile.data), tile.w, tile.h, format);
+	for(auto &aov : tile.aovs)
+		m_tileBufferPool.Release(std::move(aov.data), tile.w, tile.h, format);
+	tile.aovs.clear();
+}
+void pragma::scenekit::TileManager::ReleaseTileBatch(std::vector<TileData> &&tiles)
+{
+	for(auto &tile : tiles)
+		ReleaseTile(std::move(tile));
+	tiles.clear();
+}
+
 void pragma::scenekit::TileManager::Cancel() { SetState(State::Cancelled); }
 void pragma::scenekit::TileManager::Wait()
 {
@@ -53,18 +188,107 @@ void pragma::scenekit::TileManager::SetExposure(float exposure) { m_exposure = e
 void pragma::scenekit::TileManager::SetGamma(float gamma) { m_gamma = gamma; }
 void pragma::scenekit::TileManager::SetUseFloatData(bool b) { m_useFloatData = b; }
 
-void pragma::scenekit::TileManager::Initialize(uint32_t w, uint32_t h, uint32_t wTile, uint32_t hTile, bool cpuDevice, float exposure, float gamma, util::ocio::ColorProcessor *optColorProcessor)
+static bool set_thread_affinity(std::thread &thread, const std::vector<uint32_t> &cpus)
+{
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for(auto cpu : cpus) {
+		if(cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &cpuSet);
+	}
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet) == 0;
+#elif defined(_WIN32)
+	// Note: Only the first processor group (64 cores) is supported
+	DWORD_PTR mask = 0;
+	for(auto cpu : cpus) {
+		if(cpu < sizeof(DWORD_PTR) * 8)
+			mask |= static_cast<DWORD_PTR>(1) << cpu;
+	}
+	return mask != 0 && SetThreadAffinityMask(thread.native_handle(), mask) != 0;
+#else
+	// Not supported on this platform (e.g. macOS only provides affinity hints through thread_policy_set), the workers run unrestricted
+	return false;
+#endif
+}
+
+void pragma::scenekit::TileManager::InitializeThreadPool(const Settings &settings)
+{
+	auto workerCount = settings.workerCount;
+	if(workerCount == Settings::AUTO_WORKER_COUNT) {
+		if(!settings.workerCpuAffinity.empty())
+			workerCount = static_cast<uint32_t>(settings.workerCpuAffinity.size());
+		else {
+			auto numCores = std::max(std::thread::hardware_concurrency(), 1u);
+			// CPU renders already occupy all cores, so post-processing only gets a small share of them
+			workerCount = m_cpuDevice ? (numCores / 4) : (numCores / 2);
+		}
+		workerCount = std::clamp(workerCount, 1u, 64u);
+	}
+
+	// Workers from a previous run must not be running while the pool is being changed
+	SetState(State::Cancelled);
+	Wait();
+	m_ppThreadPool.resize(workerCount);
+	m_ppThreadPoolHandles.clear();
+	m_ppThreadPoolHandles.resize(workerCount);
+	if(!settings.workerCpuAffinity.empty()) {
+		for(auto i = decltype(workerCount) {0u}; i < workerCount; ++i) {
+			if(!set_thread_affinity(m_ppThreadPool.get_thread(i), settings.workerCpuAffinity))
+				std::cout << "Unable to set CPU affinity for tile post-processing thread " << i << "!" << std::endl;
+		}
+	}
+}
+
+void pragma::scenekit::TileManager::Initialize(uint32_t w, uint32_t h, uint32_t wTile, uint32_t hTile, bool cpuDevice, float exposure, float gamma, util::ocio::ColorProcessor *optColorProcessor, const Settings &settings)
 {
 	m_cpuDevice = cpuDevice;
+	m_storagePrecision = settings.storagePrecision;
+	m_renderedTileMemoryLimit = settings.renderedTileMemoryLimit;
+	m_backlogPolicy = settings.backlogPolicy;
+	InitializeThreadPool(settings);
 	if(optColorProcessor)
 		m_colorTransformProcessor = optColorProcessor->shared_from_this();
 	m_numTilesPerAxis = {(w / wTile) + ((w % wTile) > 0 ? 1 : 0), (h / hTile) + ((h % hTile) > 0 ? 1 : 0)};
 	auto numTiles = m_numTilesPerAxis.x * m_numTilesPerAxis.y;
 	m_numTiles = numTiles;
-	m_inputTiles.resize(numTiles);
+	// Enough room for several samples per tile, if a queue is full the renderer will be stalled until the workers have caught up
+	for(auto &queue : m_inputTileQueues)
+		queue.Resize(numTiles * 4);
+	m_latestInputSamples = std::vector<std::atomic<uint32_t>>(numTiles);
+	{
+		std::scoped_lock lock {m_legacyInputTileMutex};
+		m_legacyInputTiles.resize(numTiles);
+	}
 	m_completedTiles.resize(numTiles);
-	m_progressiveImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGBA_FLOAT);
+	m_completedTileRevisions = std::vector<uint32_t>(numTiles, 0);
+	m_appliedTileRevisions = std::vector<uint32_t>(numTiles, 0);
+	m_tilePixelVariances = std::vector<float>(numTiles, NO_NOISE_ESTIMATE);
+	m_tileNoiseLevels = std::vector<std::atomic<float>>(numTiles);
+	m_renderedTileSlots = std::vector<uint64_t>(numTiles, NO_RENDERED_TILE_SLOT);
+	m_progressiveImage = uimg::ImageBuffer::Create(w, h, (m_storagePrecision == StoragePrecision::Half) ? uimg::Format::RGBA_HDR : uimg::Format::RGBA_FLOAT);
 	m_tileSize = {wTile, hTile};
+	m_aovs = settings.aovs;
+	m_progressiveAovImages.clear();
+	for(auto &aov : m_aovs)
+		m_progressiveAovImages.push_back(uimg::ImageBuffer::Create(w, h, m_progressiveImage->GetFormat()));
+	m_previewLevels.clear();
+	for(auto levelW = w, levelH = h; m_previewLevels.size() < settings.previewLevelCount && (levelW > 1 || levelH > 1);) {
+		levelW = (levelW + 1) / 2;
+		levelH = (levelH + 1) / 2;
+		m_previewLevels.push_back(uimg::ImageBuffer::Create(levelW, levelH, m_progressiveImage->GetFormat()));
+	}
+	m_previewTileRects = std::vector<TileRect>(numTiles, TileRect {});
+	m_previewTileRevisions = std::vector<uint64_t>(numTiles, 0);
+	m_previewRevision = 0;
+	m_sharedFramebuffer = nullptr;
+	if(settings.sharedFramebuffer.has_value()) {
+		std::string err;
+		m_sharedFramebuffer = SharedFramebuffer::Create(*settings.sharedFramebuffer, w, h, wTile, hTile, err);
+		if(!m_sharedFramebuffer)
+			std::cout << "Unable to create shared framebuffer '" << settings.sharedFramebuffer->name << "': " << err << std::endl;
+	}
+	UpdateTilePriorities();
 	m_exposure = exposure;
 	m_gamma = gamma;
 	Reload(false);
@@ -76,9 +300,13 @@ void pragma::scenekit::TileManager::Reload(bool waitForCompletion)
 		StopAndWait();
 	else
 		SetState(State::Cancelled);
-	m_hasPendingWork = false;
 	m_renderedTileMutex.lock();
+	for(auto &tile : m_renderedTiles)
+		ReleaseTile(std::move(tile));
 	m_renderedTiles.clear();
+	std::fill(m_renderedTileSlots.begin(), m_renderedTileSlots.end(), NO_RENDERED_TILE_SLOT);
+	m_renderedTileSequenceBase = 0;
+	m_renderedTileBytes = 0;
 	//for(auto &tile : m_renderedTiles)
 	//	tile = {};
 
@@ -89,9 +317,16 @@ void pragma::scenekit::TileManager::Reload(bool waitForCompletion)
 	m_renderedTileMutex.unlock();
 
 	m_completedTileMutex.lock();
+	// The completed tile revisions are intentionally not reset: They only ever increase, so consumers holding revisions from before the
+	// reload (UpdateFinalImage, CopyCompletedTiles) can't mistake a new sample for one they've already seen.
 	for(auto &tile : m_completedTiles)
 		tile.sample = std::numeric_limits<uint16_t>::max();
+	std::fill(m_tilePixelVariances.begin(), m_tilePixelVariances.end(), NO_NOISE_ESTIMATE);
+	for(auto &noiseLevel : m_tileNoiseLevels)
+		noiseLevel = NO_NOISE_ESTIMATE;
 	m_completedTileMutex.unlock();
+	if(m_sharedFramebuffer)
+		m_sharedFramebuffer->BeginFrame();
 	// Test
 	/*{
 		Wait();
@@ -109,88 +344,249 @@ void pragma::scenekit::TileManager::Reload(bool waitForCompletion)
 		m_progressiveImage->Clear(Color::Red);
 	}*/
 
-	m_inputTileMutex.lock();
-	for(auto &tile : m_inputTiles)
-		tile.sample = std::numeric_limits<decltype(tile.sample)>::max();
-	m_inputTileMutex.unlock();
+	// Discard tiles from the previous run
+	{
+		std::scoped_lock lock {m_legacyInputTileMutex};
+		for(auto &tile : m_legacyInputTiles) {
+			ReleaseTile(std::move(tile));
+			tile = {};
+		}
+		m_legacyInputTileQueue = {};
+	}
+	TileData discardTile;
+	while(PopInputTile(discardTile))
+		ReleaseTile(std::move(discardTile));
+	// Sample counts start from scratch
+	for(auto &sample : m_latestInputSamples)
+		sample = 0;
+	for(auto &skipCount : m_inputQueueSkipCounts)
+		skipCount = 0;
 
 	Wait();
 	SetState(State::Running);
 	for(auto i = decltype(m_ppThreadPool.size()) {0u}; i < m_ppThreadPool.size(); ++i) {
 		m_ppThreadPoolHandles.at(i) = m_ppThreadPool.push([this](int threadId) {
-			std::unique_lock<std::mutex> mlock(m_threadWaitMutex);
+			TileData tile {};
 			for(;;) {
-				// TODO
-				// m_threadWaitCondition.wait(mlock,[this]() {return m_state != State::Running || m_hasPendingWork;});
-				// TODO: ALso see sleep
-
-				while(m_hasPendingWork) {
-					m_inputTileMutex.lock();
-					if(m_state == State::Cancelled) {
-						m_inputTileMutex.unlock();
-						goto endThread;
-					}
-					if(m_inputTileQueue.empty()) {
-						m_inputTileMutex.unlock();
+				{
+					std::unique_lock<std::mutex> mlock {m_threadWaitMutex};
+					m_threadWaitCondition.wait(mlock, [this]() { return m_state != State::Running || HasPendingInputTiles(); });
+				}
+				if(m_state == State::Cancelled)
+					break;
+				auto generation = m_inputTileGeneration.load();
+				if(!PopInputTile(tile)) {
+					// If we've been stopped, we'll only quit once all of the remaining tiles have been processed
+					if(m_state != State::Running)
 						break;
-					}
-					auto tileIndex = m_inputTileQueue.front();
-					m_inputTileQueue.pop();
-					if(m_inputTileQueue.empty())
-						m_hasPendingWork = false;
-					auto tile = m_inputTiles[tileIndex];
-					m_inputTileMutex.unlock();
-
-					if(m_state == State::Cancelled)
-						goto endThread;
-
-					InitializeTileData(tile);
-
-					if(m_state == State::Cancelled)
-						goto endThread;
-
-					m_completedTileMutex.lock();
-					if(m_completedTiles[tileIndex].sample == std::numeric_limits<uint16_t>::max() || tile.sample > m_completedTiles[tileIndex].sample)
-						m_completedTiles[tileIndex] = tile; // Completed tile data is float data WITHOUT color correction (color correction will be applied after denoising)
-					m_completedTileMutex.unlock();
-
-					ApplyPostProcessingForProgressiveTile(tile);
-					// Progressive tile is HDR 16-bit data WITH color correction (tile will be discarded when rendering is complete and 'm_completedTiles' tile will be used instead)
-					m_renderedTileMutex.lock();
-					if(m_state == State::Cancelled) {
-						m_renderedTileMutex.unlock();
-						goto endThread;
-					}
-					if(m_renderedTiles.size() == m_renderedTiles.capacity())
-						m_renderedTiles.reserve(m_renderedTiles.size() * 1.5 + 100);
-					m_renderedTiles.push_back(std::move(tile));
-					//if(m_renderedSampleCountPerTile.at(tile.index) == 0)
-					//	++m_numTilesWithRenderedSamples;
-					//m_renderedSampleCountPerTile.at(tile.index) = tile.sample +1;
-
-					uint32_t curSampleCount = m_renderedSampleCountPerTile.at(tile.index);
-					static uint32_t test = 3;
-					if((tile.sample + 1) >= test) {
-						m_renderedSampleCountPerTile.at(tile.index) = tile.sample + 1;
-						if(curSampleCount == 0)
-							++m_numTilesWithRenderedSamples;
-					}
-
-					m_renderedTileMutex.unlock();
+					// The queue may report a pending tile that hasn't been fully published by its producer yet, or another worker has taken it first.
+					// Either way there's nothing to do until the next tile has been pushed.
+					std::unique_lock<std::mutex> mlock {m_threadWaitMutex};
+					m_threadWaitCondition.wait(mlock, [this, generation]() { return m_state != State::Running || m_inputTileGeneration.load() != generation; });
+					continue;
 				}
-				if(m_hasPendingWork == false)
-					std::this_thread::sleep_for(std::chrono::milliseconds(100));
-				if((m_state == State::Stopped && m_hasPendingWork == false) || m_state == State::Cancelled)
-					goto endThread;
+				ProcessTile(tile);
 			}
-		endThread:;
 		});
 		// Thread priority is excessively high due to Cycles, so we'll reset it to normal here
 		// util::set_thread_priority(m_ppThreadPool.get_thread(i),util::ThreadPriority::Normal);
 	}
 }
-std::shared_ptr<uimg::ImageBuffer> pragma::scenekit::TileManager::UpdateFinalImage()
+bool pragma::scenekit::TileManager::IsSupersededInputTile(const TileData &tile) const { return static_cast<uint32_t>(tile.sample) + 1 < m_latestInputSamples[tile.index].load(std::memory_order_relaxed); }
+bool pragma::scenekit::TileManager::PopInputTile(TileData &outTile)
+{
+	// Higher priority tiles are drained first, unless a lower priority queue has been passed over too often
+	std::array<uint32_t, PRIORITY_LEVEL_COUNT> levels;
+	for(uint32_t i = 0; i < PRIORITY_LEVEL_COUNT; ++i)
+		levels[i] = i;
+	for(auto level = PRIORITY_LEVEL_COUNT - 1; level > 0; --level) {
+		if(m_inputQueueSkipCounts[level].load(std::memory_order_relaxed) >= MAX_PRIORITY_SKIP_COUNT) {
+			std::rotate(levels.begin(), levels.begin() + level, levels.begin() + level + 1);
+			break;
+		}
+	}
+
+	auto found = false;
+	auto popped = false;
+	for(auto level : levels) {
+		auto &queue = m_inputTileQueues[level];
+		while(queue.TryPop(outTile)) {
+			popped = true;
+			if(!IsSupersededInputTile(outTile)) {
+				found = true;
+				break;
+			}
+			m_statistics.Increment(TileStatistics::Counter::TilesSuperseded);
+			ReleaseTile(std::move(outTile));
+		}
+		if(!found)
+			continue;
+		m_inputQueueSkipCounts[level].store(0, std::memory_order_relaxed);
+		for(auto lowerLevel = level + 1; lowerLevel < PRIORITY_LEVEL_COUNT; ++lowerLevel) {
+			if(!m_inputTileQueues[lowerLevel].IsEmpty())
+				m_inputQueueSkipCounts[lowerLevel].fetch_add(1, std::memory_order_relaxed);
+		}
+		break;
+	}
+	if(popped) {
+		// Pairs with the increment of m_blockedProducerCount: Either the producer sees the free slot, or we see the producer
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(m_blockedProducerCount.load(std::memory_order_relaxed) > 0) {
+			{
+				std::scoped_lock lock {m_inputSpaceMutex};
+			}
+			m_inputSpaceCondition.notify_all();
+		}
+	}
+	return found;
+}
+bool pragma::scenekit::TileManager::HasPendingInputTiles() const
+{
+	for(auto &queue : m_inputTileQueues) {
+		if(!queue.IsEmpty())
+			return true;
+	}
+	return false;
+}
+void pragma::scenekit::TileManager::ProcessTile(TileData &tile)
+{
+	auto tStart = std::chrono::steady_clock::now();
+	if(tile.arrivalTime != std::chrono::steady_clock::time_point {})
+		m_statistics.Record(TileStatistics::Stage::Queued, tStart - tile.arrivalTime);
+	if(m_state == State::Cancelled) {
+		m_statistics.Increment(TileStatistics::Counter::TilesDiscarded);
+		ReleaseTile(std::move(tile));
+		return;
+	}
+	auto tileIndex = tile.index;
+	m_completedTileMutex.lock();
+	// Completed tile data is raw data WITHOUT color correction (color correction will be applied after denoising).
+	// Flipping and clearing the alpha channel is deferred to ApplyRectData, which does it while copying the tile into the final image.
+	if(m_completedTiles[tileIndex].sample == std::numeric_limits<uint16_t>::max() || tile.sample > m_completedTiles[tileIndex].sample) {
+		if(m_completedTiles[tileIndex].sample != std::numeric_limits<uint16_t>::max())
+			UpdateNoiseEstimate(m_completedTiles[tileIndex], tile);
+		StoreCompletedTile(tile);
+		++m_completedTileRevisions[tileIndex];
+	}
+	m_completedTileMutex.unlock();
+
+	if(m_state == State::Cancelled) {
+		m_statistics.Increment(TileStatistics::Counter::TilesDiscarded);
+		ReleaseTile(std::move(tile));
+		return;
+	}
+	auto tInitialize = std::chrono::steady_clock::now();
+	InitializeTileData(tile);
+	auto tPostProcess = std::chrono::steady_clock::now();
+	m_statistics.Record(TileStatistics::Stage::Initialize, tPostProcess - tInitialize);
+
+	ApplyPostProcessingForProgressiveTile(tile);
+	tile.readyTime = std::chrono::steady_clock::now();
+	m_statistics.Record(TileStatistics::Stage::PostProcess, tile.readyTime - tPostProcess);
+	if(m_sharedFramebuffer)
+		m_sharedFramebuffer->WriteTile(tileIndex, tile.x, tile.y, tile.w, tile.h, tile.sample, tile.data.data(), tile.IsHDRData());
+	// Progressive tile is HDR 16-bit data WITH color correction (tile will be discarded when rendering is complete and 'm_completedTiles' tile will be used instead)
+	std::unique_lock<std::mutex> lock {m_renderedTileMutex};
+	if(m_state == State::Cancelled) {
+		lock.unlock();
+		m_statistics.Increment(TileStatistics::Counter::TilesDiscarded);
+		ReleaseTile(std::move(tile));
+		return;
+	}
+	m_statistics.Increment(TileStatistics::Counter::TilesProcessed);
+	auto sample = tile.sample;
+	PushRenderedTile(std::move(tile), lock);
+	//if(m_renderedSampleCountPerTile.at(tile.index) == 0)
+	//	++m_numTilesWithRenderedSamples;
+	//m_renderedSampleCountPerTile.at(tile.index) = tile.sample +1;
+
+	uint32_t curSampleCount = m_renderedSampleCountPerTile.at(tileIndex);
+	static uint32_t test = 3;
+	if((sample + 1) >= test) {
+		m_renderedSampleCountPerTile.at(tileIndex) = sample + 1;
+		if(curSampleCount == 0)
+			++m_numTilesWithRenderedSamples;
+	}
+}
+void pragma::scenekit::TileManager::PushRenderedTile(TileData &&tile, std::unique_lock<std::mutex> &lock)
 {
+	auto tileSize = tile.GetByteSize();
+	auto hasSlot = tile.index < m_renderedTileSlots.size();
+	for(;;) {
+		// Only the latest sample of a tile is kept
+		auto slot = hasSlot ? m_renderedTileSlots[tile.index] : NO_RENDERED_TILE_SLOT;
+		if(slot != NO_RENDERED_TILE_SLOT) {
+			auto &existingTile = m_renderedTiles[slot - m_renderedTileSequenceBase];
+			if(existingTile.sample != std::numeric_limits<uint16_t>::max() && tile.sample < existingTile.sample) {
+				// The backlog already has a newer sample, this tile doesn't replace anything
+				ReleaseTile(std::move(tile));
+				return;
+			}
+			++m_coalescedRenderedTileCount;
+			m_renderedTileBytes = m_renderedTileBytes - existingTile.GetByteSize() + tileSize;
+			ReleaseTile(std::move(existingTile));
+			existingTile = std::move(tile);
+			return;
+		}
+		if(m_renderedTileMemoryLimit == 0 || m_renderedTiles.empty() || m_renderedTileBytes + tileSize <= m_renderedTileMemoryLimit)
+			break;
+		if(m_backlogPolicy == BacklogPolicy::DropOldest) {
+			DropOldestRenderedTile();
+			continue;
+		}
+		if(m_state != State::Running)
+			break; // Don't block if we're stopping, the remaining tiles have to be processed regardless
+		m_renderedTileCondition.wait(lock);
+		if(m_state == State::Cancelled) {
+			ReleaseTile(std::move(tile));
+			return;
+		}
+	}
+	if(hasSlot)
+		m_renderedTileSlots[tile.index] = m_renderedTileSequenceBase + m_renderedTiles.size();
+	m_renderedTiles.push_back(std::move(tile));
+	m_renderedTileBytes += tileSize;
+}
+void pragma::scenekit::TileManager::DropOldestRenderedTile()
+{
+	if(m_renderedTiles.empty())
+		return;
+	auto &tile = m_renderedTiles.front();
+	m_renderedTileBytes -= tile.GetByteSize();
+	if(tile.index < m_renderedTileSlots.size())
+		m_renderedTileSlots[tile.index] = NO_RENDERED_TILE_SLOT;
+	ReleaseTile(std::move(tile));
+	m_renderedTiles.pop_front();
+	++m_renderedTileSequenceBase;
+	++m_droppedRenderedTileCount;
+}
+std::shared_ptr<uimg::ImageBuffer> pragma::scenekit::TileManager::UpdateFinalImage(UpdateMode mode, std::vector<TileRect> *optOutDirtyRects)
+{
+	if(optOutDirtyRects)
+		optOutDirtyRects->clear();
+	if(mode == UpdateMode::DirtyOnly) {
+		// Workers keep running, but they can't modify the completed tiles while we're holding the lock
+		std::scoped_lock lock {m_completedTileMutex, m_previewMutex};
+		auto previewRevision = m_previewRevision + 1;
+		for(auto i = decltype(m_completedTiles.size()) {0u}; i < m_completedTiles.size(); ++i) {
+			if(m_appliedTileRevisions[i] == m_completedTileRevisions[i])
+				continue;
+			auto &tile = m_completedTiles[i];
+			ApplyRectData(tile);
+			m_appliedTileRevisions[i] = m_completedTileRevisions[i];
+			if(tile.index == std::numeric_limits<decltype(tile.index)>::max())
+				continue;
+			auto rect = GetDestinationRect(tile);
+			UpdatePreviewLevels(rect);
+			m_previewTileRects[i] = rect;
+			m_previewTileRevisions[i] = previewRevision;
+			m_previewRevision = previewRevision;
+			if(optOutDirtyRects)
+				optOutDirtyRects->push_back(rect);
+		}
+		return m_progressiveImage;
+	}
+
 	StopAndWait();
 	constexpr auto verify = false;
 	auto sample = m_completedTiles.empty() ? -1 : m_completedTiles.front().sample;
@@ -203,48 +599,435 @@ std::shared_ptr<uimg::ImageBuffer> pragma::scenekit::TileManager::UpdateFinalIma
 			++tileIdx;
 		}
 	}
+	m_appliedTileRevisions = m_completedTileRevisions;
+
+	std::scoped_lock lock {m_previewMutex};
+	UpdatePreviewLevels({0, 0, static_cast<uint32_t>(m_progressiveImage->GetWidth()), static_cast<uint32_t>(m_progressiveImage->GetHeight())});
+	++m_previewRevision;
+	for(auto i = decltype(m_completedTiles.size()) {0u}; i < m_completedTiles.size(); ++i) {
+		auto &tile = m_completedTiles[i];
+		if(tile.index == std::numeric_limits<decltype(tile.index)>::max())
+			continue;
+		m_previewTileRects[i] = GetDestinationRect(tile);
+		m_previewTileRevisions[i] = m_previewRevision;
+	}
+	if(optOutDirtyRects)
+		optOutDirtyRects->push_back({0, 0, static_cast<uint32_t>(m_progressiveImage->GetWidth()), static_cast<uint32_t>(m_progressiveImage->GetHeight())});
 	return m_progressiveImage;
 }
+std::vector<pragma::scenekit::TileManager::TileRect> pragma::scenekit::TileManager::CopyCompletedTiles(std::vector<uint32_t> &inOutRevisions, uimg::ImageBuffer &outImage, const std::vector<std::pair<PassType, uimg::ImageBuffer *>> &aovImages)
+{
+	std::vector<TileRect> rects;
+	std::scoped_lock lock {m_completedTileMutex};
+	if(inOutRevisions.size() != m_completedTiles.size())
+		inOutRevisions.resize(m_completedTiles.size(), std::numeric_limits<uint32_t>::max());
+	for(auto i = decltype(m_completedTiles.size()) {0u}; i < m_completedTiles.size(); ++i) {
+		auto &tile = m_completedTiles[i];
+		if(inOutRevisions[i] == m_completedTileRevisions[i] || tile.index == std::numeric_limits<decltype(tile.index)>::max())
+			continue;
+		ApplyRectData(tile, tile.data, outImage, true);
+		for(auto &aov : tile.aovs) {
+			auto it = std::find_if(aovImages.begin(), aovImages.end(), [&aov](const std::pair<PassType, uimg::ImageBuffer *> &pair) { return pair.first == aov.type; });
+			if(it != aovImages.end() && it->second)
+				ApplyRectData(tile, aov.data, *it->second, false);
+		}
+		inOutRevisions[i] = m_completedTileRevisions[i];
+		rects.push_back(GetDestinationRect(tile));
+	}
+	return rects;
+}
+pragma::scenekit::TileManager::TileRect pragma::scenekit::TileManager::GetDestinationRect(const TileData &tile) const
+{
+	TileRect rect {tile.x, tile.y, tile.w, tile.h};
+	// Raw tiles still have their original (unflipped) coordinates
+	if(!umath::is_flag_set(tile.flags, TileData::Flags::Initialized)) {
+		if(m_flipHorizontally)
+			rect.x = m_progressiveImage->GetWidth() - tile.x - tile.w;
+		if(m_flipVertically)
+			rect.y = m_progressiveImage->GetHeight() - tile.y - tile.h;
+	}
+	return rect;
+}
+void pragma::scenekit::TileManager::UpdateNoiseEstimate(const TileData &previousTile, const TileData &tile)
+{
+	if(previousTile.w != tile.w || previousTile.h != tile.h || tile.IsHDRData())
+		return;
+	auto numPixels = static_cast<size_t>(tile.w) * tile.h;
+	auto *prevData = reinterpret_cast<const float *>(previousTile.data.data());
+	thread_local std::vector<float> prevDataFloat;
+	if(previousTile.IsHDRData()) {
+		prevDataFloat.resize(numPixels * 4);
+		tile_kernels::convert_half_to_float(reinterpret_cast<const uint16_t *>(previousTile.data.data()), prevDataFloat.data(), prevDataFloat.size());
+		prevData = prevDataFloat.data();
+	}
+	double sqDiffSum, lumSum;
+	tile_kernels::sum_luminance_difference_rgba32f(reinterpret_cast<const float *>(tile.data.data()), prevData, numPixels, sqDiffSum, lumSum);
+
+	// Both tiles contain the running mean of their samples. The difference between the means after n and m > n samples has a variance of
+	// sigma^2 * (1 / n - 1 / m), where sigma^2 is the variance of a single sample, which gives us an estimate for sigma^2.
+	auto n = static_cast<double>(previousTile.sample) + 1.0;
+	auto m = static_cast<double>(tile.sample) + 1.0;
+	auto pixelVariance = static_cast<float>((sqDiffSum / numPixels) / (1.0 / n - 1.0 / m));
+	auto &tileVariance = m_tilePixelVariances[tile.index];
+	// A single difference is a noisy estimate, so it's blended with the previous ones
+	tileVariance = (tileVariance < 0.f) ? pixelVariance : (tileVariance + pixelVariance) * 0.5f;
+
+	auto meanLuminance = std::max(static_cast<float>(lumSum / numPixels), 0.001f);
+	m_tileNoiseLevels[tile.index] = std::sqrt(tileVariance / static_cast<float>(m)) / meanLuminance;
+}
+
+std::vector<float> pragma::scenekit::TileManager::GetConvergenceMap() const
+{
+	std::vector<float> map;
+	map.reserve(m_tileNoiseLevels.size());
+	for(auto &noiseLevel : m_tileNoiseLevels)
+		map.push_back(noiseLevel.load(std::memory_order_relaxed));
+	return map;
+}
+
+float pragma::scenekit::TileManager::GetTileNoiseLevel(uint32_t tileIndex) const { return (tileIndex < m_tileNoiseLevels.size()) ? m_tileNoiseLevels[tileIndex].load(std::memory_order_relaxed) : NO_NOISE_ESTIMATE; }
+
+std::vector<uint32_t> pragma::scenekit::TileManager::GetTilesAboveNoiseThreshold(float threshold) const
+{
+	std::vector<uint32_t> tiles;
+	for(uint32_t i = 0; i < m_tileNoiseLevels.size(); ++i) {
+		auto noiseLevel = m_tileNoiseLevels[i].load(std::memory_order_relaxed);
+		if(noiseLevel == NO_NOISE_ESTIMATE || noiseLevel > threshold)
+			tiles.push_back(i);
+	}
+	return tiles;
+}
+
+void pragma::scenekit::TileManager::StoreCompletedTile(const TileData &tile)
+{
+	auto &completedTile = m_completedTiles[tile.index];
+	if(m_storagePrecision == StoragePrecision::Full) {
+		// The copy-assignment re-uses the buffer of the previous sample, so no allocation is required here after the first sample
+		completedTile = tile;
+		return;
+	}
+	completedTile.x = tile.x;
+	completedTile.y = tile.y;
+	completedTile.w = tile.w;
+	completedTile.h = tile.h;
+	completedTile.sample = tile.sample;
+	completedTile.index = tile.index;
+	completedTile.arrivalTime = tile.arrivalTime;
+	completedTile.flags = tile.flags | TileData::Flags::HDRData;
+	auto numValues = static_cast<size_t>(tile.w) * tile.h * 4;
+	completedTile.data.resize(numValues * sizeof(uint16_t));
+	tile_kernels::convert_float_to_half(reinterpret_cast<const float *>(tile.data.data()), reinterpret_cast<uint16_t *>(completedTile.data.data()), numValues);
+	completedTile.aovs.resize(tile.aovs.size());
+	for(size_t i = 0; i < tile.aovs.size(); ++i) {
+		auto &aov = completedTile.aovs[i];
+		aov.type = tile.aovs[i].type;
+		aov.data.resize(numValues * sizeof(uint16_t));
+		tile_kernels::convert_float_to_half(reinterpret_cast<const float *>(tile.aovs[i].data.data()), reinterpret_cast<uint16_t *>(aov.data.data()), numValues);
+	}
+}
+pragma::scenekit::TileManager::TileRect pragma::scenekit::TileManager::GetPreviewLevelRect(const TileRect &rect, uint32_t level) const
+{
+	if(level == 0)
+		return rect;
+	auto &img = *m_previewLevels[level - 1];
+	auto x0 = rect.x >> level;
+	auto y0 = rect.y >> level;
+	auto x1 = std::min<uint32_t>(((rect.x + rect.w) + (1u << level) - 1) >> level, img.GetWidth());
+	auto y1 = std::min<uint32_t>(((rect.y + rect.h) + (1u << level) - 1) >> level, img.GetHeight());
+	return {x0, y0, x1 - x0, y1 - y0};
+}
+
+void pragma::scenekit::TileManager::UpdatePreviewLevels(const TileRect &rect)
+{
+	auto *src = m_progressiveImage.get();
+	for(uint32_t i = 0; i < m_previewLevels.size(); ++i) {
+		auto &dst = *m_previewLevels[i];
+		auto dstRect = GetPreviewLevelRect(rect, i + 1);
+		if(dstRect.w == 0 || dstRect.h == 0)
+			return;
+		if(m_storagePrecision == StoragePrecision::Half)
+			tile_kernels::downsample_rgba16f(static_cast<const uint16_t *>(src->GetData()), src->GetWidth(), src->GetHeight(), static_cast<uint16_t *>(dst.GetData()), dstRect.x, dstRect.y, dstRect.w, dstRect.h);
+		else
+			tile_kernels::downsample_rgba32f(static_cast<const float *>(src->GetData()), src->GetWidth(), src->GetHeight(), static_cast<float *>(dst.GetData()), dstRect.x, dstRect.y, dstRect.w, dstRect.h);
+		src = &dst;
+	}
+}
+
+std::shared_ptr<uimg::ImageBuffer> pragma::scenekit::TileManager::GetPreviewLevel(uint32_t level) const
+{
+	if(level == 0)
+		return m_progressiveImage;
+	return (level <= m_previewLevels.size()) ? m_previewLevels[level - 1] : nullptr;
+}
+
+uint64_t pragma::scenekit::TileManager::GetPreviewDirtyRects(uint32_t level, uint64_t sinceRevision, std::vector<TileRect> &outRects) const
+{
+	outRects.clear();
+	std::scoped_lock lock {m_previewMutex};
+	if(level > m_previewLevels.size())
+		return m_previewRevision;
+	for(auto i = decltype(m_previewTileRevisions.size()) {0u}; i < m_previewTileRevisions.size(); ++i) {
+		if(m_previewTileRevisions[i] > sinceRevision)
+			outRects.push_back(GetPreviewLevelRect(m_previewTileRects[i], level));
+	}
+	return m_previewRevision;
+}
+
 void pragma::scenekit::TileManager::ApplyRectData(const TileData &tile)
 {
 	if(tile.index == std::numeric_limits<decltype(tile.index)>::max())
 		return;
-	auto *srcData = reinterpret_cast<const uint8_t *>(tile.data.data());
-	auto *dstData = static_cast<uint8_t *>(m_progressiveImage->GetData());
-
-	constexpr auto sizePerPixel = sizeof(float) * 4;
-	auto srcSizePerRow = tile.w * sizePerPixel;
-	auto dstSizePerRow = m_progressiveImage->GetWidth() * sizePerPixel;
-	uint64_t srcOffset = 0;
-	uint64_t dstOffset = (tile.y * m_progressiveImage->GetWidth() + tile.x) * sizePerPixel;
-	for(auto y = tile.y; y < (tile.y + tile.h); ++y) {
-		std::memcpy(dstData + dstOffset, srcData + srcOffset, tile.w * sizePerPixel);
-		srcOffset += srcSizePerRow;
-		dstOffset += dstSizePerRow;
+	ApplyRectData(tile, tile.data, *m_progressiveImage, true);
+	for(auto &aov : tile.aovs) {
+		uint32_t aovIndex;
+		if(FindAovInfo(aov.type, &aovIndex))
+			ApplyRectData(tile, aov.data, *m_progressiveAovImages[aovIndex], false);
+	}
+}
+void pragma::scenekit::TileManager::ApplyRectData(const TileData &tile, const std::vector<uint8_t> &data, uimg::ImageBuffer &dstImage, bool clearAlpha)
+{
+	// Tiles that haven't been initialized yet still have to be flipped and need their alpha channel cleared,
+	// which is done in the same pass as the copy
+	auto isRaw = !umath::is_flag_set(tile.flags, TileData::Flags::Initialized);
+	auto rect = GetDestinationRect(tile);
+	auto imgWidth = dstImage.GetWidth();
+	auto dstOffset = (static_cast<uint64_t>(rect.y) * imgWidth + rect.x) * 4;
+	if(m_storagePrecision == StoragePrecision::Half) {
+		auto *srcData = reinterpret_cast<const uint16_t *>(data.data());
+		auto *dstData = static_cast<uint16_t *>(dstImage.GetData()) + dstOffset;
+		tile_kernels::blit_tile_rgba16f(srcData, tile.w, tile.h, dstData, imgWidth, isRaw && m_flipHorizontally, isRaw && m_flipVertically, isRaw && clearAlpha);
+		return;
 	}
+	auto *srcData = reinterpret_cast<const float *>(data.data());
+	auto *dstData = static_cast<float *>(dstImage.GetData()) + dstOffset;
+	tile_kernels::blit_tile_rgba32f(srcData, tile.w, tile.h, dstData, imgWidth, isRaw && m_flipHorizontally, isRaw && m_flipVertically, isRaw && clearAlpha);
+}
+const pragma::scenekit::TileManager::AovInfo *pragma::scenekit::TileManager::FindAovInfo(PassType type, uint32_t *optOutIndex) const
+{
+	auto it = std::find_if(m_aovs.begin(), m_aovs.end(), [type](const AovInfo &aov) { return aov.type == type; });
+	if(it == m_aovs.end())
+		return nullptr;
+	if(optOutIndex)
+		*optOutIndex = static_cast<uint32_t>(it - m_aovs.begin());
+	return &*it;
+}
+std::shared_ptr<uimg::ImageBuffer> pragma::scenekit::TileManager::GetProgressiveAovImage(PassType type) const
+{
+	uint32_t aovIndex;
+	return FindAovInfo(type, &aovIndex) ? m_progressiveAovImages[aovIndex] : nullptr;
 }
 std::vector<pragma::scenekit::TileManager::TileData> pragma::scenekit::TileManager::GetRenderedTileBatch()
 {
 	m_renderedTileMutex.lock();
-	auto tiles = std::move(m_renderedTiles);
+	std::vector<TileData> tiles {std::make_move_iterator(m_renderedTiles.begin()), std::make_move_iterator(m_renderedTiles.end())};
 	m_renderedTiles.clear();
+	m_renderedTileSequenceBase = 0;
+	std::fill(m_renderedTileSlots.begin(), m_renderedTileSlots.end(), NO_RENDERED_TILE_SLOT);
+	m_renderedTileBytes = 0;
 	m_renderedTileMutex.unlock();
+	m_renderedTileCondition.notify_all();
+
+	auto t = std::chrono::steady_clock::now();
+	for(auto &tile : tiles)
+		RecordLatency(tile, t);
+	m_statistics.Increment(TileStatistics::Counter::TilesDelivered, tiles.size());
 	return tiles;
 }
 
+void pragma::scenekit::TileManager::RecordLatency(const TileData &tile, std::chrono::steady_clock::time_point t)
+{
+	if(tile.readyTime != std::chrono::steady_clock::time_point {})
+		m_statistics.Record(TileStatistics::Stage::AwaitingConsumer, t - tile.readyTime);
+	if(tile.arrivalTime != std::chrono::steady_clock::time_point {})
+		m_statistics.Record(TileStatistics::Stage::Total, t - tile.arrivalTime);
+}
+pragma::scenekit::TileManager::LatencyInfo pragma::scenekit::TileManager::GetLatencyInfo() const
+{
+	auto &histogram = m_statistics.GetHistogram(TileStatistics::Stage::Total);
+	LatencyInfo info {};
+	info.tileCount = histogram.GetCount();
+	info.total = histogram.GetTotal();
+	info.max = histogram.GetMax();
+	return info;
+}
+void pragma::scenekit::TileManager::ResetLatencyInfo() { m_statistics.Reset(); }
+std::string pragma::scenekit::TileManager::GetStatisticsJson() const
+{
+	static constexpr std::array<std::string_view, PRIORITY_LEVEL_COUNT> queueGaugeNames {"input_queue_depth_p0", "input_queue_depth_p1", "input_queue_depth_p2", "input_queue_depth_p3"};
+	std::vector<TileStatistics::Gauge> gauges;
+	uint64_t inputQueueDepth = 0;
+	for(size_t i = 0; i < m_inputTileQueues.size(); ++i) {
+		auto depth = m_inputTileQueues[i].GetSize();
+		gauges.push_back({queueGaugeNames[i], depth});
+		inputQueueDepth += depth;
+	}
+	gauges.push_back({"input_queue_depth", inputQueueDepth});
+	auto backlogInfo = GetBacklogInfo();
+	gauges.push_back({"rendered_backlog_tiles", backlogInfo.tileCount});
+	gauges.push_back({"rendered_backlog_bytes", backlogInfo.byteSize});
+	gauges.push_back({"rendered_backlog_coalesced_tiles", backlogInfo.coalescedTileCount});
+	gauges.push_back({"rendered_backlog_dropped_tiles", backlogInfo.droppedTileCount});
+	gauges.push_back({"pooled_tile_buffers", m_tileBufferPool.GetPooledBufferCount()});
+	gauges.push_back({"worker_count", GetWorkerCount()});
+	return m_statistics.ToJson(gauges);
+}
+
 void pragma::scenekit::TileManager::AddRenderedTile(TileData &&tile)
 {
-	m_renderedTileMutex.lock();
+	std::unique_lock<std::mutex> lock {m_renderedTileMutex};
 	m_numTilesWithRenderedSamples = GetTileCount();
 	; // TODO: This is wrong and will only work if tile count is 1!
-	m_renderedTiles.push_back(std::move(tile));
-	m_renderedTileMutex.unlock();
+	PushRenderedTile(std::move(tile), lock);
+}
+
+pragma::scenekit::TileManager::BacklogInfo pragma::scenekit::TileManager::GetBacklogInfo() const
+{
+	BacklogInfo info {};
+	{
+		std::scoped_lock lock {m_renderedTileMutex};
+		info.tileCount = m_renderedTiles.size();
+		info.byteSize = m_renderedTileBytes;
+	}
+	info.coalescedTileCount = m_coalescedRenderedTileCount;
+	info.droppedTileCount = m_droppedRenderedTileCount;
+	return info;
 }
 
 void pragma::scenekit::TileManager::SetFlipImage(bool flipHorizontally, bool flipVertically)
 {
 	m_flipHorizontally = flipHorizontally;
 	m_flipVertically = flipVertically;
+	UpdateTilePriorities();
+}
+
+void pragma::scenekit::TileManager::SetTileOrder(TileOrder order, const Vector2 &focusPoint)
+{
+	{
+		std::scoped_lock lock {m_tileOrderMutex};
+		m_tileOrder = order;
+		m_focusPoint = focusPoint;
+	}
+	UpdateTilePriorities();
+}
+
+pragma::scenekit::TileManager::TileOrder pragma::scenekit::TileManager::GetTileOrder() const
+{
+	std::scoped_lock lock {m_tileOrderMutex};
+	return m_tileOrder;
+}
+
+std::vector<uint32_t> pragma::scenekit::TileManager::GetTileDispatchOrder() const
+{
+	std::scoped_lock lock {m_tileOrderMutex};
+	return m_tileDispatchOrder;
+}
+
+uint32_t pragma::scenekit::TileManager::GetTileRank(uint32_t tileIndex) const
+{
+	std::scoped_lock lock {m_tileOrderMutex};
+	return (tileIndex < m_tileRanks.size()) ? m_tileRanks[tileIndex] : std::numeric_limits<uint32_t>::max();
+}
+
+static uint32_t hilbert_curve_index(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for(auto s = n / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if(ry == 0) {
+			if(rx == 1) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+void pragma::scenekit::TileManager::UpdateTilePriorities()
+{
+	uint32_t numTilesX = m_numTilesPerAxis.x;
+	uint32_t numTilesY = m_numTilesPerAxis.y;
+	std::vector<uint32_t> order(m_numTiles);
+	for(auto i = decltype(m_numTiles) {0u}; i < m_numTiles; ++i)
+		order[i] = i;
+
+	TileOrder tileOrder;
+	Vector2 focusPoint;
+	{
+		std::scoped_lock lock {m_tileOrderMutex};
+		tileOrder = m_tileOrder;
+		focusPoint = m_focusPoint;
+	}
+	// Sort keys are evaluated in tile space of the renderer, so the focus point has to be un-flipped first
+	if(m_flipHorizontally)
+		focusPoint.x = 1.f - focusPoint.x;
+	if(m_flipVertically)
+		focusPoint.y = 1.f - focusPoint.y;
+	auto getTileCenter = [this, numTilesX](uint32_t tileIndex) -> Vector2 {
+		auto tx = tileIndex % numTilesX;
+		auto ty = tileIndex / numTilesX;
+		return {(tx + 0.5f) * m_tileSize.x, (ty + 0.5f) * m_tileSize.y};
+	};
+	auto sortByKey = [&order](const std::function<float(uint32_t)> &getKey) {
+		std::vector<float> keys(order.size());
+		for(auto i = decltype(order.size()) {0u}; i < order.size(); ++i)
+			keys[i] = getKey(i);
+		std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+	};
+	if(numTilesX > 0) {
+		switch(tileOrder) {
+		case TileOrder::Scanline:
+			break;
+		case TileOrder::Hilbert:
+			{
+				uint32_t n = 1;
+				while(n < std::max(numTilesX, numTilesY))
+					n <<= 1;
+				sortByKey([n, numTilesX](uint32_t tileIndex) -> float { return static_cast<float>(hilbert_curve_index(n, tileIndex % numTilesX, tileIndex / numTilesX)); });
+				break;
+			}
+		case TileOrder::CenterOutSpiral:
+			{
+				// Tiles are grouped in square rings around the center, each ring is traversed in clockwise order
+				Vector2 center {numTilesX * 0.5f, numTilesY * 0.5f};
+				sortByKey([numTilesX, center](uint32_t tileIndex) -> float {
+					auto dx = (tileIndex % numTilesX) + 0.5f - center.x;
+					auto dy = (tileIndex / numTilesX) + 0.5f - center.y;
+					auto ring = std::floor(std::max(std::abs(dx), std::abs(dy)));
+					auto angle = std::atan2(dy, dx) + std::numbers::pi_v<float>; // [0,2pi]
+					return ring * 8.f + angle;
+				});
+				break;
+			}
+		case TileOrder::FocusPointFirst:
+			{
+				Vector2 resolution {static_cast<float>(numTilesX * m_tileSize.x), static_cast<float>(numTilesY * m_tileSize.y)};
+				if(m_progressiveImage)
+					resolution = {static_cast<float>(m_progressiveImage->GetWidth()), static_cast<float>(m_progressiveImage->GetHeight())};
+				Vector2 focus {focusPoint.x * resolution.x, focusPoint.y * resolution.y};
+				sortByKey([&getTileCenter, focus](uint32_t tileIndex) -> float {
+					auto d = getTileCenter(tileIndex) - focus;
+					return d.x * d.x + d.y * d.y;
+				});
+				break;
+			}
+		}
+	}
+
+	std::vector<uint32_t> ranks(m_numTiles);
+	for(auto i = decltype(order.size()) {0u}; i < order.size(); ++i)
+		ranks[order[i]] = static_cast<uint32_t>(i);
+
+	std::scoped_lock lock {m_tileOrderMutex};
+	if(m_tilePriorityLevels.size() != m_numTiles)
+		m_tilePriorityLevels = std::vector<std::atomic<uint8_t>>(m_numTiles);
+	for(auto i = decltype(ranks.size()) {0u}; i < ranks.size(); ++i)
+		m_tilePriorityLevels[i] = static_cast<uint8_t>((static_cast<uint64_t>(ranks[i]) * PRIORITY_LEVEL_COUNT) / m_numTiles);
+	m_tileDispatchOrder = std::move(order);
+	m_tileRanks = std::move(ranks);
 }
 
 int32_t pragma::scenekit::TileManager::GetCurrentTileSampleCount(uint32_t tileIndex) const
@@ -264,18 +1047,46 @@ void pragma::scenekit::TileManager::InitializeTileData(TileData &data)
 	if(m_flipVertically)
 		data.y = m_progressiveImage->GetHeight() - data.y - data.h;
 
-	auto img = uimg::ImageBuffer::Create(data.data.data(), data.w, data.h, uimg::Format::RGBA_FLOAT);
-	img->Flip(m_flipHorizontally, m_flipVertically);
-	img->ClearAlpha(uimg::ImageBuffer::FULLY_OPAQUE);
+	// Flip and clear the alpha channel in a single pass
+	tile_kernels::transform_tile_rgba32f(reinterpret_cast<float *>(data.data.data()), data.w, data.h, m_flipHorizontally, m_flipVertically);
+	// The alpha channel of AOVs may contain actual data, so it's left untouched
+	for(auto &aov : data.aovs)
+		tile_kernels::transform_tile_rgba32f(reinterpret_cast<float *>(aov.data.data()), data.w, data.h, m_flipHorizontally, m_flipVertically, false);
 }
 
 void pragma::scenekit::TileManager::ApplyPostProcessingForProgressiveTile(TileData &data)
 {
+	auto applyColorTransform = [this, &data](std::vector<uint8_t> &pixels) {
+		auto img = uimg::ImageBuffer::Create(pixels.data(), data.w, data.h, data.IsFloatData() ? uimg::Format::RGBA_FLOAT : uimg::Format::RGBA_HDR);
+		std::string err;
+		auto result = m_colorTransformProcessor->Apply(*img, err);
+		if(result == false)
+			std::cout << "Unable to apply color transform: " << err << std::endl;
+	};
+	for(auto &aov : data.aovs) {
+		auto *aovInfo = FindAovInfo(aov.type);
+		if(!aovInfo)
+			continue;
+		switch(aovInfo->colorHandling) {
+		case AovColorHandling::ColorTransform:
+			if(m_colorTransformProcessor)
+				applyColorTransform(aov.data);
+			break;
+		case AovColorHandling::SignedToUnsigned:
+			{
+				auto *values = reinterpret_cast<float *>(aov.data.data());
+				auto numPixels = static_cast<size_t>(data.w) * data.h;
+				for(size_t i = 0; i < numPixels; ++i, values += 4) {
+					for(uint32_t c = 0; c < 3; ++c)
+						values[c] = values[c] * 0.5f + 0.5f;
+				}
+				break;
+			}
+		default:
+			break;
+		}
+	}
 	if(!m_colorTransformProcessor)
 		return;
-	auto img = uimg::ImageBuffer::Create(data.data.data(), data.w, data.h, data.IsFloatData() ? uimg::Format::RGBA_FLOAT : uimg::Format::RGBA_HDR);
-	std::string err;
-	auto result = m_colorTransformProcessor->Apply(*img, err);
-	if(result == false)
-		std::cout << "Unable to apply color transform: " << err << std::endl;
+	applyColorTransform(data.data);
 }
@@ -33,6 +33,7 @@ namespace util::ocio {
 };
 namespace oidn {
 	class DeviceRef;
+	class FilterRef;
 };
 
 namespace ccl {
@@ -9,24 +9,45 @@ module;
 
 #include "definitions.hpp"
 #include <util_image_types.hpp>
+#include <mathutil/uvec.h>
+#include <mathutil/umat.h>
 #include <cinttypes>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
 
 export module pragma.scenekit:denoise;
 
 export namespace pragma::scenekit::denoise {
 	struct DLLRTUTIL Info {
-		uint32_t numThreads = 16;
+		uint32_t numThreads = 16; // 0 = all cores. Limited by the core budget (see set_core_budget).
+		// Pins the denoiser threads to fixed cores. Should be disabled if denoising runs next to other work (e.g. rendering), since the pinned cores
+		// would collide with the threads of other jobs instead of leaving the placement to the OS scheduler.
+		bool setAffinity = true;
 		uint32_t width = 0;
 		uint32_t height = 0;
 		bool lightmap = false;
 		bool hdr = true;
+		// If non-zero, images larger than this will be denoised in overlapping tiles of this size, which bounds the scratch memory
+		// required by the denoiser by the tile size instead of the image size. Seams are blended across the overlap.
+		uint32_t tileSize = 0;
+		uint32_t tileOverlap = 32; // Clamped to half the tile size
+		uint32_t maxConcurrentTiles = 2; // The threads are split evenly between concurrent tiles
 	};
 
+	// Limits the total number of denoiser threads across all concurrent denoise calls of the process, 0 = unlimited (default).
+	// Denoise calls are clamped to the budget and wait until enough of it is available, so denoising can share a node with
+	// rendering without oversubscribing the cores.
+	DLLRTUTIL void set_core_budget(uint32_t numCores);
+	DLLRTUTIL uint32_t get_core_budget();
+
 	struct DLLRTUTIL ImageData {
 		uint8_t *data = nullptr;
 		uimg::Format format = uimg::Format::RGB32;
+		uint32_t rowStride = 0; // In bytes, 0 = tightly packed
 	};
 	struct DLLRTUTIL ImageInputs {
 		ImageData beautyImage;
@@ -34,13 +55,215 @@ export namespace pragma::scenekit::denoise {
 		ImageData normalImage;
 	};
 
+	// Creating an OIDN device and committing a filter is expensive compared to denoising small images, so both are cached and re-used.
+	// Filters are cached per configuration (filter type, dimensions, formats and auxiliary inputs). OIDN serializes all operations on the same
+	// device, so a new filter is preferably created on a device that isn't in use, and additional devices are only created for concurrent checkouts.
+	class DLLRTUTIL DenoiserCache {
+	  public:
+		struct Key {
+			// Device settings
+			uint32_t numThreads = 0;
+			bool setAffinity = true;
+
+			bool lightmap = false;
+			bool hdr = true;
+			uint32_t width = 0;
+			uint32_t height = 0;
+			uimg::Format beautyFormat = uimg::Format::RGB32;
+			uimg::Format outputFormat = uimg::Format::RGB32;
+			// Only relevant if the respective input is used
+			std::optional<uimg::Format> albedoFormat {};
+			std::optional<uimg::Format> normalFormat {};
+			bool operator==(const Key &other) const = default;
+		};
+		struct Entry;
+		// Exclusive access to a cached filter and its device. The filter is returned to the cache when the lease is destroyed.
+		class DLLRTUTIL Lease {
+		  public:
+			Lease() = default;
+			Lease(DenoiserCache &cache, std::unique_ptr<Entry> entry);
+			Lease(const Lease &) = delete;
+			Lease(Lease &&other);
+			Lease &operator=(const Lease &) = delete;
+			Lease &operator=(Lease &&other);
+			~Lease();
+			bool IsValid() const { return m_entry != nullptr; }
+			oidn::DeviceRef &GetDevice();
+			oidn::FilterRef &GetFilter();
+			void Release();
+		  private:
+			DenoiserCache *m_cache = nullptr;
+			std::unique_ptr<Entry> m_entry = nullptr;
+		};
+		struct Statistics {
+			uint64_t filterHits = 0;   // Checkouts that were served by a cached filter
+			uint64_t filterMisses = 0; // Checkouts that required a new filter
+			uint64_t devicesCreated = 0;
+		};
+		// Process-wide cache
+		static DenoiserCache &Get();
+
+		DenoiserCache();
+		~DenoiserCache();
+		// Thread-safe. Returns an invalid lease if no device could be created.
+		Lease Acquire(const Key &key);
+		// Maximum number of idle filters (and devices) that are kept alive
+		void SetMaxIdleFilterCount(size_t count);
+		void Clear();
+		Statistics GetStatistics() const;
+	  private:
+		struct DeviceInfo {
+			std::shared_ptr<oidn::DeviceRef> device = nullptr;
+			uint32_t numThreads = 0;
+			bool setAffinity = true;
+			uint32_t leaseCount = 0;
+		};
+		void Release(std::unique_ptr<Entry> entry);
+		void EvictExcessEntries();
+		DeviceInfo *FindDeviceInfo(const oidn::DeviceRef &device);
+
+		mutable std::mutex m_mutex;
+		std::vector<std::unique_ptr<Entry>> m_idleEntries; // Least recently used first
+		std::vector<DeviceInfo> m_devices;
+		size_t m_maxIdleFilterCount = 8;
+		Statistics m_statistics {};
+	};
+
 	class DLLRTUTIL Denoiser {
 	  public:
+		// Uses the process-wide denoiser cache
 		Denoiser();
+		Denoiser(DenoiserCache &cache);
 		bool Denoise(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback = nullptr);
 	  private:
-		std::shared_ptr<oidn::DeviceRef> m_device = nullptr;
+		bool DenoiseTiled(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback);
+		DenoiserCache *m_cache = nullptr;
 	};
 	DLLRTUTIL bool denoise(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback = nullptr);
 	DLLRTUTIL bool denoise(const Info &denoise, uimg::ImageBuffer &imgBuffer, uimg::ImageBuffer *optImgBufferAlbedo = nullptr, uimg::ImageBuffer *optImgBufferNormal = nullptr, const std::function<bool(float)> &fProgressCallback = nullptr);
+
+	struct DLLRTUTIL BatchItem {
+		Info info;
+		ImageInputs inputImages;
+		ImageData outputImage;
+	};
+	// Creates a batch item that denoises imgBuffer in-place
+	DLLRTUTIL BatchItem make_batch_item(const Info &denoise, uimg::ImageBuffer &imgBuffer, uimg::ImageBuffer *optImgBufferAlbedo = nullptr, uimg::ImageBuffer *optImgBufferNormal = nullptr);
+	// Denoises several independent images concurrently, at most maxConcurrentItems at a time. numThreads (0 = all cores) is split evenly between the
+	// concurrent images and overrides their Info::numThreads, the core budget still applies. The progress callback receives the combined progress and
+	// may be called from any of the threads. Returns false if any of the images could not be denoised, or if the callback has cancelled the batch.
+	DLLRTUTIL bool denoise_batch(const std::vector<BatchItem> &items, uint32_t numThreads = 0, const std::function<bool(float)> &fProgressCallback = nullptr, uint32_t maxConcurrentItems = 4);
+
+	// Handle to a denoise job that runs on its own thread. Copies of the handle refer to the same job.
+	// The image data has to stay valid until the job has completed. Destroying the last handle of a running job blocks until it has
+	// finished, so it should be cancelled first if the result is no longer needed.
+	class DLLRTUTIL DenoiseJob {
+	  public:
+		// Runs fDenoise on a new thread. fDenoise receives a progress callback that has to be passed on to the denoiser, which
+		// updates the job progress and aborts the denoiser if the job has been cancelled or fProgressCallback returned false.
+		static DenoiseJob Start(std::function<bool(const std::function<bool(float)> &)> fDenoise, std::function<bool(float)> fProgressCallback = nullptr);
+
+		DenoiseJob() = default;
+		bool IsValid() const { return m_state != nullptr; }
+		bool IsComplete() const;
+		float GetProgress() const;
+		// Thread-safe. The job will stop at the next progress update of the denoiser, the image may be left partially denoised.
+		void Cancel();
+		bool IsCancelled() const;
+		// Blocks until the job has finished. Returns false if the job is invalid, denoising failed or the job was cancelled.
+		bool Wait() const;
+		const std::shared_future<bool> &GetFuture() const { return m_future; }
+	  private:
+		struct State;
+		std::shared_ptr<State> m_state = nullptr;
+		std::shared_future<bool> m_future {};
+	};
+	// Asynchronous variants of denoise and denoise_batch. fProgressCallback is called from the job's thread(s).
+	DLLRTUTIL DenoiseJob denoise_async(const Info &denoise, const ImageInputs &inputImages, const ImageData &outputImage, std::function<bool(float)> fProgressCallback = nullptr);
+	DLLRTUTIL DenoiseJob denoise_batch_async(std::vector<BatchItem> items, uint32_t numThreads = 0, std::function<bool(float)> fProgressCallback = nullptr, uint32_t maxConcurrentItems = 4);
+
+	// Denoises the frames of an animation sequence with temporal stability: Every frame is denoised spatially first, and then blended with the
+	// reprojected output of the previous frame. History is rejected where the depth doesn't match (disocclusions) and clamped to the color range of
+	// the surrounding pixels of the current frame, which keeps ghosting in check. Frames have to be passed in order; the denoiser keeps the history
+	// of the last frame, so one instance is required per sequence (or per stereo eye).
+	class DLLRTUTIL TemporalDenoiser {
+	  public:
+		struct Settings {
+			// Minimum weight of the current frame. The weight starts at 1 for pixels without history and decreases with the number of accumulated frames
+			// until it reaches this value; lower values are more stable over time but respond slower to changes.
+			float blendFactor = 0.1f;
+			// History is rejected if the depth of the reprojected pixel differs by more than this fraction from the current depth
+			float depthTolerance = 0.05f;
+			// Clamps the history to the color range of the 3x3 neighborhood of the current (spatially denoised) frame
+			bool neighborhoodClamp = true;
+		};
+		struct FrameInputs {
+			ImageInputs images; // Noisy frame and optional auxiliary images, see Denoiser::Denoise
+			// Offset in pixels from every pixel to its position in the previous frame in the first two channels (e.g. from compute_camera_motion_vectors).
+			// Optional, no motion is assumed if not specified. Has to be a float format with at least two channels.
+			ImageData motionImage {nullptr, uimg::Format::RGBA32};
+			// Linear depth in the first channel. Optional, history is only rejected through the neighborhood clamp if not specified.
+			ImageData depthImage {nullptr, uimg::Format::RGBA32};
+		};
+
+		TemporalDenoiser(const Settings &settings = {});
+		// Denoises the next frame of the sequence into outputImage (only the RGB channels are written). The dimensions are taken from denoise;
+		// if they differ from the previous frame, the history is discarded.
+		bool Denoise(const Info &denoise, const FrameInputs &inputs, const ImageData &outputImage, const std::function<bool(float)> &fProgressCallback = nullptr);
+		// Discards the history, e.g. on camera cuts
+		void Reset();
+		const Settings &GetSettings() const { return m_settings; }
+		void SetSettings(const Settings &settings) { m_settings = settings; }
+	  private:
+		Settings m_settings;
+		Denoiser m_denoiser;
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		std::vector<float> m_current;       // Spatially denoised frame, packed RGB
+		std::vector<float> m_history;       // Output of the previous frame, packed RGB
+		std::vector<float> m_historyDepth;  // Empty if the previous frame had no depth
+		std::vector<float> m_historyLength; // Number of frames accumulated in every history pixel
+		std::vector<float> m_nextHistory;
+		std::vector<float> m_nextHistoryLength;
+	};
+	// Computes the screen-space motion of a static scene caused by camera movement, from the world-space positions of the current frame
+	// (e.g. the Position pass) and the view-projection matrix of the previous frame. Writes the offsets in pixels to the first two channels
+	// of outMotionImage, which has to be a float format with at least two channels. Pixels that were behind the previous camera receive an offset
+	// that points outside of the image.
+	DLLRTUTIL void compute_camera_motion_vectors(const ImageData &positionImage, uint32_t width, uint32_t height, const Mat4 &prevViewProjection, const ImageData &outMotionImage);
+
+	// Assignment of lightmap texels to UV charts (islands)
+	struct DLLRTUTIL ChartMask {
+		static constexpr uint32_t NO_CHART = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<uint32_t> chartIds; // Row-major, top row first. Charts are numbered from 1, NO_CHART for texels that aren't covered by any chart.
+		uint32_t chartCount = 0;
+	};
+	// Rasterizes the triangles of a mesh with per-vertex lightmap UVs into a chart mask. Triangles are part of the same chart if they share a vertex,
+	// or vertices with the same UV coordinates. A texel belongs to a chart if its center is covered by one of the chart's triangles.
+	// If flipV is set, v = 0 maps to the bottom row of the image.
+	DLLRTUTIL ChartMask generate_chart_mask(const std::vector<Vector2> &lightmapUvs, const std::vector<int> &triangles, uint32_t width, uint32_t height, bool flipV = false);
+
+	enum class ChartMode : uint8_t {
+		// Every chart is denoised on its own, with the surrounding texels filled in from the chart itself. No light can bleed between charts,
+		// at the cost of one denoiser invocation per chart.
+		PerChart = 0,
+		// The whole atlas is denoised at once, after the empty texels around the charts have been filled in from the nearest chart.
+		// Avoids the dark fringes caused by empty padding, but charts that are directly adjacent can still bleed into each other.
+		Masked
+	};
+	struct DLLRTUTIL ChartDenoiseInfo {
+		ChartMode mode = ChartMode::PerChart;
+		// Number of dilation steps used to fill the texels around a chart before denoising
+		uint32_t isolationMargin = 8;
+		// Number of dilation steps applied to the empty texels of the output after denoising, so bilinear lookups at chart borders don't pick up empty texels
+		uint32_t dilation = 2;
+		// Number of charts that are denoised concurrently in PerChart mode
+		uint32_t maxConcurrentCharts = 4;
+	};
+	// Denoises a lightmap atlas (lightmap mode, auxiliary inputs aren't used) according to a chart mask with the dimensions of the image.
+	// Only the texels covered by charts and the dilated texels are written to outputImage, which may be the same as the input image.
+	DLLRTUTIL bool denoise_lightmap_charts(const Info &denoise, const ImageData &inputImage, const ImageData &outputImage, const ChartMask &chartMask, const ChartDenoiseInfo &chartInfo = {},
+	  const std::function<bool(float)> &fProgressCallback = nullptr);
 };
@@ -0,0 +1,113 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <cinttypes>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <new>
+
+export module pragma.scenekit:mpmc_queue;
+
+export namespace pragma::scenekit {
+	// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's design).
+	// Values are moved in and out of the queue, so ownership of heap data (e.g. pixel buffers) is handed over without copying.
+	template<typename T>
+	class MpmcQueue {
+	  public:
+		MpmcQueue() = default;
+		MpmcQueue(size_t capacity) { Resize(capacity); }
+		MpmcQueue(const MpmcQueue &) = delete;
+		MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+		// Not thread-safe, all items will be discarded. The capacity will be rounded up to the next power of two.
+		void Resize(size_t capacity)
+		{
+			size_t size = 2;
+			while(size < capacity)
+				size <<= 1;
+			m_cells = std::make_unique<Cell[]>(size);
+			for(size_t i = 0; i < size; ++i)
+				m_cells[i].sequence.store(i, std::memory_order_relaxed);
+			m_mask = size - 1;
+			m_enqueuePos.store(0, std::memory_order_relaxed);
+			m_dequeuePos.store(0, std::memory_order_relaxed);
+		}
+		size_t GetCapacity() const { return m_cells ? (m_mask + 1) : 0; }
+
+		// Returns false if the queue is full, in which case the value is left untouched
+		bool TryPush(T &&value)
+		{
+			if(!m_cells)
+				return false;
+			Cell *cell;
+			auto pos = m_enqueuePos.load(std::memory_order_relaxed);
+			for(;;) {
+				cell = &m_cells[pos & m_mask];
+				auto seq = cell->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				if(diff == 0) {
+					if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if(diff < 0)
+					return false; // Full
+				else
+					pos = m_enqueuePos.load(std::memory_order_relaxed);
+			}
+			cell->data = std::move(value);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Returns false if the queue is empty
+		bool TryPop(T &outValue)
+		{
+			if(!m_cells)
+				return false;
+			Cell *cell;
+			auto pos = m_dequeuePos.load(std::memory_order_relaxed);
+			for(;;) {
+				cell = &m_cells[pos & m_mask];
+				auto seq = cell->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+				if(diff == 0) {
+					if(m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if(diff < 0)
+					return false; // Empty
+				else
+					pos = m_dequeuePos.load(std::memory_order_relaxed);
+			}
+			outValue = std::move(cell->data);
+			cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Approximations only, the values may already be outdated by the time they are returned
+		size_t GetSize() const
+		{
+			auto dequeuePos = m_dequeuePos.load(std::memory_order_acquire);
+			auto enqueuePos = m_enqueuePos.load(std::memory_order_acquire);
+			return (enqueuePos > dequeuePos) ? (enqueuePos - dequeuePos) : 0;
+		}
+		bool IsEmpty() const { return GetSize() == 0; }
+	  private:
+		struct Cell {
+			std::atomic<size_t> sequence {0};
+			T data {};
+		};
+		static constexpr size_t CACHE_LINE_SIZE = 64;
+		std::unique_ptr<Cell[]> m_cells = nullptr;
+		size_t m_mask = 0;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueuePos = 0;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeuePos = 0;
+	};
+};
@@ -0,0 +1,100 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <util_image_types.hpp>
+#include <cinttypes>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+export module pragma.scenekit:progressive_denoiser;
+
+import :renderer;
+import :tile_manager;
+
+export namespace pragma::scenekit {
+	// Periodically denoises the partially converged frame of a TileManager on a background thread, so interactive viewers can display
+	// a denoised preview while rendering is still in progress. The input is assembled from the completed tiles (and their albedo and normal AOV planes),
+	// the result is published as a separate image and never touches the progressive image of the tile manager.
+	class DLLRTUTIL ProgressiveDenoiser {
+	  public:
+		struct Settings {
+			// Time between the start of two denoise passes. The tile manager is polled for changed tiles at this interval, passes are skipped if nothing has changed.
+			std::chrono::milliseconds interval {500};
+			// AOVs used as auxiliary denoiser inputs. They're only used if the tile manager carries them (see TileManager::Settings::aovs).
+			std::optional<PassType> albedoPass = PassType::Albedo;
+			std::optional<PassType> normalPass = PassType::Normals;
+			// If enabled, only the bounding region of the tiles that have changed since the last pass is denoised (extended by dirtyRegionMargin
+			// on every side so the denoiser has enough context at the borders), otherwise the full frame is denoised every pass.
+			bool dirtyRegionsOnly = true;
+			uint32_t dirtyRegionMargin = 32;
+			// The tile manager's color transform is applied to the published image
+			bool applyColorTransform = true;
+			uint32_t numThreads = 0; // 0 = all cores, limited by the denoiser core budget (see denoise::set_core_budget)
+		};
+		struct Result {
+			std::shared_ptr<uimg::ImageBuffer> image = nullptr;
+			uint64_t revision = 0; // 0 = nothing has been published yet
+			TileManager::TileRect rect {}; // Region that has changed since the revision passed to GetResult
+		};
+
+		ProgressiveDenoiser(TileManager &tileManager, const Settings &settings = {});
+		~ProgressiveDenoiser();
+		// The tile manager has to be initialized before the denoiser is started, and must outlive it
+		void Start();
+		// Stops the background thread, aborting the current pass
+		void Stop();
+		bool IsRunning() const { return m_running; }
+		// Forces the next pass to start from scratch, e.g. after rendering has been restarted
+		void Reset();
+
+		// Thread-safe. The returned image is never modified after it has been published. The rect of the result is the union of the regions
+		// that have changed in all revisions after sinceRevision (i.e. the revision the viewer currently displays), or the full image if sinceRevision is 0,
+		// too old to be tracked, or the image has been re-created (e.g. because the resolution has changed) since then.
+		Result GetResult(uint64_t sinceRevision = 0) const;
+		uint64_t GetRevision() const { return m_revision; }
+		// Duration of the last denoise pass
+		std::chrono::nanoseconds GetLastPassDuration() const { return std::chrono::nanoseconds {m_lastPassDuration.load()}; }
+	  private:
+		void Run();
+		bool InitializeImages();
+		// Returns false if nothing has changed since the last pass, or the pass has been aborted
+		bool DenoisePass();
+		void Publish(const TileManager::TileRect &rect);
+
+		TileManager &m_tileManager;
+		Settings m_settings;
+		std::thread m_thread;
+		std::atomic<bool> m_running = false;
+		std::atomic<bool> m_resetRequested = false;
+		std::mutex m_wakeMutex;
+		std::condition_variable m_wakeCondition;
+
+		// Only accessed by the background thread
+		std::shared_ptr<uimg::ImageBuffer> m_inputImage = nullptr;
+		std::shared_ptr<uimg::ImageBuffer> m_albedoImage = nullptr;
+		std::shared_ptr<uimg::ImageBuffer> m_normalImage = nullptr;
+		std::shared_ptr<uimg::ImageBuffer> m_denoisedImage = nullptr;
+		std::vector<uint32_t> m_tileRevisions;
+
+		mutable std::mutex m_resultMutex;
+		Result m_result {};
+		// Changed region of the most recent revisions, oldest first
+		std::deque<std::pair<uint64_t, TileManager::TileRect>> m_changedRects;
+		std::atomic<uint64_t> m_revision = 0;
+		std::atomic<int64_t> m_lastPassDuration = 0;
+	};
+};
@@ -10,6 +10,8 @@ module;
 #include "definitions.hpp"
 #include <functional>
 #include <condition_variable>
+#include <mutex>
+#include <vector>
 #include <util_image.hpp>
 #include <sharedutils/util_parallel_job.hpp>
 #include <sharedutils/util.h>
@@ -20,6 +22,7 @@ module;
 export module pragma.scenekit:renderer;
 
 import :tile_manager;
+import :denoise;
 
 export namespace pragma::scenekit {
 	DLLRTUTIL void set_log_handler(const std::function<void(const std::string)> &logHandler = nullptr);
@@ -143,9 +146,15 @@ export namespace pragma::scenekit {
 		TileManager &GetTileManager() { return m_tileManager; }
 		const TileManager &GetTileManager() const { return const_cast<Renderer *>(this)->GetTileManager(); }
 		std::vector<pragma::scenekit::TileManager::TileData> GetRenderedTileBatch();
+		void ReleaseTileBatch(std::vector<pragma::scenekit::TileManager::TileData> &&tiles);
 		void AddActorToActorMap(WorldObject &obj);
 
 		const std::unordered_map<PassType, std::array<std::shared_ptr<uimg::ImageBuffer>, umath::to_integral(StereoEye::Count)>> &GetResultImageBuffers() const { return m_resultImageBuffers; }
+
+		// If set, lightmap bakes are denoised per UV chart of the bake target (see denoise::denoise_lightmap_charts) instead of as a single image.
+		// flipV has to match the orientation of the baked image (see denoise::generate_chart_mask).
+		void SetLightmapChartDenoising(const std::optional<denoise::ChartDenoiseInfo> &chartInfo, bool flipV = false);
+		const std::optional<denoise::ChartDenoiseInfo> &GetLightmapChartDenoising() const { return m_lightmapChartDenoiseInfo; }
 	  protected:
 		Renderer(const Scene &scene, Flags flags);
 		bool Initialize();
@@ -182,6 +191,15 @@ export namespace pragma::scenekit {
 		std::pair<uint32_t, PassType> AddPass(PassType passType);
 		void DumpImage(const std::string &renderStage, uimg::ImageBuffer &imgBuffer, uimg::ImageFormat format = uimg::ImageFormat::HDR, const std::optional<std::string> &fileName = {}) const;
 		bool ShouldDumpRenderStageImages() const;
+		// Denoises the images asynchronously, so denoising can overlap with rendering and post-processing of other images. Does nothing if the worker has been cancelled.
+		// auxImages are the auxiliary images (albedo, normals) read by the items. Lightmap items are denoised per chart if a chart mask is specified
+		void StartDenoiseJobs(RenderWorker &worker, const std::vector<denoise::BatchItem> &items, const std::vector<std::shared_ptr<uimg::ImageBuffer>> &images, const std::vector<std::shared_ptr<uimg::ImageBuffer>> &auxImages,
+		  bool dumpImages, const std::shared_ptr<const denoise::ChartMask> &chartMask = nullptr);
+		// Returns nullptr if chart denoising is disabled, or the bake target has no lightmap uvs
+		std::shared_ptr<const denoise::ChartMask> CreateLightmapChartMask(uint32_t width, uint32_t height) const;
+		// Waits for the pending denoise jobs that write or read the specified image, or all pending jobs if imgBuf is nullptr
+		void WaitForDenoiseJobs(const uimg::ImageBuffer *imgBuf = nullptr);
+		void CancelDenoiseJobs();
 
 		std::shared_ptr<Scene> m_scene = nullptr;
 		std::atomic<Flags> m_flags = Flags::None;
@@ -205,6 +223,20 @@ export namespace pragma::scenekit {
 
 		std::unordered_map<PassType, uint32_t> m_passes {};
 		uint32_t m_nextOutputIndex = 0;
+
+		struct PendingDenoiseJob {
+			std::shared_ptr<uimg::ImageBuffer> image;
+			std::vector<std::shared_ptr<uimg::ImageBuffer>> auxImages; // Read by the job
+			denoise::DenoiseJob job;
+			bool dump = false;
+		};
+		// Read by the running jobs, so it's declared before them
+		std::atomic<bool> m_denoiseJobsCancelled = false;
+		// Declared after the result image buffers, so the jobs are finished before the images are released
+		std::vector<PendingDenoiseJob> m_denoiseJobs;
+		std::mutex m_denoiseJobMutex;
+		std::optional<denoise::ChartDenoiseInfo> m_lightmapChartDenoiseInfo {};
+		bool m_lightmapChartMaskFlipV = false;
 	};
 };
 export
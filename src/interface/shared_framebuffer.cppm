@@ -0,0 +1,101 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <cinttypes>
+#include <cstddef>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <string>
+
+export module pragma.scenekit:shared_framebuffer;
+
+export namespace pragma::scenekit {
+	// Memory-mapped RGBA float framebuffer that can be read by other processes without copies or locks.
+	// Layout of the mapping:
+	// - Header at offset 0
+	// - TileHeader array (one per tile, row-major) at Header::tileHeaderOffset
+	// - Pixel data (width * height RGBA float pixels, row-major, top row first) at Header::pixelDataOffset
+	// Every tile is protected by a seqlock: Writers make TileHeader::sequence odd while writing the tile's pixels, and even again
+	// once they're done. Readers have to retry if the sequence was odd, or has changed while they were reading.
+	class DLLRTUTIL SharedFramebuffer {
+	  public:
+		static constexpr uint32_t MAGIC = 0x4246'5255; // "URFB"
+		static constexpr uint32_t VERSION = 1;
+		static constexpr uint32_t NO_SAMPLE = std::numeric_limits<uint32_t>::max();
+		enum class Backing : uint8_t {
+			SharedMemory = 0, // POSIX shared memory object / named file mapping on Windows
+			File              // Memory-mapped file, the name is the file path
+		};
+		struct CreateInfo {
+			std::string name;
+			Backing backing = Backing::SharedMemory;
+		};
+		struct Header {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t width;
+			uint32_t height;
+			uint32_t tileWidth;
+			uint32_t tileHeight;
+			uint32_t tileCountX;
+			uint32_t tileCountY;
+			uint64_t tileHeaderOffset;
+			uint64_t pixelDataOffset;
+			std::atomic<uint32_t> frameIndex; // Incremented whenever rendering is restarted
+			uint32_t reserved;
+		};
+		struct TileHeader {
+			std::atomic<uint32_t> sequence;
+			uint32_t frameIndex; // Frame the tile data belongs to
+			uint32_t sample;     // NO_SAMPLE if the tile hasn't been written yet
+			uint16_t x;
+			uint16_t y;
+			uint16_t w;
+			uint16_t h;
+			uint32_t reserved;
+		};
+		static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+		// Only supported on Linux and Windows, fails with an error on other platforms
+		static std::unique_ptr<SharedFramebuffer> Create(const CreateInfo &createInfo, uint32_t width, uint32_t height, uint32_t tileWidth, uint32_t tileHeight, std::string &outErr);
+		// Opens an existing framebuffer for reading
+		static std::unique_ptr<SharedFramebuffer> Open(const CreateInfo &createInfo, std::string &outErr);
+		~SharedFramebuffer();
+
+		// Copies RGBA float (or RGBA half, if isHalfData is true) tile data into the framebuffer.
+		// Tiles with an older sample than the one already in the framebuffer are ignored.
+		void WriteTile(uint32_t tileIndex, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t sample, const void *data, bool isHalfData);
+		// Copies the pixels of a tile into outData (at least tileWidth * tileHeight RGBA float pixels), returns false if the tile hasn't been written yet in the current frame,
+		// or if no consistent copy could be made after a bounded number of attempts (e.g. because the writer died while holding the tile)
+		bool ReadTile(uint32_t tileIndex, TileHeader &outTileHeader, float *outData) const;
+		void BeginFrame();
+
+		const Header &GetHeader() const { return *m_header; }
+		const std::string &GetName() const { return m_createInfo.name; }
+	  private:
+		SharedFramebuffer() = default;
+		bool Map(size_t size, bool create, std::string &outErr);
+		TileHeader &GetTileHeader(uint32_t tileIndex) const;
+		float *GetPixelData() const;
+
+		CreateInfo m_createInfo {};
+		bool m_owner = false;
+		void *m_mapping = nullptr;
+		size_t m_mappingSize = 0;
+		Header *m_header = nullptr;
+#ifdef __linux__
+		int m_fd = -1;
+#elif defined(_WIN32)
+		void *m_fileHandle = nullptr;
+		void *m_mappingHandle = nullptr;
+#endif
+	};
+};
@@ -0,0 +1,51 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <util_image_types.hpp>
+#include <cinttypes>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+export module pragma.scenekit:tile_buffer_pool;
+
+export namespace pragma::scenekit {
+	// Recycles tile pixel buffers of identical dimensions and format to avoid repeated heap allocations during progressive rendering
+	class DLLRTUTIL TileBufferPool {
+	  public:
+		static constexpr uint32_t DEFAULT_MAX_BUFFERS_PER_KEY = 1'024;
+		struct Statistics {
+			uint64_t hits = 0;      // Acquired buffers that were recycled
+			uint64_t misses = 0;    // Acquired buffers that had to be allocated
+			uint64_t released = 0;  // Buffers that were returned to the pool
+			uint64_t discarded = 0; // Returned buffers that were freed because they didn't match their key or the pool was full
+		};
+		std::vector<uint8_t> Acquire(uint32_t w, uint32_t h, uimg::Format format);
+		void Release(std::vector<uint8_t> &&buffer, uint32_t w, uint32_t h, uimg::Format format);
+		void Clear();
+
+		void SetMaxBuffersPerKey(uint32_t maxBuffers);
+		Statistics GetStatistics() const;
+		void ResetStatistics();
+		size_t GetPooledBufferCount() const;
+	  private:
+		static uint64_t GetKey(uint32_t w, uint32_t h, uimg::Format format);
+		static size_t GetBufferSize(uint32_t w, uint32_t h, uimg::Format format);
+		mutable std::mutex m_mutex;
+		std::unordered_map<uint64_t, std::vector<std::vector<uint8_t>>> m_buffers;
+		uint32_t m_maxBuffersPerKey = DEFAULT_MAX_BUFFERS_PER_KEY;
+
+		std::atomic<uint64_t> m_hits = 0;
+		std::atomic<uint64_t> m_misses = 0;
+		std::atomic<uint64_t> m_released = 0;
+		std::atomic<uint64_t> m_discarded = 0;
+	};
+};
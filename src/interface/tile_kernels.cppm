@@ -0,0 +1,51 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <cinttypes>
+#include <cstddef>
+
+export module pragma.scenekit:tile_kernels;
+
+export namespace pragma::scenekit::tile_kernels {
+	// Copies a tightly packed RGBA float tile into a rectangle of a destination image, flipping it and forcing the alpha channel to 1 in the same pass.
+	// dst has to point to the top-left pixel of the destination rectangle, dstRowPixelCount is the width of the destination image.
+	DLLRTUTIL void blit_tile_rgba32f(const float *src, uint32_t w, uint32_t h, float *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha = true);
+	// In-place variant of blit_tile_rgba32f for tightly packed RGBA float tiles
+	DLLRTUTIL void transform_tile_rgba32f(float *data, uint32_t w, uint32_t h, bool flipHorizontally, bool flipVertically, bool clearAlpha = true);
+
+	// Half precision (IEEE 754 binary16) variants of the above
+	DLLRTUTIL void blit_tile_rgba16f(const uint16_t *src, uint32_t w, uint32_t h, uint16_t *dst, uint32_t dstRowPixelCount, bool flipHorizontally, bool flipVertically, bool clearAlpha = true);
+	DLLRTUTIL void transform_tile_rgba16f(uint16_t *data, uint32_t w, uint32_t h, bool flipHorizontally, bool flipVertically, bool clearAlpha = true);
+
+	// Updates the rectangle [x, y, w, h] of a mip level from the next larger level (src, srcW x srcH pixels) with a 2x2 box filter.
+	// The destination level has to be (srcW + 1) / 2 x (srcH + 1) / 2 pixels, the last row and column of odd-sized levels are clamped to the edge.
+	DLLRTUTIL void downsample_rgba32f(const float *src, uint32_t srcW, uint32_t srcH, float *dst, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+	DLLRTUTIL void downsample_rgba16f(const uint16_t *src, uint32_t srcW, uint32_t srcH, uint16_t *dst, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+
+	// Sums the squared differences between the (Rec. 709) luminance of two tightly packed RGBA float images, as well as the luminance of the first image
+	DLLRTUTIL void sum_luminance_difference_rgba32f(const float *a, const float *b, size_t pixelCount, double &outSquaredDifferenceSum, double &outLuminanceSum);
+
+	// Finds the first and last pixel with an alpha value above zero in a row of RGBA float pixels. Returns false if the row is fully transparent.
+	DLLRTUTIL bool find_visible_pixel_range_rgba32f(const float *row, uint32_t w, uint32_t &outFirst, uint32_t &outLast);
+	// Returns the index of the first pixel with an alpha value below one in a row of RGBA float pixels, or w if there is none
+	DLLRTUTIL uint32_t find_first_translucent_pixel_rgba32f(const float *row, uint32_t w);
+
+	// One dilation step for texel atlases (e.g. lightmaps) in RGBA float format. Every texel without a chart (chart id 0) that borders texels with a chart
+	// receives the average value of those 8-neighbors, and the chart id of the first one. dst and dstChartIds have to be copies of src and srcChartIds,
+	// only the newly filled texels are written. Returns the number of filled texels.
+	DLLRTUTIL uint32_t dilate_rgba32f(const float *src, const uint32_t *srcChartIds, float *dst, uint32_t *dstChartIds, uint32_t w, uint32_t h);
+
+	// Conversion between single and half precision floats (round to nearest even). Uses F16C instructions if they're enabled for the build or supported
+	// by the CPU, SSE2 otherwise. All paths produce the same results, apart from the payload of NaNs.
+	DLLRTUTIL void convert_float_to_half(const float *src, uint16_t *dst, size_t count);
+	DLLRTUTIL void convert_half_to_float(const uint16_t *src, float *dst, size_t count);
+	DLLRTUTIL uint16_t float_to_half(float f);
+	DLLRTUTIL float half_to_float(uint16_t h);
+};
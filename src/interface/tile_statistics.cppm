@@ -0,0 +1,88 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <cinttypes>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+
+export module pragma.scenekit:tile_statistics;
+
+export namespace pragma::scenekit {
+	// Lock-free latency histogram with logarithmic buckets. Every power of two is split into 16 linear sub-buckets,
+	// so percentiles have a relative error of at most ~6% over the entire nanosecond range.
+	class DLLRTUTIL LatencyHistogram {
+	  public:
+		static constexpr uint32_t SUB_BUCKET_BITS = 4;
+		static constexpr uint32_t SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+		static constexpr uint32_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+		void Record(std::chrono::nanoseconds t);
+		void Reset();
+		uint64_t GetCount() const { return m_count.load(std::memory_order_relaxed); }
+		std::chrono::nanoseconds GetTotal() const { return std::chrono::nanoseconds {m_total.load(std::memory_order_relaxed)}; }
+		std::chrono::nanoseconds GetMax() const { return std::chrono::nanoseconds {m_max.load(std::memory_order_relaxed)}; }
+		std::chrono::nanoseconds GetMean() const;
+		// Returns the upper bound of the bucket containing the specified percentile (in the range [0,100])
+		std::chrono::nanoseconds GetPercentile(double percentile) const;
+	  private:
+		static uint32_t GetBucketIndex(uint64_t value);
+		static uint64_t GetBucketUpperBound(uint32_t index);
+		std::array<std::atomic<uint64_t>, BUCKET_COUNT> m_buckets {};
+		std::atomic<uint64_t> m_count = 0;
+		std::atomic<uint64_t> m_total = 0;
+		std::atomic<uint64_t> m_max = 0;
+	};
+
+	// Per-stage latencies and throughput counters of the tile post-processing pipeline
+	class DLLRTUTIL TileStatistics {
+	  public:
+		enum class Stage : uint8_t {
+			Queued = 0,       // Time between a tile being added to the tile manager and a worker picking it up
+			Initialize,       // TileManager::InitializeTileData
+			PostProcess,      // TileManager::ApplyPostProcessingForProgressiveTile
+			AwaitingConsumer, // Time between post-processing being completed and the tile being retrieved through GetRenderedTileBatch
+			Total,            // Time between a tile being added to the tile manager and it being retrieved through GetRenderedTileBatch
+			Count
+		};
+		enum class Counter : uint8_t {
+			TilesReceived = 0,
+			TilesProcessed,
+			TilesDelivered,
+			TilesDiscarded,  // Tiles that were discarded by a worker because rendering was cancelled
+			TilesSuperseded, // Tiles that were skipped because a newer sample of the same tile had been queued
+			Count
+		};
+		using Gauge = std::pair<std::string_view, uint64_t>;
+		static std::string_view GetStageName(Stage stage);
+		static std::string_view GetCounterName(Counter counter);
+
+		TileStatistics();
+		void Record(Stage stage, std::chrono::nanoseconds t) { m_histograms[static_cast<size_t>(stage)].Record(t); }
+		void Increment(Counter counter, uint64_t n = 1) { m_counters[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed); }
+		const LatencyHistogram &GetHistogram(Stage stage) const { return m_histograms[static_cast<size_t>(stage)]; }
+		uint64_t GetCounter(Counter counter) const { return m_counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed); }
+		// Time since construction or the last reset
+		std::chrono::nanoseconds GetElapsedTime() const;
+		// Average count per second since construction or the last reset
+		double GetThroughput(Counter counter) const;
+		void Reset();
+		// Gauges are point-in-time values provided by the owner (e.g. queue depths), which are written alongside the statistics
+		std::string ToJson(const std::vector<Gauge> &gauges = {}) const;
+	  private:
+		std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> m_histograms {};
+		std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> m_counters {};
+		std::atomic<int64_t> m_startTime = 0;
+	};
+};
@@ -8,23 +8,50 @@
 module;
 
 #include "definitions.hpp"
+#include <util_image_types.hpp>
 #include <cinttypes>
 #include <vector>
-#include <mutex>
+#include <utility>
+#include <string>
 #include <array>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <mutex>
 #include <optional>
+#include <chrono>
+#include <condition_variable>
 #include <sharedutils/ctpl_stl.h>
 #include <mathutil/uvec.h>
 
 export module pragma.scenekit:tile_manager;
 
 import :constants;
+import :mpmc_queue;
+import :tile_buffer_pool;
+import :shared_framebuffer;
+import :tile_statistics;
 
 export namespace pragma::scenekit {
 	enum class ColorTransform : uint8_t;
+	enum class PassType : uint32_t;
 	class DLLRTUTIL TileManager {
 	  public:
+		// Additional render pass (arbitrary output variable) carried alongside the beauty pass of a tile
+		struct AovPlane {
+			PassType type {};
+			// Tightly packed RGBA data with the same dimensions and format as the beauty pass of the tile
+			std::vector<uint8_t> data;
+		};
+		enum class AovColorHandling : uint8_t {
+			None = 0,        // The data is passed through as is (e.g. albedo or depth)
+			ColorTransform,  // The same color transform as for the beauty pass is applied (e.g. lighting passes)
+			SignedToUnsigned // Maps [-1,1] to [0,1] for previews (e.g. normals)
+		};
+		struct AovInfo {
+			PassType type {};
+			AovColorHandling colorHandling = AovColorHandling::None;
+		};
 		struct TileData {
 			enum class Flags : uint8_t { None = 0, HDRData = 1, Initialized = HDRData << 1u };
 			uint16_t x = 0;
@@ -35,45 +62,196 @@ export namespace pragma::scenekit {
 			uint16_t index = std::numeric_limits<uint16_t>::max();
 			Flags flags = Flags::None;
 			std::vector<uint8_t> data;
+			// Time at which the tile was handed to the tile manager. Used for latency measurements,
+			// will be assigned automatically by AddInputTile if not set.
+			std::chrono::steady_clock::time_point arrivalTime {};
+			// Time at which post-processing of the tile was completed
+			std::chrono::steady_clock::time_point readyTime {};
+			std::vector<AovPlane> aovs;
+			const AovPlane *FindAov(PassType type) const;
+			// Size of the pixel data of all planes
+			size_t GetByteSize() const;
 			bool IsFloatData() const;
 			bool IsHDRData() const;
+			uimg::Format GetFormat() const;
 		};
 		struct ThreadData {};
 		enum class State : uint8_t { Initial = 0, Running, Cancelled, Stopped };
+		enum class UpdateMode : uint8_t {
+			Full = 0, // Stops all workers and re-applies all completed tiles
+			DirtyOnly // Only applies tiles that have changed since the last update, without stopping the workers
+		};
+		struct TileRect {
+			uint32_t x = 0;
+			uint32_t y = 0;
+			uint32_t w = 0;
+			uint32_t h = 0;
+		};
+		// Time between a tile being added to the tile manager and it being retrieved through GetRenderedTileBatch
+		struct LatencyInfo {
+			uint64_t tileCount = 0;
+			std::chrono::nanoseconds total {0};
+			std::chrono::nanoseconds max {0};
+			std::chrono::nanoseconds GetAverage() const { return (tileCount > 0) ? std::chrono::nanoseconds {total.count() / static_cast<int64_t>(tileCount)} : std::chrono::nanoseconds {0}; }
+		};
+		// Order in which tiles should be rendered. Tiles earlier in the order also take precedence during post-processing.
+		enum class TileOrder : uint8_t {
+			Scanline = 0,
+			Hilbert,
+			CenterOutSpiral,
+			FocusPointFirst // Closest tiles to the focus point (see SetTileOrder) first
+		};
+		static constexpr uint32_t PRIORITY_LEVEL_COUNT = 4;
+		// Number of times a non-empty lower priority queue can be passed over by the workers before it is served first, so that tiles
+		// with a low priority can't starve while the renderer keeps the higher priority queues saturated
+		static constexpr uint32_t MAX_PRIORITY_SKIP_COUNT = 16;
+		enum class StoragePrecision : uint8_t {
+			Full = 0, // 32-bit float
+			Half      // 16-bit float, halves the memory and bandwidth required for the progressive image and the completed tiles
+		};
+		// Determines what happens to new tiles when the rendered tile backlog (see GetRenderedTileBatch) has reached its memory limit
+		enum class BacklogPolicy : uint8_t {
+			DropOldest = 0, // The oldest tiles in the backlog are discarded
+			Block           // Workers wait until the backlog has been retrieved, which in turn stalls the renderer once the input queues are full
+		};
+		struct BacklogInfo {
+			size_t tileCount = 0;
+			size_t byteSize = 0;
+			uint64_t coalescedTileCount = 0; // Tiles that have replaced an older sample of the same tile in the backlog
+			uint64_t droppedTileCount = 0;   // Tiles that have been discarded due to the memory limit
+		};
+		struct Settings {
+			static constexpr uint32_t AUTO_WORKER_COUNT = 0;
+			// Number of post-processing worker threads. If set to AUTO_WORKER_COUNT, the count will be determined from the hardware concurrency
+			// and the render device (CPU renders leave less room for post-processing), or the number of cores in workerCpuAffinity if specified.
+			uint32_t workerCount = AUTO_WORKER_COUNT;
+			// Logical cores the workers are allowed to run on, e.g. to keep post-processing away from the cores used by the renderer. Empty = no restriction.
+			// Only supported on Linux and Windows, ignored on other platforms.
+			std::vector<uint32_t> workerCpuAffinity;
+			// Precision of the progressive image (as returned by UpdateFinalImage) and the completed tiles.
+			// Tiles retrieved through GetRenderedTileBatch are not affected.
+			StoragePrecision storagePrecision = StoragePrecision::Full;
+			// Maximum size of the pixel data of all tiles in the rendered tile backlog in bytes, 0 = unlimited.
+			// Only the latest sample of each tile is kept in the backlog, so it will never contain more than one entry per tile.
+			size_t renderedTileMemoryLimit = 0;
+			BacklogPolicy backlogPolicy = BacklogPolicy::DropOldest;
+			// If specified, every post-processed tile will also be published to a shared framebuffer, which allows viewers in other processes
+			// to display the progressive image without any copies through the host application.
+			std::optional<SharedFramebuffer::CreateInfo> sharedFramebuffer {};
+			// Number of downsampled preview levels of the progressive image (each half the resolution of the previous one) to maintain, 0 = disabled.
+			// The levels are updated incrementally by UpdateFinalImage for every changed tile.
+			uint32_t previewLevelCount = 0;
+			// AOVs which are expected to arrive with the input tiles. Every AOV gets its own progressive image, and is post-processed according to its color handling.
+			// AOV planes of other types are passed through without any post-processing.
+			std::vector<AovInfo> aovs;
+		};
 		~TileManager();
-		void Initialize(uint32_t w, uint32_t h, uint32_t wTile, uint32_t hTile, bool cpuDevice, float exposure = 0.f, float gamma = DEFAULT_GAMMA, util::ocio::ColorProcessor *optColorProcessor = nullptr);
+		void Initialize(uint32_t w, uint32_t h, uint32_t wTile, uint32_t hTile, bool cpuDevice, float exposure = 0.f, float gamma = DEFAULT_GAMMA, util::ocio::ColorProcessor *optColorProcessor = nullptr, const Settings &settings = {});
 		void Reload(bool waitForCompletion);
 		void Cancel();
 		void Wait();
 		void StopAndWait();
-		std::shared_ptr<uimg::ImageBuffer> UpdateFinalImage();
+		// If optOutDirtyRects is specified, it will receive the image regions that have been changed by the update
+		std::shared_ptr<uimg::ImageBuffer> UpdateFinalImage(UpdateMode mode = UpdateMode::Full, std::vector<TileRect> *optOutDirtyRects = nullptr);
 		std::vector<TileData> GetRenderedTileBatch();
 		void AddRenderedTile(TileData &&tile);
+		// Queues a tile rendered by the renderer for post-processing and wakes up a worker thread
+		void AddInputTile(TileData &&tile);
+		// Leases a pixel buffer for an input tile from the tile buffer pool
+		std::vector<uint8_t> AcquireTileBuffer(uint32_t w, uint32_t h, uimg::Format format = uimg::Format::RGBA_FLOAT);
+		// Returns the pixel buffers of tiles retrieved through GetRenderedTileBatch to the tile buffer pool
+		void ReleaseTileBatch(std::vector<TileData> &&tiles);
+		void ReleaseTile(TileData &&tile);
+		TileBufferPool &GetTileBufferPool() { return m_tileBufferPool; }
+		const TileBufferPool &GetTileBufferPool() const { return m_tileBufferPool; }
+		// Returns nullptr if no shared framebuffer was requested, or if it could not be created
+		SharedFramebuffer *GetSharedFramebuffer() { return m_sharedFramebuffer.get(); }
+		BacklogInfo GetBacklogInfo() const;
+		// Thread-safe. Copies the completed tiles (raw data without color transform) whose revision differs from inOutRevisions into outImage,
+		// and their AOV planes into the images of the matching pass types. The images have to have the resolution and format of the progressive image.
+		// inOutRevisions is resized to the tile count if necessary and receives the revisions of the copied tiles. Returns the destination rects of the copied tiles.
+		std::vector<TileRect> CopyCompletedTiles(std::vector<uint32_t> &inOutRevisions, uimg::ImageBuffer &outImage, const std::vector<std::pair<PassType, uimg::ImageBuffer *>> &aovImages = {});
+		util::ocio::ColorProcessor *GetColorTransformProcessor() const { return m_colorTransformProcessor.get(); }
+		// AOVs carried alongside the beauty pass, as specified in the settings
+		const std::vector<AovInfo> &GetAovs() const { return m_aovs; }
+		// Returns nullptr if the AOV hasn't been specified in the settings. Like the beauty image, the AOV images are only modified by UpdateFinalImage.
+		std::shared_ptr<uimg::ImageBuffer> GetProgressiveAovImage(PassType type) const;
+		// Number of preview levels including level 0, which is the progressive image itself
+		uint32_t GetPreviewLevelCount() const { return static_cast<uint32_t>(m_previewLevels.size()) + 1; }
+		// Returns nullptr if the level doesn't exist. Like the progressive image, the levels are only modified by UpdateFinalImage.
+		std::shared_ptr<uimg::ImageBuffer> GetPreviewLevel(uint32_t level) const;
+		// Collects the regions of a preview level that have changed since the specified revision (0 = all regions that have been rendered so far).
+		// Returns the current revision, which should be passed to the next call.
+		uint64_t GetPreviewDirtyRects(uint32_t level, uint64_t sinceRevision, std::vector<TileRect> &outRects) const;
+		LatencyInfo GetLatencyInfo() const;
+		// Resets all statistics, including the per-stage latencies
+		void ResetLatencyInfo();
+		const TileStatistics &GetStatistics() const { return m_statistics; }
+		void ResetStatistics() { m_statistics.Reset(); }
+		// Statistics as JSON, including the current queue depths and backlog size
+		std::string GetStatisticsJson() const;
 		Vector2i GetTileSize() const { return m_tileSize; }
 		uint32_t GetTileCount() const { return m_numTiles; }
 		Vector2i GetTilesPerAxisCount() const { return m_numTilesPerAxis; }
 		float GetExposure() const { return m_exposure; }
 		float GetGamma() const { return m_gamma; }
 		bool IsCpuDevice() const { return m_cpuDevice; }
+		StoragePrecision GetStoragePrecision() const { return m_storagePrecision; }
+		uint32_t GetWorkerCount() const { return static_cast<uint32_t>(m_ppThreadPoolHandles.size()); }
 		int32_t GetCurrentTileSampleCount(uint32_t tileIndex) const;
+		static constexpr float NO_NOISE_ESTIMATE = -1.f;
+		// Estimated relative noise (standard error of the mean luminance divided by the mean luminance) of every tile, indexed by tile index.
+		// The estimate is derived from the change between consecutive progressive samples, so tiles need at least two samples to have one.
+		std::vector<float> GetConvergenceMap() const;
+		float GetTileNoiseLevel(uint32_t tileIndex) const;
+		// Returns the indices of all tiles whose noise level is above the threshold, or which don't have an estimate yet
+		std::vector<uint32_t> GetTilesAboveNoiseThreshold(float threshold) const;
 		uint32_t GetTilesWithRenderedSamplesCount() const { return m_numTilesWithRenderedSamples; }
 		bool AllTilesHaveRenderedSamples() const { return GetTilesWithRenderedSamplesCount() == GetTileCount(); }
 		void SetFlipImage(bool flipHorizontally, bool flipVertically);
 		void SetExposure(float exposure);
 		void SetGamma(float gamma);
 		void SetUseFloatData(bool b);
+		// focusPoint is in normalized coordinates of the final (flipped) image, with {0,0} being the top left
+		void SetTileOrder(TileOrder order, const Vector2 &focusPoint = {0.5f, 0.5f});
+		TileOrder GetTileOrder() const;
+		// Tile indices in the order in which the renderer should dispatch them (tile indices are expected to be in row-major order)
+		std::vector<uint32_t> GetTileDispatchOrder() const;
+		// Returns the position of the tile in the dispatch order, lower means higher priority
+		uint32_t GetTileRank(uint32_t tileIndex) const;
 
 		void ApplyPostProcessingForProgressiveTile(TileData &data);
 
-		// For internal use only
-		std::vector<TileData> &GetInputTiles() { return m_inputTiles; }
-		std::mutex &GetInputTileMutex() { return m_inputTileMutex; }
-		std::queue<size_t> &GetInputTileQueue() { return m_inputTileQueue; }
+		// Legacy interface, new code should use AddInputTile: Renderers that still write tiles to GetInputTiles() and push their index to GetInputTileQueue()
+		// (with GetInputTileMutex() locked) have to call NotifyPendingWork afterwards, which forwards the queued tiles to AddInputTile.
+		// Not marked as [[deprecated]] yet, since the Cycles backend still uses it and has to stay warning-free until it has been migrated.
+		std::vector<TileData> &GetInputTiles() { return m_legacyInputTiles; }
+		std::mutex &GetInputTileMutex() { return m_legacyInputTileMutex; }
+		std::queue<size_t> &GetInputTileQueue() { return m_legacyInputTileQueue; }
 		void NotifyPendingWork();
 	  private:
 		void ApplyRectData(const TileData &data);
+		void ApplyRectData(const TileData &tile, const std::vector<uint8_t> &data, uimg::ImageBuffer &dstImage, bool clearAlpha);
+		const AovInfo *FindAovInfo(PassType type, uint32_t *optOutIndex = nullptr) const;
+		TileRect GetDestinationRect(const TileData &data) const;
+		TileRect GetPreviewLevelRect(const TileRect &rect, uint32_t level) const;
+		void UpdatePreviewLevels(const TileRect &rect);
+		void StoreCompletedTile(const TileData &tile);
+		void UpdateNoiseEstimate(const TileData &previousTile, const TileData &tile);
+		void UpdateTilePriorities();
+		bool PopInputTile(TileData &outTile);
+		bool HasPendingInputTiles() const;
+		// Returns true if a newer sample of the tile has been queued in the meantime
+		bool IsSupersededInputTile(const TileData &tile) const;
+		void ForwardLegacyInputTiles();
+		// m_renderedTileMutex has to be locked
+		void PushRenderedTile(TileData &&tile, std::unique_lock<std::mutex> &lock);
+		void DropOldestRenderedTile();
 		void InitializeTileData(TileData &data);
 		void SetState(State state);
+		void InitializeThreadPool(const Settings &settings);
+		void ProcessTile(TileData &tile);
+		void RecordLatency(const TileData &tile, std::chrono::steady_clock::time_point t);
 
 		Vector2i m_tileSize;
 		uint32_t m_numTiles = 0;
@@ -86,25 +264,79 @@ export namespace pragma::scenekit {
 		std::shared_ptr<util::ocio::ColorProcessor> m_colorTransformProcessor = nullptr;
 
 		bool m_useFloatData = false;
+		StoragePrecision m_storagePrecision = StoragePrecision::Full;
 		bool m_cpuDevice = false;
-		std::atomic<bool> m_hasPendingWork = false;
-		std::mutex m_inputTileMutex;
-		std::vector<TileData> m_inputTiles; // Tiles that have been updated by Cycles, but still require post-processing
-		std::queue<size_t> m_inputTileQueue;
+		TileBufferPool m_tileBufferPool;
+		std::unique_ptr<SharedFramebuffer> m_sharedFramebuffer = nullptr;
+		// Preview levels 1 to n, in the same format as the progressive image
+		std::vector<std::shared_ptr<uimg::ImageBuffer>> m_previewLevels;
+		std::vector<TileRect> m_previewTileRects; // Destination rect of every tile in level 0
+		std::vector<uint64_t> m_previewTileRevisions;
+		uint64_t m_previewRevision = 0;
+		mutable std::mutex m_previewMutex;
+		// Tiles that have been updated by Cycles, but still require post-processing, one queue per priority level
+		std::array<MpmcQueue<TileData>, PRIORITY_LEVEL_COUNT> m_inputTileQueues;
+		// Sample + 1 of the newest queued tile of every tile index (0 = none). Older samples that are still queued are skipped by the workers.
+		std::vector<std::atomic<uint32_t>> m_latestInputSamples;
+		// Producers wait on this condition while the input queue is full. Workers only notify it if m_blockedProducerCount is non-zero.
+		std::mutex m_inputSpaceMutex;
+		std::condition_variable m_inputSpaceCondition;
+		std::atomic<uint32_t> m_blockedProducerCount = 0;
+		std::mutex m_legacyInputTileMutex;
+		std::vector<TileData> m_legacyInputTiles;
+		std::queue<size_t> m_legacyInputTileQueue;
+
+		// Number of tiles that have been popped from higher priority queues while the queue of that level wasn't empty
+		std::array<std::atomic<uint32_t>, PRIORITY_LEVEL_COUNT> m_inputQueueSkipCounts {};
+
+		// m_tileOrderMutex has to be locked when accessing the tile order, focus point, dispatch order, ranks or priority levels
+		TileOrder m_tileOrder = TileOrder::Scanline;
+		Vector2 m_focusPoint {0.5f, 0.5f};
+		mutable std::mutex m_tileOrderMutex;
+		std::vector<uint32_t> m_tileDispatchOrder;
+		std::vector<uint32_t> m_tileRanks;
+		std::vector<std::atomic<uint8_t>> m_tilePriorityLevels;
 		bool m_flipHorizontally = false;
 		bool m_flipVertically = false;
 
-		std::mutex m_renderedTileMutex;
-		std::vector<TileData> m_renderedTiles;
-		std::array<std::future<void>, 10> m_ppThreadPoolHandles;
-		ctpl::thread_pool m_ppThreadPool {static_cast<int32_t>(m_ppThreadPoolHandles.size())};
+		static constexpr uint64_t NO_RENDERED_TILE_SLOT = std::numeric_limits<uint64_t>::max();
+		mutable std::mutex m_renderedTileMutex;
+		std::condition_variable m_renderedTileCondition;
+		// Oldest tile first, so that dropping the oldest tile doesn't have to move the others
+		std::deque<TileData> m_renderedTiles;
+		// Tile index -> Sequence number of the tile in m_renderedTiles. Sequence numbers remain stable when tiles are dropped,
+		// the position in m_renderedTiles is the sequence number minus m_renderedTileSequenceBase.
+		std::vector<uint64_t> m_renderedTileSlots;
+		uint64_t m_renderedTileSequenceBase = 0; // Sequence number of the front of m_renderedTiles
+		size_t m_renderedTileBytes = 0;
+		size_t m_renderedTileMemoryLimit = 0;
+		BacklogPolicy m_backlogPolicy = BacklogPolicy::DropOldest;
+		std::atomic<uint64_t> m_coalescedRenderedTileCount = 0;
+		std::atomic<uint64_t> m_droppedRenderedTileCount = 0;
+		TileStatistics m_statistics;
+		std::vector<std::future<void>> m_ppThreadPoolHandles;
+		ctpl::thread_pool m_ppThreadPool {};
+		// Worker threads sleep on this condition until new tiles have been queued or the state has changed.
+		// m_state must only be changed while m_threadWaitMutex is locked, and producers have to lock it after pushing
+		// to the input queue before notifying, otherwise wake-ups could get lost.
 		std::condition_variable m_threadWaitCondition {};
 		std::mutex m_threadWaitMutex {};
 		std::atomic<State> m_state = State::Initial;
+		// Incremented (while m_threadWaitMutex is locked) whenever a tile has been pushed to an input queue
+		std::atomic<uint64_t> m_inputTileGeneration = 0;
 
 		std::mutex m_completedTileMutex;
 		std::vector<TileData> m_completedTiles;
+		// Incremented whenever a completed tile is replaced with a newer sample
+		std::vector<uint32_t> m_completedTileRevisions;
+		// Revision of each completed tile that was last applied to the progressive image
+		std::vector<uint32_t> m_appliedTileRevisions;
+		// Estimated per-pixel luminance variance of a single sample, averaged over the tile. Negative if there's no estimate yet.
+		std::vector<float> m_tilePixelVariances;
+		std::vector<std::atomic<float>> m_tileNoiseLevels;
 		std::shared_ptr<uimg::ImageBuffer> m_progressiveImage = nullptr;
+		std::vector<AovInfo> m_aovs;
+		std::vector<std::shared_ptr<uimg::ImageBuffer>> m_progressiveAovImages; // Same order as m_aovs
 	};
 };
 export { REGISTER_BASIC_BITWISE_OPERATORS(pragma::scenekit::TileManager::TileData::Flags) }
@@ -12,12 +12,18 @@ export import :exception;
 export import :light;
 export import :mesh;
 export import :model_cache;
+export import :mpmc_queue;
 export import :object;
+export import :progressive_denoiser;
 export import :renderer;
 export import :scene;
 export import :scene_object;
 export import :shader;
 export import :shader_nodes;
+export import :shared_framebuffer;
 export import :subdivision;
+export import :tile_kernels;
+export import :tile_buffer_pool;
 export import :tile_manager;
+export import :tile_statistics;
 export import :world_object;